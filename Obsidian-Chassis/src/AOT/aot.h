@@ -0,0 +1,203 @@
+/*
+ * aot.h
+ *
+ * Runtime support for C++ translation units generated by vm2cpp.
+ *
+ * A translated program operates on the same vcontext registers, stack 
+ * and virtual data section semantics as VM::execute, without any 
+ * fetch, decode or dispatch at run time.
+ */
+
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "err.h"
+#include "rc4.h"
+#include "vm.h"
+
+/*
+ * Accessors used by the generated code.
+ */
+#define VREG(x) (s.ctx.vreg[x])
+#define VFLAGS (s.ctx.veflags)
+#define VVEC(x) (s.ctx.vvec[x])
+#define VDATA(type, addr) (*(type *)&s.vdata[addr])
+
+/*
+ * State of a translated program.
+ */
+typedef struct _vaot {
+	vcontext ctx;					// Registers, stack pointer and EFLAGS.
+	std::vector<uint8_t> vdata;		// Virtual data section.
+	std::vector<uint32_t> vstack;	// Virtual stack section.
+	RC4 rc4;						// RC4 state for VM_RC4K/VM_RC4C.
+	AES aes;						// AES key schedule for VM_AESK.
+	REG target;						// Target of a register indirect jump.
+	uint32_t error;					// Error code of the fault that stopped the program.
+
+	_vaot(const std::vector<uint8_t>& data) : ctx(), vdata(VM_DATA_LIMIT), vstack(VM_STACK_SIZE), target(0), error(0) {
+		ctx.veflags.clear();
+		memcpy(vdata.data(), data.data(), data.size() < vdata.size() ? data.size() : vdata.size());
+	}
+
+	/*
+	 * Stop the program with an error code.
+	 */
+	bool fault(const uint32_t code) {
+		error = code;
+		return false;
+	}
+
+	/*
+	 * Stack operations as done by the VM handlers.
+	 */
+	bool push(const uint32_t value) {
+		if (ctx.vsp == vstack.size())
+			return fault(ERR_STACK_OVERFLOW);
+		vstack[ctx.vsp++] = value;
+		return true;
+	}
+
+	bool pop(uint32_t& value) {
+		if (ctx.vsp == 0)
+			return fault(ERR_STACK_UNDERFLOW);
+		value = vstack[--ctx.vsp];
+		return true;
+	}
+
+	bool pushad() {
+		if (vstack.size() - ctx.vsp < NUM_REGISTERS)
+			return fault(ERR_STACK_OVERFLOW);
+		memcpy(&vstack[ctx.vsp], ctx.vreg, sizeof(ctx.vreg));
+		ctx.vsp += NUM_REGISTERS;
+		return true;
+	}
+
+	bool popad() {
+		if (ctx.vsp < NUM_REGISTERS)
+			return fault(ERR_STACK_UNDERFLOW);
+		ctx.vsp -= NUM_REGISTERS;
+		memcpy(ctx.vreg, &vstack[ctx.vsp], sizeof(ctx.vreg));
+		return true;
+	}
+
+	/*
+	 * VM_RC4M. Faults if a key, the input or an output is outside the
+	 * data section.
+	 */
+	bool rc4m(const REG keys, const REG in, const REG out, const uint32_t length, const uint32_t kl, const uint32_t count) {
+		uint8_t *k[RC4_STREAMS], *o[RC4_STREAMS];
+
+		if (!within(in, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+
+		for (uint32_t s = 0; s < count;) {
+			uint32_t n = 0;
+
+			for (; n < RC4_STREAMS && s < count; n++, s++) {
+				const REG key = keys + s * kl, output = out + s * length;
+
+				if (!within(key, kl ? kl : 1) || !within(output, length))
+					return fault(ERR_DATA_OUT_OF_BOUNDS);
+				k[n] = &vdata[key];
+				o[n] = &vdata[output];
+			}
+			RC4::cipher_streams(n, k, kl, &vdata[in], length, o);
+		}
+		return true;
+	}
+
+	/*
+	 * Bulk memory opcodes. Fault if a range is outside the data section.
+	 */
+	bool copy(const REG dst, const REG src, const REG length) {
+		if (!within(dst, length) || !within(src, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		memmove(&vdata[dst], &vdata[src], length);
+		return true;
+	}
+
+	bool fill(const REG dst, const REG value, const REG length) {
+		if (!within(dst, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		memset(&vdata[dst], (uint8_t)value, length);
+		return true;
+	}
+
+	bool compare(REG& index, const REG a, const REG b, const REG length) {
+		if (!within(a, length) || !within(b, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		index = mem_mismatch(&vdata[a], &vdata[b], length);
+		if (index < length)
+			ctx.veflags.sub(vdata[a + index], vdata[b + index]);
+		else
+			ctx.veflags.sub(0, 0);
+		return true;
+	}
+
+	bool find(REG& index, const REG data, const REG value, const REG length) {
+		if (!within(data, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		index = mem_find(&vdata[data], (uint8_t)value, length);
+		ctx.veflags.sub(index, length);
+		return true;
+	}
+
+	/*
+	 * Crypto opcodes. Fault if a range is outside the data section.
+	 */
+	bool aesk(const REG key, const uint32_t length) {
+		if (!within(key, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		aes.set_key(&vdata[key], length);
+		return true;
+	}
+
+	bool aes_blocks(const REG in, const REG out, const REG blocks, const bool decrypt) {
+		if (!within(in, (uint64_t)blocks * AES_BLOCK_SIZE) || !within(out, (uint64_t)blocks * AES_BLOCK_SIZE))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		if (decrypt)
+			aes.decrypt(&vdata[in], &vdata[out], blocks);
+		else
+			aes.encrypt(&vdata[in], &vdata[out], blocks);
+		return true;
+	}
+
+	bool aesctr(const REG in, const REG out, const REG length, const REG counter) {
+		if (!within(in, length) || !within(out, length) || !within(counter, AES_BLOCK_SIZE))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		aes.ctr(&vdata[in], &vdata[out], length, &vdata[counter]);
+		return true;
+	}
+
+	bool crc(REG& value, const REG data, const REG length) {
+		if (!within(data, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		value = crc32c(value, &vdata[data], length);
+		return true;
+	}
+
+	bool sha(const REG digest, const REG data, const REG length) {
+		if (!within(digest, SHA256_DIGEST_SIZE) || !within(data, length))
+			return fault(ERR_DATA_OUT_OF_BOUNDS);
+		sha256(&vdata[data], length, &vdata[digest]);
+		return true;
+	}
+
+	bool within(const REG addr, const uint64_t length) const {
+		return (uint64_t)addr + length <= vdata.size();
+	}
+} vaot;
+
+/*
+ * Entry point of a translated program. Returns vreg[0] like VM::start. 
+ * s.error is non-zero if the program stopped on a fault.
+ */
+uint32_t aot_start(vaot& s);
+
+#endif // !__AOT_H__
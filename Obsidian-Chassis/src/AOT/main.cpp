@@ -0,0 +1,26 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "aot.h"
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    std::vector<uint8_t> data;
+    vaot s(data);
+    aot_start(s);
+
+    /*
+     * Exit with the error code like VM::panic.
+     */
+    if (s.error) {
+#ifdef DEBUG
+        std::cerr << "[-] Error (0x" << std::hex << s.error << std::dec << "): " << strerr(s.error) << ".\n";
+#endif
+        return s.error;
+    }
+
+    return 0;
+}
@@ -0,0 +1,563 @@
+/*
+ * vm2cpp.cpp
+ *
+ * Ahead-of-time translator from an assembled code section to C++.
+ *
+ * The code section is decoded with the same decoder as the VM and
+ * every routine (the entry point and each call target) becomes one C++
+ * function. Instructions become straight-line statements on the vaot
+ * state (see aot.h) and immediate branch targets become labels, so the
+ * host compiler can allocate registers and optimise across the whole
+ * routine with no fetch or dispatch left at run time.
+ *
+ * Limitations:
+ *   - Register indirect jumps are lowered to a switch over the
+ *     instructions of the current routine. Routines containing them
+ *     also include every instruction whose offset is loaded with
+ *     vm_movi or vm_pushi.
+ *   - A vm_ret must return to the instruction after its vm_call.
+ *     Any other return address stops the program.
+ *   - vm_passthru stops the program since the native code is not
+ *     part of the translation.
+ *
+ * Usage: vm2cpp [-s START] [-l LENGTH] [-o OUT.cpp] FILE.bin
+ *
+ * FILE.bin is the raw code section, e.g. the .text section of an
+ * object assembled from a .vasm file. START and LENGTH select the code
+ * section within the file (defaults to the whole file).
+ */
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "container.h"
+#include "decode.h"
+#include "err.h"
+#include "opcodes.h"
+#include "vm.h"
+
+/*
+ * Routine return address used for the entry point. No vm_call pushes
+ * this value so a vm_ret from the entry routine never matches it.
+ */
+#define AOT_NO_RETURN "UINT32_MAX"
+
+typedef struct _vroutine {
+    uint32_t entry;                 // Decoded index of the first instruction.
+    std::set<uint32_t> insns;       // Decoded indices of the instructions reachable in the routine.
+    bool indirect;                  // Contains a register indirect jump.
+} vroutine;
+
+static vstream stream;
+static uint32_t end;                // Decoded index of the end of code sentinel.
+static FILE *out;
+
+/*
+ * Name of the label or function for a decoded index.
+ */
+static std::string label(const char *prefix, const uint32_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s_%04x", prefix, stream.vaddr[index]);
+    return name;
+}
+
+/*
+ * Error code of a branch to a sentinel index.
+ */
+static uint32_t fault(const uint32_t index) {
+    return stream.insns[index].imm;
+}
+
+/*
+ * Condition tested by a conditional jump on the lazy EFLAGS.
+ */
+static const char *condition(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_JE:   case VM_JEI:      return "VFLAGS.zero()";
+        case VM_JNE:  case VM_JNEI:     return "!VFLAGS.zero()";
+        case VM_JL:   case VM_JLI:      return "VFLAGS.less()";
+        case VM_JLE:  case VM_JLEI:     return "VFLAGS.less_equal()";
+        case VM_JNL:  case VM_JNLI:     return "!VFLAGS.less()";
+        case VM_JNLE: case VM_JNLEI:    return "!VFLAGS.less_equal()";
+        case VM_JB:   case VM_JBI:
+        case VM_JC:   case VM_JCI:      return "VFLAGS.carry()";
+        case VM_JBE:  case VM_JBEI:     return "VFLAGS.below_equal()";
+        case VM_JNB:  case VM_JNBI:
+        case VM_JNC:  case VM_JNCI:     return "!VFLAGS.carry()";
+        case VM_JNBE: case VM_JNBEI:    return "!VFLAGS.below_equal()";
+        case VM_JS:   case VM_JSI:      return "VFLAGS.sign()";
+        case VM_JNS:  case VM_JNSI:     return "!VFLAGS.sign()";
+        case VM_JO:   case VM_JOI:      return "VFLAGS.overflow()";
+        case VM_JNO:  case VM_JNOI:     return "!VFLAGS.overflow()";
+        default:                        return "true";
+    }
+}
+
+static bool falls_through(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_HLT:
+        case VM_JMP:
+        case VM_JMPI:
+        case VM_RET:
+        case VM_FAULT:
+        case VM_PASSTHRU:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+/*
+ * Collect the instructions reachable from the routine entry without
+ * following calls.
+ */
+static void walk(vroutine& routine, const std::vector<uint32_t>& loaded) {
+    std::vector<uint32_t> work = { routine.entry };
+
+    while (!work.empty()) {
+        const uint32_t i = work.back();
+        work.pop_back();
+
+        if (i >= end || !routine.insns.insert(i).second)
+            continue;
+
+        const vinsn& insn = stream.insns[i];
+
+        if (insn.opcode == VM_JMPI || insn.opcode == VM_JMP || insn_is_jcc(insn.opcode)) {
+            if (insn_has_target(insn))
+                work.push_back(insn.target);
+            else if (!routine.indirect) {
+                routine.indirect = true;
+                work.insert(work.end(), loaded.begin(), loaded.end());
+            }
+        }
+
+        if (falls_through(insn.opcode))
+            work.push_back(i + 1);
+    }
+}
+
+/*
+ * Emit a jump to a decoded index from within a routine.
+ */
+static void jump(const uint32_t index, const char *indent) {
+    if (index >= end)
+        fprintf(out, "%sreturn s.fault(%u);\n", indent, fault(index));
+    else
+        fprintf(out, "%sgoto %s;\n", indent, label("L", index).c_str());
+}
+
+/*
+ * Emit a bounds check on a register address operand. The VM faults on 
+ * the same accesses through the guard pages of its data section. 
+ * Immediate addresses are below 0x100 and always in bounds.
+ */
+static void check(const uint8_t reg, const size_t width) {
+    fprintf(out, "    if (VREG(%u) > s.vdata.size() - %zu) return s.fault(%u);\n", reg, width, ERR_DATA_OUT_OF_BOUNDS);
+}
+
+static void emit(const vinsn& insn) {
+    const unsigned a = insn.ra, b = insn.rb;
+
+    switch (insn.opcode) {
+        case VM_MOV:    fprintf(out, "    VREG(%u) = VREG(%u);\n", a, b); break;
+        case VM_MOVI:   fprintf(out, "    VREG(%u) = 0x%xu;\n", a, insn.imm); break;
+        case VM_ADD:    fprintf(out, "    VREG(%u) = ADD(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_ADDI:   fprintf(out, "    VREG(%u) = ADD(VREG(%u), 0x%xu);\n", a, a, insn.imm); break;
+        case VM_ADC:    fprintf(out, "    VREG(%u) = ADC(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_INC:    fprintf(out, "    VREG(%u) += 1;\n", a); break;
+        case VM_DEC:    fprintf(out, "    VREG(%u) -= 1;\n", a); break;
+        case VM_LEA:    fprintf(out, "    VREG(%u) = VREG(%u);\n", a, b); break;
+        case VM_NEG:    fprintf(out, "    VREG(%u) = NEG(VREG(%u));\n", a, a); break;
+        case VM_NOT:    fprintf(out, "    VREG(%u) = NOT(VREG(%u));\n", a, a); break;
+        case VM_OR:     fprintf(out, "    VREG(%u) = OR(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_AND:    fprintf(out, "    VREG(%u) = AND(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_NOR:    fprintf(out, "    VREG(%u) = NOR(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_XOR:    fprintf(out, "    VREG(%u) = XOR(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_XORI:   fprintf(out, "    VREG(%u) = XOR(VREG(%u), 0x%xu);\n", a, a, insn.imm); break;
+        case VM_SHR:    fprintf(out, "    VREG(%u) >>= VREG(%u);\n", a, b); break;
+        case VM_SHL:    fprintf(out, "    VREG(%u) <<= VREG(%u);\n", a, b); break;
+        case VM_DIV:
+            fprintf(out, "    if (VREG(%u) == 0) return s.fault(%u);\n", b, ERR_DIVIDE_BY_ZERO);
+            fprintf(out, "    VREG(%u) /= VREG(%u);\n", a, b);
+            break;
+
+        case VM_IDIV:
+            fprintf(out, "    if (VREG(%u) == 0) return s.fault(%u);\n", b, ERR_DIVIDE_BY_ZERO);
+            fprintf(out, "    VREG(%u) /= (IMM32)VREG(%u);\n", a, b);
+            break;
+
+        case VM_MUL:    fprintf(out, "    VREG(%u) *= VREG(%u);\n", a, b); break;
+        case VM_IMUL:   fprintf(out, "    VREG(%u) *= (IMM32)VREG(%u);\n", a, b); break;
+        case VM_NOP:    break;
+
+        case VM_SUB:    fprintf(out, "    VREG(%u) = VFLAGS.sub(VREG(%u), VREG(%u));\n", a, a, b); break;
+        case VM_SUBI:   fprintf(out, "    VREG(%u) = VFLAGS.sub(VREG(%u), 0x%xu);\n", a, a, insn.imm); break;
+        case VM_CMP:    fprintf(out, "    VFLAGS.sub(VREG(%u), 0x%xu);\n", a, insn.imm); break;
+        case VM_TEST:   fprintf(out, "    VFLAGS.test(AND(VREG(%u), VREG(%u)));\n", a, b); break;
+
+        case VM_XCHG:
+            fprintf(out, "    VREG(%u) = XOR(VREG(%u), VREG(%u));\n", a, a, b);
+            fprintf(out, "    VREG(%u) = XOR(VREG(%u), VREG(%u));\n", b, b, a);
+            fprintf(out, "    VREG(%u) = XOR(VREG(%u), VREG(%u));\n", a, a, b);
+            break;
+
+        case VM_PUSH:   fprintf(out, "    if (!s.push(VREG(%u))) return false;\n", a); break;
+        case VM_PUSHI:  fprintf(out, "    if (!s.push(0x%xu)) return false;\n", insn.imm); break;
+        case VM_POP:    fprintf(out, "    if (!s.pop(VREG(%u))) return false;\n", a); break;
+        case VM_PUSHAD: fprintf(out, "    if (!s.pushad()) return false;\n"); break;
+        case VM_POPAD:  fprintf(out, "    if (!s.popad()) return false;\n"); break;
+
+        case VM_SBB:
+        case VM_SAR:
+        case VM_SAL:
+        case VM_MOD:
+        case VM_PASSTHRU:
+            fprintf(out, "    return s.fault(%u);\n", ERR_OPCODE_UNIMPLEMENTED);
+            break;
+
+        case VM_LOADB:  check(b, 1); fprintf(out, "    VREG(%u) = VDATA(IMM8, VREG(%u));\n", a, b); break;
+        case VM_LOADBI: fprintf(out, "    VREG(%u) = VDATA(IMM8, %u);\n", a, b); break;
+        case VM_LOADW:  check(b, 2); fprintf(out, "    VREG(%u) = VDATA(IMM16, VREG(%u));\n", a, b); break;
+        case VM_LOADWI: fprintf(out, "    VREG(%u) = VDATA(IMM16, %u);\n", a, b); break;
+        case VM_LOADD:  check(b, 4); fprintf(out, "    VREG(%u) = VDATA(IMM32, VREG(%u));\n", a, b); break;
+        case VM_LOADDI: fprintf(out, "    VREG(%u) = VDATA(IMM32, %u);\n", a, b); break;
+        case VM_STORB:  fprintf(out, "    VDATA(IMM8, %u) = (IMM8)VREG(%u);\n", a, b); break;
+        case VM_STORBI: fprintf(out, "    VDATA(IMM8, %u) = (IMM8)0x%xu;\n", a, insn.imm); break;
+        case VM_STORW:  fprintf(out, "    VDATA(IMM16, %u) = (IMM16)VREG(%u);\n", a, b); break;
+        case VM_STORWI: fprintf(out, "    VDATA(IMM16, %u) = (IMM16)0x%xu;\n", a, insn.imm); break;
+        case VM_STORD:  fprintf(out, "    VDATA(IMM32, %u) = (IMM32)VREG(%u);\n", a, b); break;
+        case VM_STORDI: fprintf(out, "    VDATA(IMM32, %u) = 0x%xu;\n", a, insn.imm); break;
+
+        case VM_RC4K:
+            fprintf(out, "    s.rc4.set_for_cipher(0x%xu, &s.vdata[%u]);\n", insn.imm, a);
+            break;
+
+        case VM_RC4C:
+            fprintf(out, "    s.rc4.cipher(&s.vdata[%u], 0x%xu, &s.vdata[%u], &s.vdata[%u]);\n", a, insn.imm, b, insn.rc);
+            break;
+
+        case VM_VLOAD:
+            check(b, VECTOR_SIZE);
+            fprintf(out, "    vec_load(VVEC(%u), &s.vdata[VREG(%u)]);\n", a, b);
+            break;
+
+        case VM_VSTORE:
+            check(a, VECTOR_SIZE);
+            fprintf(out, "    vec_store(&s.vdata[VREG(%u)], VVEC(%u));\n", a, b);
+            break;
+
+        case VM_VMOV:    fprintf(out, "    VVEC(%u) = VVEC(%u);\n", a, b); break;
+        case VM_VBCASTD: fprintf(out, "    vec_broadcast(VVEC(%u), VREG(%u));\n", a, b); break;
+        case VM_VEXTRD:  fprintf(out, "    VREG(%u) = VVEC(%u).d[%u];\n", a, b, insn.imm); break;
+        case VM_VXOR:    fprintf(out, "    VVEC(%u).d ^= VVEC(%u).d;\n", a, b); break;
+        case VM_VAND:    fprintf(out, "    VVEC(%u).d &= VVEC(%u).d;\n", a, b); break;
+        case VM_VOR:     fprintf(out, "    VVEC(%u).d |= VVEC(%u).d;\n", a, b); break;
+        case VM_VADDB:   fprintf(out, "    VVEC(%u).b += VVEC(%u).b;\n", a, b); break;
+        case VM_VADDW:   fprintf(out, "    VVEC(%u).w += VVEC(%u).w;\n", a, b); break;
+        case VM_VADDD:   fprintf(out, "    VVEC(%u).d += VVEC(%u).d;\n", a, b); break;
+        case VM_VSUBB:   fprintf(out, "    VVEC(%u).b -= VVEC(%u).b;\n", a, b); break;
+        case VM_VSUBW:   fprintf(out, "    VVEC(%u).w -= VVEC(%u).w;\n", a, b); break;
+        case VM_VSUBD:   fprintf(out, "    VVEC(%u).d -= VVEC(%u).d;\n", a, b); break;
+        case VM_VSHLD:   fprintf(out, "    vec_shl(VVEC(%u), %u);\n", a, insn.imm); break;
+        case VM_VSHRD:   fprintf(out, "    vec_shr(VVEC(%u), %u);\n", a, insn.imm); break;
+        case VM_VSHUFD:  fprintf(out, "    vec_shuffle(VVEC(%u), VVEC(%u), 0x%x);\n", a, b, insn.imm); break;
+        case VM_VHADDB:  fprintf(out, "    VREG(%u) = vec_sum8(VVEC(%u));\n", a, b); break;
+        case VM_VHADDD:  fprintf(out, "    VREG(%u) = vec_sum32(VVEC(%u));\n", a, b); break;
+        case VM_VHXORD:  fprintf(out, "    VREG(%u) = vec_xor32(VVEC(%u));\n", a, b); break;
+
+        case VM_MEMCPY:
+            fprintf(out, "    if (!s.copy(VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc);
+            break;
+
+        case VM_MEMSET:
+            fprintf(out, "    if (!s.fill(VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc);
+            break;
+
+        case VM_MEMCMP:
+            fprintf(out, "    if (!s.compare(VREG(%u), VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc, insn.imm);
+            break;
+
+        case VM_MEMCHR:
+            fprintf(out, "    if (!s.find(VREG(%u), VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc, insn.imm);
+            break;
+
+        case VM_AESK:
+            fprintf(out, "    if (!s.aesk(VREG(%u), %u)) return false;\n", a, insn.imm);
+            break;
+
+        case VM_AESE:
+        case VM_AESD:
+            fprintf(out, "    if (!s.aes_blocks(VREG(%u), VREG(%u), VREG(%u), %s)) return false;\n",
+                    a, b, insn.rc, insn.opcode == VM_AESD ? "true" : "false");
+            break;
+
+        case VM_AESCTR:
+            fprintf(out, "    if (!s.aesctr(VREG(%u), VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc, insn.imm);
+            break;
+
+        case VM_CRC32C:
+            fprintf(out, "    if (!s.crc(VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc);
+            break;
+
+        case VM_SHA256:
+            fprintf(out, "    if (!s.sha(VREG(%u), VREG(%u), VREG(%u))) return false;\n", a, b, insn.rc);
+            break;
+
+        case VM_RC4M:
+            fprintf(out, "    if (!s.rc4m(VREG(%u), VREG(%u), VREG(%u), 0x%xu, %u, %u)) return false;\n",
+                    a, b, insn.rc, insn.imm, insn.target & 0xFF, insn.target >> 8);
+            break;
+
+        case VM_CONOUT:
+            fprintf(out, "    std::cout << (char *)&s.vdata[%u];\n", a);
+            break;
+
+        case VM_HLT:
+            fprintf(out, "    return false;\n");
+            break;
+
+        case VM_FAULT:
+            fprintf(out, "    return s.fault(%u);\n", insn.imm);
+            break;
+
+        case VM_JMPI:
+            jump(insn.target, "    ");
+            break;
+
+        case VM_JMP:
+            fprintf(out, "    {\n");
+            fprintf(out, "        s.target = VREG(%u);\n", a);
+            fprintf(out, "        goto dispatch;\n");
+            fprintf(out, "    }\n");
+            break;
+
+        case VM_CALL:
+        case VM_RCALL:
+            fprintf(out, "    if (!s.push(0x%xu)) return false;\n", insn.imm);
+            if (insn.target >= end)
+                fprintf(out, "    return s.fault(%u);\n", fault(insn.target));
+            else
+                fprintf(out, "    if (!%s(s, 0x%xu)) return false;\n", label("r", insn.target).c_str(), insn.imm);
+            break;
+
+        case VM_RET:
+            fprintf(out, "    if (!s.pop(s.target)) return false;\n");
+            fprintf(out, "    if (s.target != ret) return s.fault(%u);\n", ERR_OPCODE_UNIMPLEMENTED);
+            fprintf(out, "    return true;\n");
+            break;
+
+        default:
+            if (!insn_is_jcc(insn.opcode)) {
+                fprintf(out, "    return s.fault(%u);\n", ERR_OPCODE_INVALID);
+                break;
+            }
+
+            /*
+             * Conditional jumps, immediate or register indirect.
+             */
+            if (insn_has_target(insn)) {
+                fprintf(out, "    if (%s)\n", condition(insn.opcode));
+                jump(insn.target, "        ");
+            } else {
+                fprintf(out, "    if (%s) {\n", condition(insn.opcode));
+                fprintf(out, "        s.target = VREG(%u);\n", a);
+                fprintf(out, "        goto dispatch;\n");
+                fprintf(out, "    }\n");
+            }
+            break;
+    }
+}
+
+static void translate(const vroutine& routine) {
+    /*
+     * Labels are only emitted where they are used so the output builds
+     * cleanly with -Wall -Werror.
+     */
+    std::set<uint32_t> labels;
+    for (auto it = routine.insns.begin(); it != routine.insns.end(); it++) {
+        const vinsn& insn = stream.insns[*it];
+        auto next = std::next(it);
+
+        if (routine.indirect)
+            labels.insert(*it);
+        if (insn_has_target(insn) && insn.opcode != VM_CALL && insn.opcode != VM_RCALL)
+            labels.insert(insn.target);
+        if (falls_through(insn.opcode) && (next == routine.insns.end() || *next != *it + 1))
+            labels.insert(*it + 1);
+    }
+
+    /*
+     * Code before the entry point is reached by jumping backwards.
+     */
+    if (*routine.insns.begin() != routine.entry)
+        labels.insert(routine.entry);
+
+    fprintf(out, "static bool %s(vaot& s, const REG ret) {\n", label("r", routine.entry).c_str());
+    fprintf(out, "    (void)ret;\n");
+
+    if (*routine.insns.begin() != routine.entry)
+        jump(routine.entry, "    ");
+
+    for (auto it = routine.insns.begin(); it != routine.insns.end(); it++) {
+        const uint32_t i = *it;
+        auto next = std::next(it);
+
+        if (labels.count(i))
+            fprintf(out, "%s:\n", label("L", i).c_str());
+        else
+            fprintf(out, "    // %s\n", label("L", i).c_str());
+
+        emit(stream.insns[i]);
+
+        if (falls_through(stream.insns[i].opcode) && (next == routine.insns.end() || *next != i + 1))
+            jump(i + 1, "    ");
+    }
+
+    if (routine.indirect) {
+        fprintf(out, "dispatch:\n");
+        fprintf(out, "    switch (s.target) {\n");
+        for (uint32_t i = 0; i < end; i++) {
+            if (routine.insns.count(i))
+                fprintf(out, "        case 0x%04x: goto %s;\n", stream.vaddr[i], label("L", i).c_str());
+            else
+                fprintf(out, "        case 0x%04x: return s.fault(%u);\n", stream.vaddr[i], ERR_OPCODE_UNIMPLEMENTED);
+        }
+        fprintf(out, "        default: return s.fault(s.target >= 0x%xu ? %u : %u);\n", stream.vsize, ERR_CODE_OUT_OF_BOUNDS, ERR_CODE_MISALIGNED);
+        fprintf(out, "    }\n");
+    }
+
+    fprintf(out, "}\n\n");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s START] [-l LENGTH] [-o OUT.cpp] FILE.bin|FILE.obvm\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *input = nullptr, *output = nullptr;
+    unsigned long start = 0, length = ULONG_MAX;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            start = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            length = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (argv[i][0] != '-' && !input)
+            input = argv[i];
+        else
+            usage(argv[0]);
+    }
+
+    if (!input)
+        usage(argv[0]);
+
+    /*
+     * Read the code section.
+     */
+    FILE *file = fopen(input, "rb");
+    if (!file) {
+        perror(input);
+        return 1;
+    }
+
+    std::vector<OPCODE> code;
+    OPCODE buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        code.insert(code.end(), buffer, buffer + read);
+    fclose(file);
+
+    /*
+     * Containers carry the bounds of their code section, unless 
+     * overridden on the command line.
+     */
+    vheader header;
+    if (code.size() >= sizeof(header)) {
+        memcpy(&header, code.data(), sizeof(header));
+        if (header.magic == VM_CONTAINER_MAGIC && start == 0 && length == ULONG_MAX) {
+            start = header.code_offset;
+            length = header.code_size;
+        }
+    }
+
+    if (start > code.size()) {
+        fprintf(stderr, "%s: start 0x%lx is past the end of the file\n", input, start);
+        return 1;
+    }
+    code.erase(code.begin(), code.begin() + start);
+    if (length < code.size())
+        code.resize(length);
+
+    decode_stream(code.data(), (uint32_t)code.size(), stream);
+    end = stream.index((REG)code.size());
+
+    /*
+     * Offsets loaded into registers or onto the stack are the possible
+     * targets of register indirect jumps.
+     */
+    std::vector<uint32_t> loaded;
+    for (uint32_t i = 0; i < end; i++) {
+        const vinsn& insn = stream.insns[i];
+        if ((insn.opcode == VM_MOVI || insn.opcode == VM_PUSHI) && stream.index(insn.imm) < end)
+            loaded.push_back(stream.index(insn.imm));
+    }
+
+    /*
+     * The entry point and every call target start a routine.
+     */
+    std::set<uint32_t> entries = { 0 };
+    for (uint32_t i = 0; i < end; i++) {
+        const vinsn& insn = stream.insns[i];
+        if ((insn.opcode == VM_CALL || insn.opcode == VM_RCALL) && insn.target < end)
+            entries.insert(insn.target);
+    }
+
+    std::vector<vroutine> routines;
+    for (const uint32_t entry : entries) {
+        if (entry >= end)
+            continue;
+        vroutine routine = { entry, {}, false };
+        walk(routine, loaded);
+        routines.push_back(routine);
+    }
+
+    out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        perror(output);
+        return 1;
+    }
+
+    fprintf(out, "/*\n * Translated from %s by vm2cpp. Do not edit.\n */\n\n", input);
+    fprintf(out, "#include \"aot.h\"\n\n");
+
+    for (const vroutine& routine : routines)
+        fprintf(out, "static bool %s(vaot& s, const REG ret);\n", label("r", routine.entry).c_str());
+    fprintf(out, "\n");
+
+    for (const vroutine& routine : routines)
+        translate(routine);
+
+    fprintf(out, "uint32_t aot_start(vaot& s) {\n");
+    if (end == 0)
+        fprintf(out, "    s.fault(%u);\n", ERR_CODE_OUT_OF_BOUNDS);
+    else
+        fprintf(out, "    if (%s(s, %s))\n        s.fault(%u);\n", label("r", 0).c_str(), AOT_NO_RETURN, ERR_CODE_OUT_OF_BOUNDS);
+    fprintf(out, "    return VREG(0);\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
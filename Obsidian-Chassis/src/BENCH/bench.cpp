@@ -0,0 +1,660 @@
+/*
+ * bench.cpp
+ *
+ * Benchmark suite for the CPU loop.
+ *
+ * Every kernel is a bytecode program generated below and run with the
+ * VM as built (dispatch backend, JIT and fusion settings), best of
+ * BENCH_RUNS runs after a warm-up run:
+ *
+ *   - opcode kernels: a loop of BENCH_UNROLL copies of one opcode from
+ *     opcodes.h (or the shortest sequence that exercises it, e.g. push
+ *     and pop),
+ *   - macro kernels: call/return heavy recursion (the factorial routine
+ *     of examples/fact.vasm), load loops over the data section and
+ *     RC4 through VM_RC4K/VM_RC4C and VM_RC4M, and the bulk memory,
+ *     AES, CRC32C and SHA-256 opcodes,
+ *   - lanes kernels: the hash loop run by VMLanes on VM_LANES inputs
+ *     at once, counting the instructions of every lane,
+ *   - startup kernels: constructing a VM, start() after a run,
+ *     start() from a snapshot and resuming from a snapshot one basic
+ *     block per run(), running the program linked at _vm_start
+ *     (examples/fact.vasm).
+ *
+ * Results are printed as JSON. Guest instruction counts are those of
+ * the program as written, so fused and JIT compiled sequences count
+ * every instruction they replace. Cycles are TSC cycles on x86 and
+ * steady_clock ticks elsewhere.
+ *
+ * usage: bench [NAME...]   run the kernels whose name starts with NAME
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "lanes.h"
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_RUNS 5
+#define BENCH_UNROLL 16
+#define BENCH_INSNS 20000000            // Guest instructions per run of a kernel.
+
+/*
+ * Registers used by the kernels.
+ */
+#define R_ONE 1                         // 1, shift count.
+#define R_THREE 2                       // 3, divisor.
+#define R_X 3                           // Operand.
+#define R_Y 4                           // Operand.
+#define R_JMP 5                         // Register branch target.
+#define R_ADDR 6                        // Data address.
+#define R_MUL 7                         // Hash multiplier.
+#define R_TMP 8                         // Scratch.
+#define R_OUTER 14                      // Outer loop counter.
+#define R_COUNT 15                      // Loop counter.
+#define V_X 1                           // Vector operand.
+#define V_Y 2                           // Vector operand.
+
+/*
+ * Bytecode with its guest instruction count.
+ */
+typedef struct _vcode {
+    std::vector<OPCODE> bytes;
+    uint64_t insns = 0;
+
+    uint32_t here() const {
+        return bytes.size();
+    }
+
+    /*
+     * Append one instruction.
+     */
+    _vcode& op(const OPCODE opcode, std::initializer_list<uint8_t> operands = {}) {
+        bytes.push_back(opcode);
+        bytes.insert(bytes.end(), operands);
+        insns++;
+        return *this;
+    }
+
+    _vcode& op32(const OPCODE opcode, std::initializer_list<uint8_t> operands, const uint32_t imm) {
+        op(opcode, operands);
+        for (int i = 0; i < 4; i++)
+            bytes.push_back(imm >> (8 * i));
+        return *this;
+    }
+
+    void patch(const uint32_t at, const uint32_t imm) {
+        memcpy(&bytes[at], &imm, sizeof(imm));
+    }
+} vcode;
+
+typedef struct _vkernel {
+    std::string name;
+    std::string kind;                   // opcode, macro, lanes or startup.
+    std::vector<OPCODE> code;           // Program, empty for startup kernels.
+    std::vector<uint8_t> data;          // Input.
+    uint64_t insns;                     // Guest instructions per run.
+    uint64_t bytes;                     // Bytes processed per run or 0.
+    std::function<void()> run;          // Lanes and startup kernels only.
+} vkernel;
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+/*
+ * Build a kernel that runs body in a loop, unrolled BENCH_UNROLL times.
+ * body appends one copy at the given code and returns nothing. Copies
+ * may call a subroutine emitted after the loop by tail.
+ */
+static vkernel loop(const std::string& name, const std::function<void(vcode&)>& body, const std::function<void(vcode&)>& tail = nullptr) {
+    vcode code;
+
+    code.op32(VM_MOVI, { R_ONE }, 1);
+    code.op32(VM_MOVI, { R_THREE }, 3);
+    code.op32(VM_MOVI, { R_X }, 0x12345678);
+    code.op32(VM_MOVI, { R_Y }, 0x9abcdef);
+    code.op32(VM_MOVI, { R_ADDR }, 0x10);
+    code.op32(VM_MOVI, { R_COUNT }, 0);
+
+    const uint32_t count = code.here() - 4;
+    const uint64_t setup = code.insns;
+    const uint32_t head = code.here();
+
+    for (int i = 0; i < BENCH_UNROLL; i++)
+        body(code);
+
+    const uint64_t iteration = code.insns - setup + 3;
+
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, head);
+    code.op(VM_HLT);
+
+    if (tail)
+        tail(code);
+
+    const uint32_t iterations = BENCH_INSNS / iteration + 1;
+
+    code.patch(count, iterations);
+    return { name, "opcode", code.bytes, {}, setup + iterations * iteration + 1, 0, nullptr };
+}
+
+/*
+ * Kernel of a single instruction.
+ */
+static vkernel single(const std::string& name, const OPCODE opcode, std::initializer_list<uint8_t> operands) {
+    return loop(name, [=](vcode& code) { code.op(opcode, operands); });
+}
+
+static vkernel single32(const std::string& name, const OPCODE opcode, std::initializer_list<uint8_t> operands, const uint32_t imm) {
+    return loop(name, [=](vcode& code) { code.op32(opcode, operands, imm); });
+}
+
+/*
+ * Kernel of a branch to the next instruction, taken or not.
+ */
+static vkernel jump(const std::string& name, const OPCODE opcode) {
+    return loop(name, [=](vcode& code) { code.op32(opcode, {}, code.here() + 5); });
+}
+
+/*
+ * Kernel of a register branch to the next instruction, each preceded
+ * by the load of its target.
+ */
+static vkernel jump_reg(const std::string& name, const OPCODE opcode) {
+    return loop(name, [=](vcode& code) {
+        code.op32(VM_MOVI, { R_JMP }, code.here() + 8);
+        code.op(opcode, { R_JMP });
+    });
+}
+
+static void opcode_kernels(std::vector<vkernel>& kernels) {
+    kernels.push_back(single("nop", VM_NOP, {}));
+    kernels.push_back(single("mov", VM_MOV, { R_X, R_Y }));
+    kernels.push_back(single32("movi", VM_MOVI, { R_X }, 42));
+    kernels.push_back(single("add", VM_ADD, { R_X, R_Y }));
+    kernels.push_back(single32("addi", VM_ADDI, { R_X }, 42));
+    kernels.push_back(single("sub", VM_SUB, { R_X, R_Y }));
+    kernels.push_back(single32("subi", VM_SUBI, { R_X }, 42));
+    kernels.push_back(single("adc", VM_ADC, { R_X, R_Y }));
+    kernels.push_back(single("inc", VM_INC, { R_X }));
+    kernels.push_back(single("dec", VM_DEC, { R_X }));
+    kernels.push_back(single32("cmp", VM_CMP, { R_X }, 42));
+    kernels.push_back(single("lea", VM_LEA, { R_X, R_Y }));
+    kernels.push_back(single("neg", VM_NEG, { R_X }));
+    kernels.push_back(single("or", VM_OR, { R_X, R_Y }));
+    kernels.push_back(single("and", VM_AND, { R_X, R_Y }));
+    kernels.push_back(single("not", VM_NOT, { R_X }));
+    kernels.push_back(single("nor", VM_NOR, { R_X, R_Y }));
+    kernels.push_back(single("xor", VM_XOR, { R_X, R_Y }));
+    kernels.push_back(single32("xori", VM_XORI, { R_X }, 42));
+    kernels.push_back(single("test", VM_TEST, { R_X, R_Y }));
+    kernels.push_back(single("shr", VM_SHR, { R_X, R_ONE }));
+    kernels.push_back(single("shl", VM_SHL, { R_X, R_ONE }));
+    kernels.push_back(single("div", VM_DIV, { R_X, R_THREE }));
+    kernels.push_back(single("idiv", VM_IDIV, { R_X, R_THREE }));
+    kernels.push_back(single("mul", VM_MUL, { R_X, R_THREE }));
+    kernels.push_back(single("imul", VM_IMUL, { R_X, R_THREE }));
+    kernels.push_back(single("xchg", VM_XCHG, { R_X, R_Y }));
+
+    kernels.push_back(loop("push_pop", [](vcode& code) {
+        code.op(VM_PUSH, { R_X });
+        code.op(VM_POP, { R_Y });
+    }));
+    kernels.push_back(loop("pushi_pop", [](vcode& code) {
+        code.op32(VM_PUSHI, {}, 42);
+        code.op(VM_POP, { R_Y });
+    }));
+    kernels.push_back(loop("pushad_popad", [](vcode& code) {
+        code.op(VM_PUSHAD);
+        code.op(VM_POPAD);
+    }));
+
+    kernels.push_back(jump("jmpi", VM_JMPI));
+    kernels.push_back(jump_reg("jmp", VM_JMP));
+
+    static const char *conditions[] = { "e", "ne", "l", "le", "nl", "nle", "b", "be", "nb", "nbe", "c", "nc", "s", "ns", "o", "no" };
+
+    for (unsigned i = 0; i < 16; i++) {
+        kernels.push_back(jump_reg(std::string("j") + conditions[i], VM_JE + 2 * i));
+        kernels.push_back(jump(std::string("j") + conditions[i] + "i", VM_JEI + 2 * i));
+    }
+
+    /*
+     * Calls go to a single return after the loop.
+     */
+    for (const OPCODE opcode : { VM_CALL, VM_RCALL }) {
+        auto ret = std::make_shared<uint32_t>(0);
+        auto sites = std::make_shared<std::vector<uint32_t>>();
+
+        kernels.push_back(loop(opcode == VM_CALL ? "call_ret" : "rcall_ret", [=](vcode& code) {
+            sites->push_back(code.here());
+            code.op32(opcode, {}, 0);
+            code.insns++;                                   // The return.
+        }, [=](vcode& code) {
+            *ret = code.here();
+            code.bytes.push_back(VM_RET);
+            for (const uint32_t site : *sites)
+                code.patch(site + 1, opcode == VM_CALL ? *ret : *ret - (site + 5));
+        }));
+    }
+
+    kernels.push_back(single("loadb", VM_LOADB, { R_X, R_ADDR }));
+    kernels.push_back(single("loadbi", VM_LOADBI, { R_X, 0x10 }));
+    kernels.push_back(single("loadw", VM_LOADW, { R_X, R_ADDR }));
+    kernels.push_back(single("loadwi", VM_LOADWI, { R_X, 0x10 }));
+    kernels.push_back(single("loadd", VM_LOADD, { R_X, R_ADDR }));
+    kernels.push_back(single("loaddi", VM_LOADDI, { R_X, 0x10 }));
+    kernels.push_back(single("storb", VM_STORB, { 0x10, R_X }));
+    kernels.push_back(single("storbi", VM_STORBI, { 0x10, 42 }));
+    kernels.push_back(single("storw", VM_STORW, { 0x10, R_X }));
+    kernels.push_back(single("storwi", VM_STORWI, { 0x10, 42, 0 }));
+    kernels.push_back(single("stord", VM_STORD, { 0x10, R_X }));
+    kernels.push_back(single32("stordi", VM_STORDI, { 0x10 }, 42));
+
+    kernels.push_back(single("vload", VM_VLOAD, { V_X, R_ADDR }));
+    kernels.push_back(single("vstore", VM_VSTORE, { R_ADDR, V_X }));
+    kernels.push_back(single("vmov", VM_VMOV, { V_X, V_Y }));
+    kernels.push_back(single("vbcastd", VM_VBCASTD, { V_X, R_X }));
+    kernels.push_back(single("vextrd", VM_VEXTRD, { R_X, V_X, 3 }));
+    kernels.push_back(single("vxor", VM_VXOR, { V_X, V_Y }));
+    kernels.push_back(single("vand", VM_VAND, { V_X, V_Y }));
+    kernels.push_back(single("vor", VM_VOR, { V_X, V_Y }));
+    kernels.push_back(single("vaddb", VM_VADDB, { V_X, V_Y }));
+    kernels.push_back(single("vaddw", VM_VADDW, { V_X, V_Y }));
+    kernels.push_back(single("vaddd", VM_VADDD, { V_X, V_Y }));
+    kernels.push_back(single("vsubb", VM_VSUBB, { V_X, V_Y }));
+    kernels.push_back(single("vsubw", VM_VSUBW, { V_X, V_Y }));
+    kernels.push_back(single("vsubd", VM_VSUBD, { V_X, V_Y }));
+    kernels.push_back(single("vshld", VM_VSHLD, { V_X, 1 }));
+    kernels.push_back(single("vshrd", VM_VSHRD, { V_X, 1 }));
+    kernels.push_back(single("vshufd", VM_VSHUFD, { V_X, V_X, 0x1B }));
+    kernels.push_back(single("vhaddb", VM_VHADDB, { R_X, V_X }));
+    kernels.push_back(single("vhaddd", VM_VHADDD, { R_X, V_X }));
+    kernels.push_back(single("vhxord", VM_VHXORD, { R_X, V_X }));
+}
+
+/*
+ * Recursive factorial of examples/fact.vasm, called in a loop.
+ */
+static vkernel fact(const uint32_t n) {
+    vcode code;
+
+    code.op32(VM_MOVI, { R_COUNT }, 0);
+
+    const uint32_t count = code.here() - 4;
+    const uint32_t head = code.here();
+
+    code.op32(VM_MOVI, { 1 }, n);
+    code.op32(VM_CALL, {}, 0);
+
+    const uint32_t call = code.here() - 4;
+
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, head);
+    code.op(VM_HLT);
+
+    /*
+     * _fact: test, jei _ret, jmpi _next, _ret: movi, ret, _next: push,
+     * dec, call _fact, pop, mul, ret.
+     */
+    const uint32_t entry = code.here();
+
+    code.patch(call, entry);
+    code.op(VM_TEST, { 1, 1 });
+    code.op32(VM_JEI, {}, entry + 13);
+    code.op32(VM_JMPI, {}, entry + 20);
+    code.op32(VM_MOVI, { 0 }, 1);
+    code.op(VM_RET);
+    code.op(VM_PUSH, { 1 });
+    code.op(VM_DEC, { 1 });
+    code.op32(VM_CALL, {}, entry);
+    code.op(VM_POP, { 2 });
+    code.op(VM_MUL, { 0, 2 });
+    code.op(VM_RET);
+
+    const uint64_t iteration = 2 + 9 * n + 4 + 3;
+    const uint32_t iterations = BENCH_INSNS / iteration + 1;
+
+    code.patch(count, iterations);
+    return { "fact", "macro", code.bytes, {}, 1 + iterations * iteration + 1, 0, nullptr };
+}
+
+/*
+ * Loads over size bytes of input with the given stride, passes times.
+ */
+static vkernel load(const std::string& name, const uint32_t size, const uint32_t stride) {
+    vcode code;
+    const uint32_t passes = BENCH_INSNS / (6 * (size / stride)) + 1;
+
+    code.op32(VM_MOVI, { R_OUTER }, passes);
+
+    const uint32_t outer = code.here();
+
+    code.op32(VM_MOVI, { R_ADDR }, 0);
+    code.op32(VM_MOVI, { R_COUNT }, size / stride);
+
+    const uint32_t inner = code.here();
+
+    code.op(VM_LOADD, { R_X, R_ADDR });
+    code.op(VM_ADD, { R_Y, R_X });
+    code.op32(VM_ADDI, { R_ADDR }, stride);
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, inner);
+    code.op(VM_DEC, { R_OUTER });
+    code.op(VM_TEST, { R_OUTER, R_OUTER });
+    code.op32(VM_JNEI, {}, outer);
+    code.op(VM_HLT);
+
+    std::vector<uint8_t> data(size);
+    std::mt19937 random(1);
+
+    for (auto& byte : data)
+        byte = random();
+
+    return { name, "macro", code.bytes, data, 1 + passes * (2 + 6 * (size / stride) + 3) + 1, (uint64_t)passes * size, nullptr };
+}
+
+/*
+ * Keys RC4 and encrypts length bytes, iterations times.
+ */
+static vkernel rc4(const uint32_t length) {
+    vcode code;
+    const uint32_t iterations = 256;
+
+    code.op32(VM_MOVI, { R_COUNT }, iterations);
+
+    const uint32_t head = code.here();
+
+    code.op32(VM_RC4K, { 0x00 }, 8);
+    code.op(VM_RC4C, { 0x20, 0x40 });
+    for (int i = 0; i < 4; i++)
+        code.bytes.push_back(length >> (8 * i));
+    code.bytes.push_back(0x60);
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, head);
+    code.op(VM_HLT);
+
+    std::vector<uint8_t> data = { 0x9E, 0xB2, 0x7A, 0xC3, 0x11, 0x6C, 0xD5, 0x8A };
+
+    return { "rc4", "macro", code.bytes, data, 1 + iterations * 5 + 1, (uint64_t)iterations * length, nullptr };
+}
+
+/*
+ * Encrypts length bytes with count keys through VM_RC4M, iterations
+ * times.
+ */
+static vkernel rc4m(const uint32_t length, const uint8_t count) {
+    vcode code;
+    const uint32_t iterations = 64;
+
+    code.op32(VM_MOVI, { R_X }, 0x100);
+    code.op32(VM_MOVI, { R_Y }, 0x1000);
+    code.op32(VM_MOVI, { R_ADDR }, 0x1000 + length);
+    code.op32(VM_MOVI, { R_COUNT }, iterations);
+
+    const uint32_t head = code.here();
+
+    code.op32(VM_RC4M, { R_X, R_Y, R_ADDR }, length);
+    code.bytes.push_back(8);
+    code.bytes.push_back(count);
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, head);
+    code.op(VM_HLT);
+
+    std::vector<uint8_t> data(0x100 + 8 * count);
+    std::mt19937 random(1);
+
+    for (auto& byte : data)
+        byte = random();
+
+    return { "rc4m", "macro", code.bytes, data, 4 + iterations * 4 + 1, (uint64_t)iterations * count * length, nullptr };
+}
+
+/*
+ * Runs one bulk memory or crypto instruction over length bytes at
+ * 0x1000, iterations times. R_ADDR holds the length, or the number of
+ * blocks for AES ECB. The data section is zero, so compares run to the
+ * end and searches for R_THREE find nothing.
+ */
+static vkernel range(const std::string& name, const uint32_t length, const uint32_t count, const std::function<void(vcode&)>& body) {
+    vcode code;
+    const uint32_t iterations = 256;
+
+    code.op32(VM_MOVI, { R_ONE }, 0x100);
+    code.op32(VM_MOVI, { R_THREE }, 0xFF);
+    code.op32(VM_MOVI, { R_X }, 0x1000);
+    code.op32(VM_MOVI, { R_Y }, 0x1000 + length);
+    code.op32(VM_MOVI, { R_ADDR }, count);
+    code.op32(VM_MOVI, { R_COUNT }, iterations);
+
+    const uint32_t head = code.here();
+
+    body(code);
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, head);
+    code.op(VM_HLT);
+
+    return { name, "macro", code.bytes, {}, 6 + iterations * 4 + 1, (uint64_t)iterations * length, nullptr };
+}
+
+/*
+ * Hashes the dword at 0 with a multiply, shift and xor loop, which 
+ * only uses opcodes VMLanes runs lane-wise.
+ */
+static vkernel hash(void) {
+    vcode code;
+    const uint32_t iterations = BENCH_INSNS / 9;
+
+    code.op(VM_LOADDI, { R_X, 0x00 });
+    code.op32(VM_MOVI, { R_Y }, 0x811C9DC5);
+    code.op32(VM_MOVI, { R_MUL }, 0x01000193);
+    code.op32(VM_MOVI, { R_ONE }, 1);
+    code.op32(VM_MOVI, { R_COUNT }, iterations);
+
+    const uint32_t head = code.here();
+
+    code.op(VM_XOR, { R_Y, R_X });
+    code.op(VM_MUL, { R_Y, R_MUL });
+    code.op(VM_MOV, { R_TMP, R_Y });
+    code.op(VM_SHR, { R_TMP, R_ONE });
+    code.op(VM_XOR, { R_Y, R_TMP });
+    code.op32(VM_ADDI, { R_X }, 0x9E3779B9);
+    code.op(VM_DEC, { R_COUNT });
+    code.op(VM_TEST, { R_COUNT, R_COUNT });
+    code.op32(VM_JNEI, {}, head);
+    code.op(VM_HLT);
+
+    return { "hash", "macro", code.bytes, { 1, 2, 3, 4 }, 5 + iterations * 9 + 1, 0, nullptr };
+}
+
+/*
+ * Runs a macro kernel on VM_LANES inputs in lockstep. Each lane gets
+ * the kernel's input with a different first byte.
+ */
+static vkernel lanes(const vkernel& kernel) {
+    auto batch = std::make_shared<VMLanes>(std::make_shared<const Program>(kernel.code));
+    auto inputs = std::make_shared<std::vector<std::vector<uint8_t>>>(VM_LANES, kernel.data);
+
+    for (uint32_t i = 0; i < VM_LANES; i++)
+        (*inputs)[i][0] += i;
+
+    return { "lanes_" + kernel.name, "lanes", {}, {}, kernel.insns * VM_LANES, 0, [batch, inputs] {
+        batch->run(*inputs);
+    } };
+}
+
+static void range_kernels(std::vector<vkernel>& kernels) {
+    const uint32_t length = 0x10000;
+
+    kernels.push_back(range("memcpy", length, length, [](vcode& code) {
+        code.op(VM_MEMCPY, { R_Y, R_X, R_ADDR });
+    }));
+    kernels.push_back(range("memset", length, length, [](vcode& code) {
+        code.op(VM_MEMSET, { R_X, R_COUNT, R_ADDR });
+    }));
+    kernels.push_back(range("memcmp", length, length, [](vcode& code) {
+        code.op(VM_MEMCMP, { R_JMP, R_X, R_Y, R_ADDR });
+    }));
+    kernels.push_back(range("memchr", length, length, [](vcode& code) {
+        code.op(VM_MEMCHR, { R_JMP, R_X, R_THREE, R_ADDR });
+    }));
+    kernels.push_back(range("aese", length, length / AES_BLOCK_SIZE, [](vcode& code) {
+        code.op(VM_AESE, { R_X, R_Y, R_ADDR });
+    }));
+    kernels.push_back(range("aesd", length, length / AES_BLOCK_SIZE, [](vcode& code) {
+        code.op(VM_AESD, { R_X, R_Y, R_ADDR });
+    }));
+    kernels.push_back(range("aesctr", length, length, [](vcode& code) {
+        code.op(VM_AESCTR, { R_X, R_Y, R_ADDR, R_ONE });
+    }));
+    kernels.push_back(range("crc32c", length, length, [](vcode& code) {
+        code.op(VM_CRC32C, { R_THREE, R_X, R_ADDR });
+    }));
+    kernels.push_back(range("sha256", length, length, [](vcode& code) {
+        code.op(VM_SHA256, { R_Y, R_X, R_ADDR });
+    }));
+}
+
+/*
+ * Instructions run by examples/fact.vasm: two to call fact(6), nine
+ * per level, four for the last one and the halt.
+ */
+#define FACT_VASM_INSNS (2 + 9 * 6 + 4 + 1)
+
+static void startup_kernels(std::vector<vkernel>& kernels) {
+    static VM restarted, restored, sliced;
+
+    restarted.start();
+    restored.snapshot();
+    sliced.snapshot();
+
+    kernels.push_back({ "vm_construct", "startup", {}, {}, FACT_VASM_INSNS, 0, [] {
+        VM vm;
+        vm.start();
+    } });
+    kernels.push_back({ "vm_start", "startup", {}, {}, FACT_VASM_INSNS, 0, [] {
+        restarted.start();
+    } });
+    kernels.push_back({ "vm_restore", "startup", {}, {}, FACT_VASM_INSNS, 0, [] {
+        restored.start();
+    } });
+    kernels.push_back({ "vm_slice", "startup", {}, {}, FACT_VASM_INSNS, 0, [] {
+        sliced.prepare();
+        while (sliced.run(1) == VSTATUS_YIELDED);
+    } });
+}
+
+static const char *backend(void) {
+#if VM_DISPATCH == VM_DISPATCH_SWITCH
+    return "switch";
+#elif VM_DISPATCH == VM_DISPATCH_GOTO
+    return "goto";
+#else
+    return "tailcall";
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<vkernel> kernels;
+
+    opcode_kernels(kernels);
+    kernels.push_back(fact(10));
+    kernels.push_back(load("load_seq", 0x100000, 4));
+    kernels.push_back(load("load_stride", 0x800000, 64));
+    kernels.push_back(rc4(0x10000));
+    kernels.push_back(rc4m(0x1000, 16));
+    kernels.push_back(hash());
+    kernels.push_back(lanes(kernels.back()));
+    range_kernels(kernels);
+    startup_kernels(kernels);
+
+    printf("{\n  \"backend\": \"%s\",\n", backend());
+#ifdef VM_JIT
+    printf("  \"jit\": true,\n");
+#else
+    printf("  \"jit\": false,\n");
+#endif
+    printf("  \"kernels\": [");
+
+    bool first = true;
+
+    for (const auto& kernel : kernels) {
+        bool selected = argc < 2;
+
+        for (int i = 1; i < argc; i++)
+            selected |= kernel.name.compare(0, strlen(argv[i]), argv[i]) == 0;
+        if (!selected)
+            continue;
+
+        /*
+         * Startup kernels are too short to time one by one.
+         */
+        const uint64_t repeat = kernel.run && kernel.insns < BENCH_INSNS / 16 ? BENCH_INSNS / kernel.insns / 16 : 1;
+        VM vm(kernel.run ? Program::builtin() : std::make_shared<const Program>(kernel.code));
+        uint32_t error = 0;
+        double best_seconds = 0;
+        uint64_t best_cycles = 0;
+
+        for (int run = 0; run <= BENCH_RUNS; run++) {
+            const auto start = std::chrono::steady_clock::now();
+            const uint64_t start_cycles = cycles();
+
+            if (kernel.run) {
+                for (uint64_t i = 0; i < repeat; i++)
+                    kernel.run();
+            } else {
+                vm.start(kernel.data);
+                error |= vm.error();
+            }
+
+            const uint64_t elapsed_cycles = cycles() - start_cycles;
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            /*
+             * The first run warms up caches, page tables and the JIT.
+             */
+            if (run == 1 || (run > 1 && seconds < best_seconds)) {
+                best_seconds = seconds;
+                best_cycles = elapsed_cycles;
+            }
+        }
+
+        const double insns = (double)kernel.insns * repeat;
+
+        printf("%s\n    { \"name\": \"%s\", \"kind\": \"%s\", \"insns\": %.0f, \"seconds\": %.6f, \"cycles\": %llu, "
+               "\"cycles_per_insn\": %.3f, \"insns_per_sec\": %.0f",
+               first ? "" : ",", kernel.name.c_str(), kernel.kind.c_str(), insns, best_seconds,
+               (unsigned long long)best_cycles, best_cycles / insns, insns / best_seconds);
+        if (kernel.bytes)
+            printf(", \"bytes_per_sec\": %.0f", kernel.bytes / best_seconds);
+        if (kernel.kind == "startup")
+            printf(", \"ns_per_run\": %.1f, \"cycles_per_run\": %.0f", best_seconds * 1e9 / repeat, (double)best_cycles / repeat);
+        if (error)
+            printf(", \"error\": %u", error);
+        printf(" }");
+        first = false;
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
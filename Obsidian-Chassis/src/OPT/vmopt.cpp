@@ -0,0 +1,1043 @@
+/*
+ * vmopt.cpp
+ *
+ * Bytecode to bytecode optimiser.
+ *
+ * The code section is decoded with the same decoder as the VM and split
+ * into basic blocks at the entry point, every branch and call target
+ * and after every branch, call, return and halt. The passes below are
+ * repeated until none of them changes anything:
+ *
+ *   - Constant propagation and folding within each block. Register-only
+ *     arithmetic (vm_addi, vm_inc, vm_xor, ...) on known values becomes
+ *     a vm_movi, register jumps to a known offset become immediate
+ *     jumps and conditional jumps on known flags become a vm_jmpi or
+ *     are dropped.
+ *   - Jump threading. Branches and calls to a vm_jmpi go straight to
+ *     its target, jumps to the next instruction are dropped and a
+ *     conditional jump over a vm_jmpi becomes the inverted jump.
+ *   - Dead code elimination. Instructions unreachable from the entry
+ *     point, vm_nop and register-only instructions whose result is
+ *     overwritten within the block before it is read are dropped.
+ *
+ * The remaining instructions are laid out again and every immediate
+ * branch and call target is relocated. Containers keep their data
+ * section and their symbols are moved to the new offsets.
+ *
+ * The output must pass the verifier (see verify.h), which proves that
+ * every branch is immediate and every vm_ret pops the return address
+ * of its call, so control flow survives the relocation. Programs that
+ * do not verify, keep register jumps whose target is not a constant or
+ * contain vm_passthru are written out unchanged with a warning.
+ *
+ * Code offsets held in registers as plain values (e.g. the operand of
+ * a resolved register jump) are not relocated, and neither are the
+ * registers left behind by a run that traps.
+ *
+ * Usage: vmopt [-s START] [-l LENGTH] [-v] -o OUT FILE.bin|FILE.obvm
+ *
+ * FILE.bin is the raw code section, e.g. the .text section of an
+ * object assembled from a .vasm file, and is written back raw. START
+ * and LENGTH select the code section within the file (defaults to the
+ * whole file). -v prints what each pass did.
+ */
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "container.h"
+#include "decode.h"
+#include "err.h"
+#include "opcodes.h"
+#include "vm.h"
+
+/*
+ * Register mask with every register live.
+ */
+#define OPT_ALL ((1u << NUM_REGISTERS) - 1)
+
+/*
+ * Mask of a register operand.
+ */
+#define OPT_REG(r) ((r) < NUM_REGISTERS ? 1u << (r) : 0)
+
+/*
+ * Maximum number of times the passes are repeated.
+ */
+#define OPT_ROUNDS 16
+
+typedef struct _vnode {
+    vinsn insn;                     // Decoded instruction, target is a node index.
+    std::vector<uint8_t> bytes;     // Encoding. Branch targets are patched on layout.
+    bool removed;                   // Dropped from the output.
+    uint8_t jump;                   // Register a resolved register jump read, or NUM_REGISTERS.
+} vnode;
+
+/*
+ * What the passes did, for -v.
+ */
+typedef struct _vstats {
+    uint32_t folded;                // Instructions replaced by a constant.
+    uint32_t resolved;              // Register jumps made immediate.
+    uint32_t decided;               // Conditional jumps on known flags.
+    uint32_t threaded;              // Branch targets moved past a vm_jmpi.
+    uint32_t inverted;              // Conditional jumps over a vm_jmpi inverted.
+    uint32_t unreachable;           // Unreachable instructions dropped.
+    uint32_t dead;                  // Dead register writes and vm_nop dropped.
+    uint32_t jumps;                 // Jumps to the next instruction dropped.
+} vstats;
+
+static vstream stream;
+static std::vector<vnode> nodes;    // One per decoded instruction of the input.
+static uint32_t end;                // Decoded index of the end of code sentinel.
+static vstats stats;
+
+/*
+ * First instruction still in the program at or after index i.
+ */
+static uint32_t resolve(uint32_t i) {
+    while (i < end && nodes[i].removed)
+        i++;
+    return i;
+}
+
+static uint32_t next(const uint32_t i) {
+    return resolve(i + 1);
+}
+
+static bool is_jcc_reg(const vinsn& insn) {
+    return insn_is_jcc(insn.opcode) && !insn_has_target(insn);
+}
+
+static bool is_jcc_imm(const vinsn& insn) {
+    return insn_is_jcc(insn.opcode) && insn_has_target(insn);
+}
+
+static bool falls_through(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_HLT:
+        case VM_JMP:
+        case VM_JMPI:
+        case VM_RET:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+/*
+ * Returns whether the instruction ends its basic block.
+ */
+static bool ends_block(const vinsn& insn) {
+    return !falls_through(insn.opcode) || insn_is_jcc(insn.opcode) || insn.opcode == VM_CALL || insn.opcode == VM_RCALL;
+}
+
+/*
+ * Leaders of the basic blocks of the remaining instructions.
+ */
+static std::vector<bool> leaders(void) {
+    std::vector<bool> leader(end + 1, false);
+
+    leader[resolve(0)] = true;
+    for (uint32_t i = resolve(0); i < end; i = next(i)) {
+        const vinsn& insn = nodes[i].insn;
+
+        if (insn_has_target(insn))
+            leader[resolve(insn.target)] = true;
+        if (ends_block(insn))
+            leader[next(i)] = true;
+    }
+
+    return leader;
+}
+
+/*
+ * Rewrite a node in place.
+ */
+static void set_movi(vnode& node, const REG value) {
+    const uint8_t ra = node.insn.ra;
+
+    node.insn = vinsn();
+    node.insn.opcode = VM_MOVI;
+    node.insn.ra = ra;
+    node.insn.imm = value;
+    node.bytes = { VM_MOVI, ra, (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+}
+
+static void set_jump(vnode& node, const OPCODE opcode, const uint32_t target) {
+    node.insn = vinsn();
+    node.insn.opcode = opcode;
+    node.insn.target = target;
+    node.bytes = { opcode, 0, 0, 0, 0 };
+}
+
+/*
+ * Returns whether the conditional jump is taken on the flags.
+ */
+static bool taken(const OPCODE opcode, const vflags& flags) {
+    switch (opcode) {
+        case VM_JEI:    return flags.zero();
+        case VM_JNEI:   return !flags.zero();
+        case VM_JLI:    return flags.less();
+        case VM_JLEI:   return flags.less_equal();
+        case VM_JNLI:   return !flags.less();
+        case VM_JNLEI:  return !flags.less_equal();
+        case VM_JBI:
+        case VM_JCI:    return flags.carry();
+        case VM_JBEI:   return flags.below_equal();
+        case VM_JNBI:
+        case VM_JNCI:   return !flags.carry();
+        case VM_JNBEI:  return !flags.below_equal();
+        case VM_JSI:    return flags.sign();
+        case VM_JNSI:   return !flags.sign();
+        case VM_JOI:    return flags.overflow();
+        case VM_JNOI:   return !flags.overflow();
+        default:        return true;
+    }
+}
+
+/*
+ * Conditional jump taken exactly when the given one is not.
+ */
+static OPCODE inverse(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_JEI:    return VM_JNEI;
+        case VM_JNEI:   return VM_JEI;
+        case VM_JLI:    return VM_JNLI;
+        case VM_JNLI:   return VM_JLI;
+        case VM_JLEI:   return VM_JNLEI;
+        case VM_JNLEI:  return VM_JLEI;
+        case VM_JBI:    return VM_JNBI;
+        case VM_JNBI:   return VM_JBI;
+        case VM_JBEI:   return VM_JNBEI;
+        case VM_JNBEI:  return VM_JBEI;
+        case VM_JCI:    return VM_JNCI;
+        case VM_JNCI:   return VM_JCI;
+        case VM_JSI:    return VM_JNSI;
+        case VM_JNSI:   return VM_JSI;
+        case VM_JOI:    return VM_JNOI;
+        case VM_JNOI:   return VM_JOI;
+        default:        return opcode;
+    }
+}
+
+/*
+ * Register-only instructions that never fault and leave the flags
+ * alone. Their only effect is the value written to ra.
+ */
+static bool is_pure(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_MOVI:
+        case VM_MOV:
+        case VM_LEA:
+        case VM_ADD:
+        case VM_ADDI:
+        case VM_INC:
+        case VM_DEC:
+        case VM_NEG:
+        case VM_NOT:
+        case VM_OR:
+        case VM_AND:
+        case VM_NOR:
+        case VM_XOR:
+        case VM_XORI:
+        case VM_SHR:
+        case VM_SHL:
+        case VM_MUL:
+        case VM_IMUL:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Returns whether a pure instruction or a flag writer reads vreg[rb].
+ */
+static bool reads_rb(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_MOV:
+        case VM_LEA:
+        case VM_ADD:
+        case VM_OR:
+        case VM_AND:
+        case VM_NOR:
+        case VM_XOR:
+        case VM_SHR:
+        case VM_SHL:
+        case VM_MUL:
+        case VM_IMUL:
+        case VM_SUB:
+        case VM_TEST:
+        case VM_XCHG:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Returns whether a pure instruction or a flag writer reads vreg[ra].
+ */
+static bool reads_ra(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_MOVI:
+        case VM_MOV:
+        case VM_LEA:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+/*
+ * Registers an instruction reads. Unknown instructions read every
+ * register.
+ */
+static uint32_t uses(const vinsn& insn) {
+    switch (insn.opcode) {
+        case VM_NOP:
+        case VM_HLT:
+        case VM_PUSHI:
+        case VM_STORBI:
+        case VM_STORWI:
+        case VM_STORDI:
+        case VM_MOVI:
+        case VM_LOADBI:
+        case VM_LOADWI:
+        case VM_LOADDI:
+        case VM_POP:
+            return insn.opcode == VM_HLT ? OPT_ALL : 0;
+
+        case VM_PUSH:
+        case VM_SUBI:
+        case VM_CMP:
+            return OPT_REG(insn.ra);
+
+        case VM_LOADB:
+        case VM_LOADW:
+        case VM_LOADD:
+        case VM_STORB:
+        case VM_STORW:
+        case VM_STORD:
+            return OPT_REG(insn.rb);
+
+        case VM_SUB:
+        case VM_TEST:
+        case VM_XCHG:
+            return (OPT_REG(insn.ra)) | (OPT_REG(insn.rb));
+
+        default:
+            if (!is_pure(insn.opcode))
+                return OPT_ALL;
+            return (reads_ra(insn.opcode) ? OPT_REG(insn.ra) : 0) | (reads_rb(insn.opcode) ? OPT_REG(insn.rb) : 0);
+    }
+}
+
+/*
+ * Registers an instruction may write. Unknown instructions write every
+ * register.
+ */
+static uint32_t writes(const vinsn& insn) {
+    switch (insn.opcode) {
+        case VM_NOP:
+        case VM_PUSH:
+        case VM_PUSHI:
+        case VM_PUSHAD:
+        case VM_STORB:
+        case VM_STORW:
+        case VM_STORD:
+        case VM_STORBI:
+        case VM_STORWI:
+        case VM_STORDI:
+        case VM_CMP:
+        case VM_TEST:
+        case VM_CONOUT:
+        case VM_HLT:
+            return 0;
+
+        case VM_SUB:
+        case VM_SUBI:
+        case VM_LOADB:
+        case VM_LOADW:
+        case VM_LOADD:
+        case VM_LOADBI:
+        case VM_LOADWI:
+        case VM_LOADDI:
+        case VM_POP:
+            return OPT_REG(insn.ra);
+
+        case VM_XCHG:
+            return (OPT_REG(insn.ra)) | (OPT_REG(insn.rb));
+
+        default:
+            return is_pure(insn.opcode) ? OPT_REG(insn.ra) : OPT_ALL;
+    }
+}
+
+/*
+ * Registers an instruction overwrites without reading them first.
+ */
+static uint32_t kills(const vinsn& insn) {
+    return writes(insn) == OPT_ALL ? 0 : writes(insn) & ~uses(insn);
+}
+
+/*
+ * Value a pure instruction writes to ra, given the values it reads.
+ * Returns false if the result is not folded.
+ */
+static bool evaluate(const vinsn& insn, const REG a, const REG b, REG& result) {
+    switch (insn.opcode) {
+        case VM_MOVI:   result = insn.imm; return true;
+        case VM_MOV:
+        case VM_LEA:    result = b; return true;
+        case VM_ADD:    result = ADD(a, b); return true;
+        case VM_ADDI:   result = ADD(a, insn.imm); return true;
+        case VM_INC:    result = a + 1; return true;
+        case VM_DEC:    result = a - 1; return true;
+        case VM_NEG:    result = NEG(a); return true;
+        case VM_NOT:    result = NOT(a); return true;
+        case VM_OR:     result = OR(a, b); return true;
+        case VM_AND:    result = AND(a, b); return true;
+        case VM_NOR:    result = NOR(a, b); return true;
+        case VM_XOR:    result = XOR(a, b); return true;
+        case VM_XORI:   result = XOR(a, insn.imm); return true;
+        case VM_MUL:
+        case VM_IMUL:   result = a * b; return true;
+
+        /*
+         * Counts past the register width are left to the host.
+         */
+        case VM_SHR:    result = a >> b; return b < 32;
+        case VM_SHL:    result = a << b; return b < 32;
+
+        default:        return false;
+    }
+}
+
+/*
+ * Registers whose value is known within a block.
+ */
+typedef struct _vknown {
+    REG value[NUM_REGISTERS];
+    uint32_t mask;                  // Known registers.
+
+    bool has(const uint8_t r) const { return r < NUM_REGISTERS && (mask & (1u << r)); }
+    void set(const uint8_t r, const REG v) { value[r] = v; mask |= 1u << r; }
+    void drop(const uint8_t r) { if (r < NUM_REGISTERS) mask &= ~(1u << r); }
+} vknown;
+
+/*
+ * Constant propagation and folding within each block.
+ *
+ * While register jumps are left, any instruction may be a block
+ * leader, so folding is not safe. With consistent set, only register
+ * jumps to a known offset are made immediate, one per call so the
+ * blocks are split at its target before the next one is resolved, and
+ * *consistent is cleared if a jump resolved earlier no longer reaches
+ * its target with the current blocks.
+ */
+static bool fold(bool *consistent = nullptr) {
+    const std::vector<bool> leader = leaders();
+    const bool resolving = consistent != nullptr;
+    bool changed = false;
+    vknown known = {};
+    vflags flags = {};
+    bool flagged = false;
+
+    for (uint32_t i = resolve(0); i < end; i = next(i)) {
+        vnode& node = nodes[i];
+        vinsn& insn = node.insn;
+
+        if (leader[i]) {
+            known.mask = 0;
+            flagged = false;
+        }
+
+        /*
+         * Register jumps to a constant instruction offset.
+         */
+        if ((insn.opcode == VM_JMP || is_jcc_reg(insn)) && known.has(insn.ra) && known.value[insn.ra] < stream.vsize &&
+            stream.index(known.value[insn.ra]) < end) {
+            node.jump = insn.ra;
+            set_jump(node, insn.opcode == VM_JMP ? VM_JMPI : insn.opcode + 1, stream.index(known.value[insn.ra]));
+            stats.resolved++;
+            return true;
+        }
+
+        if (resolving && node.jump < NUM_REGISTERS &&
+            !(known.has(node.jump) && known.value[node.jump] < stream.vsize && stream.index(known.value[node.jump]) == insn.target))
+            *consistent = false;
+
+        const REG a = known.has(insn.ra) ? known.value[insn.ra] : 0;
+        const REG b = known.has(insn.rb) ? known.value[insn.rb] : 0;
+        const bool ready = (!reads_ra(insn.opcode) || known.has(insn.ra)) && (!reads_rb(insn.opcode) || known.has(insn.rb));
+
+        if (is_jcc_imm(insn)) {
+            if (flagged && !resolving) {
+                if (taken(insn.opcode, flags))
+                    set_jump(node, VM_JMPI, insn.target);
+                else
+                    node.removed = true;
+                stats.decided++;
+                changed = true;
+            }
+            continue;
+        }
+
+        switch (insn.opcode) {
+            case VM_SUB:
+            case VM_SUBI:
+            case VM_CMP:
+                flagged = ready;
+                if (ready) {
+                    const REG r = flags.sub(a, insn.opcode == VM_SUB ? b : insn.imm);
+
+                    if (insn.opcode != VM_CMP)
+                        known.set(insn.ra, r);
+                } else if (insn.opcode != VM_CMP) {
+                    known.drop(insn.ra);
+                }
+                break;
+
+            case VM_TEST:
+                flagged = ready;
+                if (ready)
+                    flags.test(AND(a, b));
+                break;
+
+            case VM_XCHG: {
+                const bool ka = known.has(insn.ra), kb = known.has(insn.rb);
+
+                /*
+                 * The handler is an XOR swap, which zeroes a register
+                 * swapped with itself.
+                 */
+                if (insn.ra == insn.rb) {
+                    known.set(insn.ra, 0);
+                    break;
+                }
+
+                known.drop(insn.ra);
+                known.drop(insn.rb);
+                if (kb)
+                    known.set(insn.ra, b);
+                if (ka)
+                    known.set(insn.rb, a);
+                break;
+            }
+
+            default: {
+                REG result;
+
+                if (is_pure(insn.opcode)) {
+                    if (ready && evaluate(insn, a, b, result)) {
+                        if (!resolving && insn.opcode != VM_MOVI && insn.opcode != VM_MOV && insn.opcode != VM_LEA) {
+                            set_movi(node, result);
+                            stats.folded++;
+                            changed = true;
+                        }
+                        known.set(insn.ra, result);
+                    } else {
+                        known.drop(insn.ra);
+                    }
+                } else {
+                    known.mask &= ~writes(insn);
+                }
+
+                if (insn.opcode == VM_MEMCMP || insn.opcode == VM_MEMCHR)
+                    flagged = false;
+                break;
+            }
+        }
+    }
+
+    return changed;
+}
+
+/*
+ * Jump threading and removal of jumps to the next instruction.
+ */
+static bool thread(void) {
+    bool changed = false;
+    std::vector<uint32_t> refs(end + 1, 0);
+
+    for (uint32_t i = resolve(0); i < end; i = next(i)) {
+        vinsn& insn = nodes[i].insn;
+
+        if (!insn_has_target(insn))
+            continue;
+
+        /*
+         * Follow chains of vm_jmpi, stopping on loops.
+         */
+        uint32_t target = resolve(insn.target);
+
+        for (uint32_t hops = 0; target < end && nodes[target].insn.opcode == VM_JMPI && hops < end; hops++) {
+            const uint32_t after = resolve(nodes[target].insn.target);
+
+            if (after == target)
+                break;
+            target = after;
+        }
+
+        if (target != resolve(insn.target)) {
+            stats.threaded++;
+            changed = true;
+        }
+        insn.target = target;
+        refs[target]++;
+    }
+
+    refs[resolve(0)]++;
+
+    for (uint32_t i = resolve(0); i < end; i = next(i)) {
+        vnode& node = nodes[i];
+        const uint32_t after = next(i);
+
+        if ((node.insn.opcode == VM_JMPI || is_jcc_imm(node.insn)) && node.insn.target == after) {
+            node.removed = true;
+            refs[after]--;
+            stats.jumps++;
+            changed = true;
+            continue;
+        }
+
+        /*
+         * jcc L; jmpi M; L: becomes jncc M; L: if nothing else enters
+         * the vm_jmpi.
+         */
+        if (is_jcc_imm(node.insn) && after < end && nodes[after].insn.opcode == VM_JMPI && refs[after] == 0 &&
+            node.insn.target == next(after)) {
+            refs[node.insn.target]--;
+            node.insn.opcode = inverse(node.insn.opcode);
+            node.insn.target = nodes[after].insn.target;
+            node.bytes[0] = node.insn.opcode;
+            nodes[after].removed = true;
+            stats.inverted++;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/*
+ * Returns whether an instruction sets the flags without reading them.
+ */
+static bool sets_flags(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_SUB:
+        case VM_SUBI:
+        case VM_CMP:
+        case VM_TEST:
+        case VM_MEMCMP:
+        case VM_MEMCHR:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Whether the flags may be read after each remaining instruction
+ * before they are set again. Only conditional jumps read them. Calls
+ * pass them on to the callee and every return and halt keeps them, so
+ * the flags a function leaves behind reach the code after its calls.
+ */
+static std::vector<bool> flags_live(void) {
+    std::vector<bool> in(end + 1, false), out(end + 1, false);
+    std::vector<uint32_t> order;
+    bool changed = true;
+
+    for (uint32_t i = resolve(0); i < end; i = next(i))
+        order.push_back(i);
+
+    while (changed) {
+        changed = false;
+
+        for (auto it = order.rbegin(); it != order.rend(); it++) {
+            const vinsn& insn = nodes[*it].insn;
+            bool after = false;
+
+            if (insn.opcode == VM_CALL || insn.opcode == VM_RCALL) {
+                after = in[resolve(insn.target)];
+            } else if (insn.opcode == VM_RET || insn.opcode == VM_HLT) {
+                after = true;
+            } else {
+                if (falls_through(insn.opcode))
+                    after = after || in[next(*it)];
+                if (insn_has_target(insn))
+                    after = after || in[resolve(insn.target)];
+            }
+
+            const bool before = !sets_flags(insn.opcode) && (after || insn_is_jcc(insn.opcode));
+
+            if (after != out[*it] || before != in[*it]) {
+                out[*it] = after;
+                in[*it] = before;
+                changed = true;
+            }
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Dead code elimination.
+ */
+static bool sweep(void) {
+    bool changed = false;
+
+    /*
+     * Instructions reachable from the entry point. Calls continue at
+     * the instruction after them when the callee returns.
+     */
+    std::vector<bool> reached(end, false);
+    std::vector<uint32_t> work = { resolve(0) };
+
+    while (!work.empty()) {
+        const uint32_t i = work.back();
+
+        work.pop_back();
+        if (i >= end || reached[i])
+            continue;
+        reached[i] = true;
+
+        const vinsn& insn = nodes[i].insn;
+
+        if (insn_has_target(insn))
+            work.push_back(resolve(insn.target));
+        if (falls_through(insn.opcode))
+            work.push_back(next(i));
+    }
+
+    for (uint32_t i = 0; i < end; i++) {
+        if (!nodes[i].removed && !reached[i]) {
+            nodes[i].removed = true;
+            stats.unreachable++;
+            changed = true;
+        } else if (!nodes[i].removed && nodes[i].insn.opcode == VM_NOP) {
+            nodes[i].removed = true;
+            stats.dead++;
+            changed = true;
+        }
+    }
+
+    /*
+     * Pure writes overwritten before they are read, within a block
+     * where every register is live at the end, and compares whose
+     * flags are never read.
+     */
+    const std::vector<bool> leader = leaders();
+    const std::vector<bool> flags = flags_live();
+    std::vector<uint32_t> order;
+
+    for (uint32_t i = resolve(0); i < end; i = next(i))
+        order.push_back(i);
+
+    uint32_t live = OPT_ALL;
+
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+        vnode& node = nodes[*it];
+        const OPCODE opcode = node.insn.opcode;
+
+        if (leader[next(*it)] || next(*it) == end)
+            live = OPT_ALL;
+
+        if ((is_pure(opcode) && !(live & OPT_REG(node.insn.ra))) || ((opcode == VM_CMP || opcode == VM_TEST) && !flags[*it])) {
+            node.removed = true;
+            stats.dead++;
+            changed = true;
+            continue;
+        }
+
+        live = (live & ~kills(node.insn)) | uses(node.insn);
+    }
+
+    return changed;
+}
+
+/*
+ * Lay out the remaining instructions and relocate branch targets.
+ * offsets maps every input index (and end) to its output offset.
+ */
+static std::vector<uint8_t> layout(std::vector<uint32_t>& offsets) {
+    std::vector<uint8_t> code;
+
+    offsets.assign(end + 1, 0);
+    for (uint32_t i = 0; i < end; i++) {
+        offsets[i] = code.size();
+        if (!nodes[i].removed)
+            code.insert(code.end(), nodes[i].bytes.begin(), nodes[i].bytes.end());
+    }
+    offsets[end] = code.size();
+
+    for (uint32_t i = resolve(0); i < end; i = next(i)) {
+        const vinsn& insn = nodes[i].insn;
+
+        if (!insn_has_target(insn))
+            continue;
+
+        uint32_t value = offsets[resolve(insn.target)];
+
+        if (insn.opcode == VM_RCALL)
+            value -= offsets[i] + 5;
+        memcpy(&code[offsets[i] + 1], &value, sizeof(value));
+    }
+
+    return code;
+}
+
+/*
+ * Reason the program cannot be optimised, or null.
+ */
+static const char *unsupported(void) {
+    for (uint32_t i = 0; i < end; i++) {
+        const vinsn& insn = nodes[i].insn;
+
+        if (insn.opcode == VM_FAULT)
+            return "invalid instruction";
+        if (insn.opcode == VM_PASSTHRU)
+            return "vm_passthru";
+        if (insn_has_target(insn) && insn.target >= end)
+            return "branch target outside the code";
+        if ((is_pure(insn.opcode) || insn.opcode == VM_SUB || insn.opcode == VM_SUBI || insn.opcode == VM_CMP ||
+             insn.opcode == VM_TEST || insn.opcode == VM_XCHG) &&
+            (insn.ra >= NUM_REGISTERS || (reads_rb(insn.opcode) && insn.rb >= NUM_REGISTERS)))
+            return "invalid register";
+    }
+
+    return nullptr;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s START] [-l LENGTH] [-v] -o OUT FILE.bin|FILE.obvm\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *input = nullptr, *output = nullptr;
+    unsigned long start = 0, length = ULONG_MAX;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            start = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            length = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-v"))
+            verbose = true;
+        else if (argv[i][0] != '-' && !input)
+            input = argv[i];
+        else
+            usage(argv[0]);
+    }
+
+    if (!input || !output)
+        usage(argv[0]);
+
+    /*
+     * Read the file.
+     */
+    FILE *file = fopen(input, "rb");
+    if (!file) {
+        perror(input);
+        return 1;
+    }
+
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + read);
+    fclose(file);
+
+    /*
+     * Containers carry the bounds of their sections. The data section
+     * is copied and the symbols are relocated.
+     */
+    vheader header;
+    bool container = false;
+    std::vector<uint8_t> data;
+    std::vector<std::pair<std::string, uint32_t>> symbols;
+
+    if (bytes.size() >= sizeof(header)) {
+        memcpy(&header, bytes.data(), sizeof(header));
+        container = header.magic == VM_CONTAINER_MAGIC;
+    }
+
+    if (container) {
+        if ((uint64_t)header.code_offset + header.code_size > bytes.size() ||
+            (uint64_t)header.data_offset + header.data_size > bytes.size() ||
+            (uint64_t)header.symbols_offset + header.symbols_size > bytes.size()) {
+            fprintf(stderr, "%s: section exceeds the end of the file\n", input);
+            return 1;
+        }
+
+        if (start == 0 && length == ULONG_MAX) {
+            start = header.code_offset;
+            length = header.code_size;
+        }
+        data.assign(bytes.begin() + header.data_offset, bytes.begin() + header.data_offset + header.data_size);
+
+        for (uint32_t at = header.symbols_offset; at < header.symbols_offset + header.symbols_size;) {
+            uint32_t value;
+
+            if (header.symbols_offset + header.symbols_size - at < 5 || header.symbols_offset + header.symbols_size - at < 5u + bytes[at + 4]) {
+                fprintf(stderr, "%s: truncated symbol table\n", input);
+                return 1;
+            }
+            memcpy(&value, &bytes[at], sizeof(value));
+            symbols.emplace_back(std::string((const char *)&bytes[at + 5], bytes[at + 4]), value);
+            at += 5 + bytes[at + 4];
+        }
+    }
+
+    if (start > bytes.size()) {
+        fprintf(stderr, "%s: start 0x%lx is past the end of the file\n", input, start);
+        return 1;
+    }
+
+    std::vector<OPCODE> code(bytes.begin() + start, bytes.end());
+    if (length < code.size())
+        code.resize(length);
+
+    decode_stream(code.data(), (uint32_t)code.size(), stream);
+    end = stream.index((REG)code.size());
+
+    nodes.resize(end);
+    for (uint32_t i = 0; i < end; i++) {
+        const uint32_t vpc = stream.vaddr[i];
+        const uint32_t size = (i + 1 < end ? stream.vaddr[i + 1] : stream.vsize) - vpc;
+
+        nodes[i].insn = stream.insns[i];
+        nodes[i].bytes.assign(code.begin() + vpc, code.begin() + vpc + size);
+        nodes[i].removed = false;
+        nodes[i].jump = NUM_REGISTERS;
+    }
+
+    /*
+     * Resolve the register jumps, then optimise until nothing changes.
+     * Register jumps left after that have unknown targets.
+     */
+    std::vector<OPCODE> optimised = code;
+    std::vector<uint32_t> offsets;
+    const char *reason = end == 0 ? "empty code section" : unsupported();
+    bool consistent = true;
+
+    while (reason == nullptr && fold(&consistent))
+        ;
+
+    if (reason == nullptr && !consistent)
+        reason = "register jump with an unknown target";
+    for (uint32_t i = resolve(0); i < end && reason == nullptr; i = next(i))
+        if (nodes[i].insn.opcode == VM_JMP || is_jcc_reg(nodes[i].insn))
+            reason = "register jump with an unknown target";
+
+    for (int round = 0; reason == nullptr && round < OPT_ROUNDS; round++) {
+        bool changed = fold();
+
+        changed |= thread();
+        changed |= sweep();
+        if (!changed)
+            break;
+    }
+
+    if (reason == nullptr) {
+        vstream result;
+        vverify verify;
+
+        optimised = layout(offsets);
+        decode_stream(optimised.data(), (uint32_t)optimised.size(), result);
+        if (!verify_stream(result, verify)) {
+            static std::string message;
+
+            message = "does not verify (" + strerr(verify.error) + ")";
+            reason = message.c_str();
+        }
+    }
+
+    if (reason != nullptr) {
+        fprintf(stderr, "%s: not optimised: %s\n", input, reason);
+        optimised = code;
+        offsets.clear();
+    }
+
+    if (verbose && reason == nullptr) {
+        uint32_t kept = 0;
+
+        for (const vnode& node : nodes)
+            kept += !node.removed;
+        fprintf(stderr, "%s: %u -> %u instructions, %zu -> %zu bytes\n", input, end, kept, code.size(), optimised.size());
+        fprintf(stderr, "    folded %u, resolved %u, decided %u, threaded %u, inverted %u\n",
+                stats.folded, stats.resolved, stats.decided, stats.threaded, stats.inverted);
+        fprintf(stderr, "    dropped %u unreachable, %u dead, %u jumps to the next instruction\n",
+                stats.unreachable, stats.dead, stats.jumps);
+    }
+
+    /*
+     * Symbols at an instruction move with it. Symbols at a dropped
+     * instruction move to the instruction that runs in its place. Other
+     * symbols are kept as they are.
+     */
+    if (!offsets.empty()) {
+        for (auto& symbol : symbols) {
+            if (symbol.second < stream.vsize && stream.index(symbol.second) < end)
+                symbol.second = offsets[resolve(stream.index(symbol.second))];
+            else if (symbol.second == stream.vsize)
+                symbol.second = optimised.size();
+        }
+    }
+
+    FILE *out = fopen(output, "wb");
+    if (!out) {
+        perror(output);
+        return 1;
+    }
+
+    if (container) {
+        std::vector<uint8_t> table;
+
+        for (const auto& symbol : symbols) {
+            const uint32_t value = symbol.second;
+
+            table.insert(table.end(), (const uint8_t *)&value, (const uint8_t *)&value + sizeof(value));
+            table.push_back((uint8_t)symbol.first.size());
+            table.insert(table.end(), symbol.first.begin(), symbol.first.end());
+        }
+
+        header.code_offset = sizeof(header);
+        header.code_size = optimised.size();
+        header.data_offset = header.code_offset + header.code_size;
+        header.data_size = data.size();
+        header.symbols_offset = header.data_offset + header.data_size;
+        header.symbols_size = table.size();
+
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(optimised.data(), 1, optimised.size(), out);
+        fwrite(data.data(), 1, data.size(), out);
+        fwrite(table.data(), 1, table.size(), out);
+    } else {
+        fwrite(optimised.data(), 1, optimised.size(), out);
+    }
+
+    if (fclose(out) != 0) {
+        perror(output);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <cstring>
+
+#include "bulk.h"
+
+#if !defined(VM_BULK_PORTABLE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VM_BULK_X86
+#include <immintrin.h>
+
+/*
+ * Vector loops advance i past equal bytes. They return true with i at
+ * the first difference, or false with fewer than a vector of bytes
+ * left for the next narrower loop.
+ */
+__attribute__((target("avx2")))
+static bool mismatch_avx2(const uint8_t *a, const uint8_t *b, const size_t length, size_t& i) {
+    for (; i + 64 <= length; i += 64) {
+        const __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                             _mm256_loadu_si256((const __m256i *)(b + i)));
+        const __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+                                             _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(lo, hi)) != 0xFFFFFFFF) {
+            const uint64_t equal = (uint32_t)_mm256_movemask_epi8(lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+
+            i += __builtin_ctzll(~equal);
+            return true;
+        }
+    }
+    for (; i + 32 <= length; i += 32) {
+        const uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                                      _mm256_loadu_si256((const __m256i *)(b + i))));
+
+        if (equal != 0xFFFFFFFF) {
+            i += __builtin_ctz(~equal);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+__attribute__((target("sse2")))
+static bool mismatch_sse2(const uint8_t *a, const uint8_t *b, const size_t length, size_t& i) {
+    for (; i + 16 <= length; i += 16) {
+        const uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                                _mm_loadu_si128((const __m128i *)(b + i))));
+
+        if (equal != 0xFFFF) {
+            i += __builtin_ctz(~equal);
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+size_t mem_mismatch(const uint8_t *a, const uint8_t *b, size_t length) {
+    size_t i = 0;
+
+#ifdef VM_BULK_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    static const bool sse2 = __builtin_cpu_supports("sse2");
+
+    if (avx2 && mismatch_avx2(a, b, length, i))
+        return i;
+    if (sse2 && mismatch_sse2(a, b, length, i))
+        return i;
+#endif
+    for (; i + 8 <= length; i += 8) {
+        uint64_t x, y;
+
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+            break;
+    }
+    for (; i < length && a[i] == b[i]; i++)
+        ;
+
+    return i;
+}
+
+size_t mem_find(const uint8_t *data, uint8_t value, size_t length) {
+    const void *match = memchr(data, value, length);
+
+    return match != nullptr ? (const uint8_t *)match - data : length;
+}
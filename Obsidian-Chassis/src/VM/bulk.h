@@ -0,0 +1,32 @@
+/*
+ * bulk.h
+ *
+ * Byte scanning kernels behind the VM_MEMCMP and VM_MEMCHR opcodes.
+ *
+ * Copies, fills and byte searches go to the C library, whose routines
+ * already pick SSE2/AVX2 code for the host. Comparing needs the offset
+ * of the first difference, which memcmp does not return, so mismatch
+ * has its own SSE2 and AVX2 loops on x86, picked by CPUID on first use.
+ * Define VM_BULK_PORTABLE to build the portable loop only.
+ *
+ * Included by vm.h after the base types.
+ */
+
+#ifndef __BULK_H__
+#define __BULK_H__
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Offset of the first byte where a and b differ, or length if they
+ * are equal.
+ */
+size_t mem_mismatch(const uint8_t *a, const uint8_t *b, size_t length);
+
+/*
+ * Offset of the first byte equal to value, or length if there is none.
+ */
+size_t mem_find(const uint8_t *data, uint8_t value, size_t length);
+
+#endif // !__BULK_H__
@@ -0,0 +1,49 @@
+/*
+ * container.h
+ *
+ * On-disk bytecode container.
+ *
+ * A container file holds a program that can be loaded at runtime
+ * instead of being linked into the host binary at _vm_start. All
+ * fields are little endian.
+ *
+ *   vheader                       at offset 0
+ *   code section                  code_offset, code_size bytes
+ *   initial data section          data_offset, data_size bytes (optional)
+ *   symbol table                  symbols_offset, symbols_size bytes (optional)
+ *
+ * The symbol table is a sequence of variable length entries:
+ *
+ *   uint32_t value                Code offset (or any value) of the symbol.
+ *   uint8_t length                Length of the name.
+ *   char name[length]             Name, not terminated.
+ *
+ * Containers are assembled with NASM from the macros in
+ * src/ASM/container.inc (nasm -fbin) and loaded with Program::open or
+ * VM::load, which map the file read-only and execute the code section
+ * in place.
+ */
+
+#ifndef __CONTAINER_H__
+#define __CONTAINER_H__
+
+#include <cstdint>
+
+#define VM_CONTAINER_MAGIC 0x4D56424F           // "OBVM"
+#define VM_CONTAINER_VERSION 1
+
+typedef struct _vheader {
+	uint32_t magic;				// VM_CONTAINER_MAGIC.
+	uint16_t version;			// VM_CONTAINER_VERSION.
+	uint16_t flags;				// Reserved, must be 0.
+	uint32_t code_offset;		// File offset of the code section.
+	uint32_t code_size;			// Size of the code section.
+	uint32_t data_offset;		// File offset of the initial data section.
+	uint32_t data_size;			// Size of the initial data section.
+	uint32_t symbols_offset;	// File offset of the symbol table.
+	uint32_t symbols_size;		// Size of the symbol table.
+} vheader;
+
+static_assert(sizeof(vheader) == 32, "vheader must match the on-disk layout");
+
+#endif // !__CONTAINER_H__
@@ -0,0 +1,588 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "crypto.h"
+
+#if !defined(VM_CRYPTO_PORTABLE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VM_CRYPTO_X86
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*
+ * Host instructions found by CPUID.
+ */
+typedef struct _vcpu {
+    bool aes;                       // AES-NI.
+    bool crc;                       // SSE4.2 CRC32.
+    bool sha;                       // SHA extensions with SSSE3 and SSE4.1.
+} vcpu;
+
+static const vcpu& cpu(void) {
+    static const vcpu features = [] {
+        vcpu f = {};
+        unsigned a, b, c, d;
+        bool ssse3 = false, sse41 = false;
+
+        if (__get_cpuid(1, &a, &b, &c, &d)) {
+            f.aes = c & bit_AES;
+            f.crc = c & bit_SSE4_2;
+            ssse3 = c & bit_SSSE3;
+            sse41 = c & bit_SSE4_1;
+        }
+        if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+            f.sha = (b & bit_SHA) && ssse3 && sse41;
+        return f;
+    }();
+
+    return features;
+}
+#endif
+
+static uint64_t load_be64(const uint8_t *p) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < 8; i++)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static void store_be64(uint8_t *p, uint64_t value) {
+    for (int i = 7; i >= 0; i--, value >>= 8)
+        p[i] = (uint8_t)value;
+}
+
+/*
+ * GF(2^8) arithmetic and the S-boxes, built at compile time.
+ */
+static constexpr uint8_t xtime(const uint8_t x) {
+    return (uint8_t)(x << 1) ^ (x & 0x80 ? 0x1B : 0);
+}
+
+static constexpr uint8_t gmul(uint8_t a, uint8_t b) {
+    uint8_t p = 0;
+
+    for (; b; b >>= 1, a = xtime(a))
+        if (b & 1)
+            p ^= a;
+    return p;
+}
+
+static constexpr std::array<uint8_t, 256> make_sbox(void) {
+    std::array<uint8_t, 256> sbox = {};
+
+    for (int x = 0; x < 256; x++) {
+        /*
+         * Multiplicative inverse as x^254, then the affine transform.
+         */
+        uint8_t power = x, inverse = 1;
+
+        for (int i = 1; i < 8; i++) {
+            power = gmul(power, power);
+            inverse = gmul(inverse, power);
+        }
+
+        uint8_t s = 0x63;
+
+        for (int i = 0; i < 5; i++)
+            s ^= (uint8_t)(inverse << i | inverse >> (8 - i));
+        sbox[x] = s;
+    }
+
+    return sbox;
+}
+
+static constexpr std::array<uint8_t, 256> make_inverse(const std::array<uint8_t, 256>& sbox) {
+    std::array<uint8_t, 256> inverse = {};
+
+    for (int x = 0; x < 256; x++)
+        inverse[sbox[x]] = x;
+    return inverse;
+}
+
+static constexpr std::array<uint8_t, 256> s_sbox = make_sbox();
+static constexpr std::array<uint8_t, 256> s_inverse = make_inverse(s_sbox);
+
+static void inv_mix_columns(uint8_t *state) {
+    for (int c = 0; c < 4; c++) {
+        uint8_t *col = state + 4 * c;
+        const uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+
+        col[0] = gmul(a0, 14) ^ gmul(a1, 11) ^ gmul(a2, 13) ^ gmul(a3, 9);
+        col[1] = gmul(a0, 9) ^ gmul(a1, 14) ^ gmul(a2, 11) ^ gmul(a3, 13);
+        col[2] = gmul(a0, 13) ^ gmul(a1, 9) ^ gmul(a2, 14) ^ gmul(a3, 11);
+        col[3] = gmul(a0, 11) ^ gmul(a1, 13) ^ gmul(a2, 9) ^ gmul(a3, 14);
+    }
+}
+
+/*
+ * Portable FIPS-197 cipher on one block, and the equivalent inverse
+ * cipher.
+ */
+static void encrypt_block(const uint8_t (*keys)[AES_BLOCK_SIZE], const unsigned rounds, const uint8_t *in, uint8_t *out) {
+    uint8_t s[AES_BLOCK_SIZE], t[AES_BLOCK_SIZE];
+
+    for (int i = 0; i < AES_BLOCK_SIZE; i++)
+        s[i] = in[i] ^ keys[0][i];
+
+    for (unsigned round = 1; round <= rounds; round++) {
+        /*
+         * SubBytes and ShiftRows.
+         */
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++)
+                t[r + 4 * c] = s_sbox[s[r + 4 * ((c + r) % 4)]];
+
+        if (round == rounds) {
+            memcpy(s, t, sizeof(s));
+        } else {
+            for (int c = 0; c < 4; c++) {
+                const uint8_t *col = t + 4 * c;
+                const uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+
+                for (int r = 0; r < 4; r++)
+                    s[r + 4 * c] = col[r] ^ all ^ xtime(col[r] ^ col[(r + 1) % 4]);
+            }
+        }
+
+        for (int i = 0; i < AES_BLOCK_SIZE; i++)
+            s[i] ^= keys[round][i];
+    }
+
+    memcpy(out, s, sizeof(s));
+}
+
+static void decrypt_block(const uint8_t (*keys)[AES_BLOCK_SIZE], const unsigned rounds, const uint8_t *in, uint8_t *out) {
+    uint8_t s[AES_BLOCK_SIZE], t[AES_BLOCK_SIZE];
+
+    for (int i = 0; i < AES_BLOCK_SIZE; i++)
+        s[i] = in[i] ^ keys[0][i];
+
+    for (unsigned round = 1; round <= rounds; round++) {
+        /*
+         * InvSubBytes and InvShiftRows.
+         */
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++)
+                t[r + 4 * ((c + r) % 4)] = s_inverse[s[r + 4 * c]];
+
+        if (round != rounds)
+            inv_mix_columns(t);
+
+        for (int i = 0; i < AES_BLOCK_SIZE; i++)
+            s[i] = t[i] ^ keys[round][i];
+    }
+
+    memcpy(out, s, sizeof(s));
+}
+
+#ifdef VM_CRYPTO_X86
+/*
+ * AES-NI. AESENC has a latency of several cycles but issues every
+ * cycle, so AES_NI_WAY independent blocks are kept in flight.
+ */
+#define AES_NI_WAY 8
+
+template <bool Decrypt>
+__attribute__((target("aes,sse2")))
+static inline __m128i round_ni(const __m128i b, const __m128i k) {
+    return Decrypt ? _mm_aesdec_si128(b, k) : _mm_aesenc_si128(b, k);
+}
+
+template <bool Decrypt>
+__attribute__((target("aes,sse2")))
+static inline __m128i last_ni(const __m128i b, const __m128i k) {
+    return Decrypt ? _mm_aesdeclast_si128(b, k) : _mm_aesenclast_si128(b, k);
+}
+
+/*
+ * Run n <= AES_NI_WAY blocks through the rounds.
+ */
+template <bool Decrypt, size_t N>
+__attribute__((target("aes,sse2")))
+static inline void cipher_ni(const __m128i *k, const unsigned rounds, __m128i *b) {
+    /*
+     * The blocks must stay in registers, so unroll across them.
+     */
+#pragma GCC unroll 8
+    for (size_t j = 0; j < N; j++)
+        b[j] = _mm_xor_si128(b[j], k[0]);
+    for (unsigned i = 1; i < rounds; i++) {
+#pragma GCC unroll 8
+        for (size_t j = 0; j < N; j++)
+            b[j] = round_ni<Decrypt>(b[j], k[i]);
+    }
+#pragma GCC unroll 8
+    for (size_t j = 0; j < N; j++)
+        b[j] = last_ni<Decrypt>(b[j], k[rounds]);
+}
+
+template <bool Decrypt>
+__attribute__((target("aes,sse2")))
+static void blocks_ni(const uint8_t (*keys)[AES_BLOCK_SIZE], const unsigned rounds, const uint8_t *in, uint8_t *out, size_t blocks) {
+    __m128i k[AES_MAX_ROUNDS + 1], b[AES_NI_WAY];
+
+    for (unsigned i = 0; i <= rounds; i++)
+        k[i] = _mm_load_si128((const __m128i *)keys[i]);
+
+    for (; blocks >= AES_NI_WAY; blocks -= AES_NI_WAY, in += sizeof(b), out += sizeof(b)) {
+        for (size_t j = 0; j < AES_NI_WAY; j++)
+            b[j] = _mm_loadu_si128((const __m128i *)in + j);
+        cipher_ni<Decrypt, AES_NI_WAY>(k, rounds, b);
+        for (size_t j = 0; j < AES_NI_WAY; j++)
+            _mm_storeu_si128((__m128i *)out + j, b[j]);
+    }
+
+    for (; blocks > 0; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+        b[0] = _mm_loadu_si128((const __m128i *)in);
+        cipher_ni<Decrypt, 1>(k, rounds, b);
+        _mm_storeu_si128((__m128i *)out, b[0]);
+    }
+}
+
+/*
+ * Counter mode with the counter blocks built in registers.
+ */
+__attribute__((target("aes,sse2")))
+static void ctr_ni(const uint8_t (*keys)[AES_BLOCK_SIZE], const unsigned rounds, const uint8_t *in, uint8_t *out, size_t length, uint64_t& hi, uint64_t& lo) {
+    __m128i k[AES_MAX_ROUNDS + 1], b[AES_NI_WAY];
+
+    for (unsigned i = 0; i <= rounds; i++)
+        k[i] = _mm_load_si128((const __m128i *)keys[i]);
+
+    while (length > 0) {
+        const size_t n = std::min<size_t>(AES_NI_WAY, (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+
+        for (size_t j = 0; j < n; j++) {
+            b[j] = _mm_set_epi64x((long long)__builtin_bswap64(lo), (long long)__builtin_bswap64(hi));
+            if (++lo == 0)
+                ++hi;
+        }
+
+        if (n == AES_NI_WAY && length >= sizeof(b)) {
+            cipher_ni<false, AES_NI_WAY>(k, rounds, b);
+            for (size_t j = 0; j < AES_NI_WAY; j++)
+                _mm_storeu_si128((__m128i *)out + j, _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)in + j)));
+            in += sizeof(b);
+            out += sizeof(b);
+            length -= sizeof(b);
+            continue;
+        }
+
+        /*
+         * Last blocks, the final one possibly partial.
+         */
+        uint8_t stream[sizeof(b)];
+
+        for (size_t j = 0; j < n; j++) {
+            cipher_ni<false, 1>(k, rounds, &b[j]);
+            _mm_storeu_si128((__m128i *)stream + j, b[j]);
+        }
+        for (size_t i = 0; i < length; i++)
+            out[i] = in[i] ^ stream[i];
+        length = 0;
+    }
+}
+#endif
+
+AES::AES() {
+    static const uint8_t zero[16] = {};
+
+    set_key(zero, sizeof(zero));
+}
+
+bool AES::set_key(const uint8_t *key, const unsigned length) {
+    if (length != 16 && length != 32)
+        return false;
+
+    const unsigned nk = length / 4;
+    uint8_t *w = &m_enc[0][0];
+    uint8_t rcon = 1;
+
+    m_rounds = nk + 6;
+    memcpy(w, key, length);
+
+    for (unsigned i = nk; i < 4 * (m_rounds + 1); i++) {
+        uint8_t t[4];
+
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % nk == 0) {
+            const uint8_t first = t[0];
+
+            t[0] = s_sbox[t[1]] ^ rcon;
+            t[1] = s_sbox[t[2]];
+            t[2] = s_sbox[t[3]];
+            t[3] = s_sbox[first];
+            rcon = xtime(rcon);
+        } else if (nk > 6 && i % nk == 4) {
+            for (int j = 0; j < 4; j++)
+                t[j] = s_sbox[t[j]];
+        }
+        for (int j = 0; j < 4; j++)
+            w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+    }
+
+    /*
+     * Round keys of the equivalent inverse cipher: reversed, with
+     * InvMixColumns applied to the inner ones.
+     */
+    for (unsigned i = 0; i <= m_rounds; i++) {
+        memcpy(m_dec[i], m_enc[m_rounds - i], AES_BLOCK_SIZE);
+        if (i != 0 && i != m_rounds)
+            inv_mix_columns(m_dec[i]);
+    }
+
+    return true;
+}
+
+void AES::encrypt(const uint8_t *in, uint8_t *out, size_t blocks) const {
+#ifdef VM_CRYPTO_X86
+    if (cpu().aes)
+        return blocks_ni<false>(m_enc, m_rounds, in, out, blocks);
+#endif
+    for (; blocks > 0; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE)
+        encrypt_block(m_enc, m_rounds, in, out);
+}
+
+void AES::decrypt(const uint8_t *in, uint8_t *out, size_t blocks) const {
+#ifdef VM_CRYPTO_X86
+    if (cpu().aes)
+        return blocks_ni<true>(m_dec, m_rounds, in, out, blocks);
+#endif
+    for (; blocks > 0; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE)
+        decrypt_block(m_dec, m_rounds, in, out);
+}
+
+void AES::ctr(const uint8_t *in, uint8_t *out, size_t length, uint8_t *counter) const {
+    /*
+     * Encrypt a batch of counter blocks at a time, then XOR.
+     */
+    uint8_t blocks[8 * AES_BLOCK_SIZE], stream[8 * AES_BLOCK_SIZE];
+    uint64_t hi = load_be64(counter), lo = load_be64(counter + 8);
+
+#ifdef VM_CRYPTO_X86
+    if (cpu().aes) {
+        ctr_ni(m_enc, m_rounds, in, out, length, hi, lo);
+        length = 0;
+    }
+#endif
+    while (length > 0) {
+        const size_t n = std::min<size_t>(8, (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+        const size_t bytes = std::min<size_t>(length, n * AES_BLOCK_SIZE);
+
+        for (size_t i = 0; i < n; i++) {
+            store_be64(blocks + i * AES_BLOCK_SIZE, hi);
+            store_be64(blocks + i * AES_BLOCK_SIZE + 8, lo);
+            if (++lo == 0)
+                ++hi;
+        }
+
+        encrypt(blocks, stream, n);
+        for (size_t i = 0; i < bytes; i++)
+            out[i] = in[i] ^ stream[i];
+
+        in += bytes;
+        out += bytes;
+        length -= bytes;
+    }
+
+    store_be64(counter, hi);
+    store_be64(counter + 8, lo);
+}
+
+/*
+ * Reflected CRC32C table.
+ */
+static constexpr std::array<uint32_t, 256> make_crc32c(void) {
+    std::array<uint32_t, 256> table = {};
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++)
+            crc = crc >> 1 ^ (crc & 1 ? 0x82F63B78 : 0);
+        table[i] = crc;
+    }
+
+    return table;
+}
+
+static constexpr std::array<uint32_t, 256> s_crc32c = make_crc32c();
+
+#ifdef VM_CRYPTO_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t value;
+
+        memcpy(&value, data, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+    crc = (uint32_t)crc64;
+#else
+    for (; length >= 4; length -= 4, data += 4) {
+        uint32_t value;
+
+        memcpy(&value, data, sizeof(value));
+        crc = _mm_crc32_u32(crc, value);
+    }
+#endif
+    for (; length > 0; length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t length) {
+    crc = ~crc;
+#ifdef VM_CRYPTO_X86
+    if (cpu().crc)
+        return ~crc32c_sse42(crc, data, length);
+#endif
+    for (; length > 0; length--)
+        crc = s_crc32c[(crc ^ *data++) & 0xFF] ^ crc >> 8;
+    return ~crc;
+}
+
+static const uint32_t s_sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static uint32_t rotr(const uint32_t x, const int n) {
+    return x >> n | x << (32 - n);
+}
+
+static void sha256_portable(uint32_t *state, const uint8_t *data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | data[4 * i + 1] << 16 | data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ w[i - 15] >> 3;
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ w[i - 2] >> 10;
+
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + s_sha256_k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef VM_CRYPTO_X86
+/*
+ * SHA extensions. The state is kept as ABEF and CDGH; each group of
+ * four rounds extends the message schedule four words ahead.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_ni(uint32_t *state, const uint8_t *data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        const __m128i abef = state0, cdgh = state1;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++)
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + i), mask);
+
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; g++) {
+            __m128i m = _mm_add_epi32(msg[g % 4], _mm_loadu_si128((const __m128i *)&s_sha256_k[4 * g]));
+
+            state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+            if (g >= 3 && g <= 14) {
+                __m128i& next = msg[(g + 1) % 4];
+
+                next = _mm_add_epi32(next, _mm_alignr_epi8(msg[g % 4], msg[(g + 3) % 4], 4));
+                next = _mm_sha256msg2_epu32(next, msg[g % 4]);
+            }
+            m = _mm_shuffle_epi32(m, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+            if (g >= 1 && g <= 12)
+                msg[(g + 3) % 4] = _mm_sha256msg1_epu32(msg[(g + 3) % 4], msg[g % 4]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static void sha256_blocks(uint32_t *state, const uint8_t *data, size_t blocks) {
+#ifdef VM_CRYPTO_X86
+    if (cpu().sha)
+        return sha256_ni(state, data, blocks);
+#endif
+    sha256_portable(state, data, blocks);
+}
+
+void sha256(const uint8_t *data, size_t length, uint8_t *digest) {
+    uint32_t state[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    const size_t blocks = length / 64, rest = length % 64;
+    uint8_t tail[128] = {};
+
+    sha256_blocks(state, data, blocks);
+
+    /*
+     * Pad the rest with a one bit, zeros and the bit length.
+     */
+    const size_t padded = rest < 56 ? 64 : 128;
+
+    memcpy(tail, data + blocks * 64, rest);
+    tail[rest] = 0x80;
+    store_be64(tail + padded - 8, (uint64_t)length * 8);
+    sha256_blocks(state, tail, padded / 64);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
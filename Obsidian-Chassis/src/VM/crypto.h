@@ -0,0 +1,72 @@
+/*
+ * crypto.h
+ *
+ * AES, CRC32C and SHA-256 behind the VM_AES*, VM_CRC32C and VM_SHA256
+ * opcodes.
+ *
+ * Every primitive has a portable implementation and, on x86, one using
+ * AES-NI, SSE4.2 or the SHA extensions. The first use picks the
+ * instructions CPUID reports, so one binary runs on any host. Define
+ * VM_CRYPTO_PORTABLE to build the portable code only, e.g. for
+ * compilers without the GCC target attribute.
+ *
+ * Included by vm.h after the base types.
+ */
+
+#ifndef __CRYPTO_H__
+#define __CRYPTO_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+#define SHA256_DIGEST_SIZE 32
+
+class AES {
+	private:
+	/*
+	 * Encryption round keys in FIPS-197 byte order, and the decryption
+	 * round keys of the equivalent inverse cipher used by AES-NI.
+	 */
+	alignas(16) uint8_t m_enc[AES_MAX_ROUNDS + 1][AES_BLOCK_SIZE];
+	alignas(16) uint8_t m_dec[AES_MAX_ROUNDS + 1][AES_BLOCK_SIZE];
+	unsigned m_rounds;					// 10 or 14.
+
+	public:
+	/*
+	 * Starts with an all zero 128-bit key.
+	 */
+	AES();
+
+	/*
+	 * Expand a 16 or 32 byte key. Returns false for other lengths.
+	 */
+	bool set_key(const uint8_t *key, const unsigned length);
+
+	/*
+	 * Encrypt or decrypt blocks of AES_BLOCK_SIZE bytes (ECB).
+	 */
+	void encrypt(const uint8_t *in, uint8_t *out, size_t blocks) const;
+	void decrypt(const uint8_t *in, uint8_t *out, size_t blocks) const;
+
+	/*
+	 * Encrypt or decrypt length bytes in counter mode. The counter is
+	 * a 128-bit big endian block, incremented once per block and left
+	 * at the next unused value.
+	 */
+	void ctr(const uint8_t *in, uint8_t *out, size_t length, uint8_t *counter) const;
+};
+
+/*
+ * CRC32C (Castagnoli) of length bytes, continuing from the CRC of the
+ * preceding data or 0.
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t length);
+
+/*
+ * SHA-256 digest of length bytes.
+ */
+void sha256(const uint8_t *data, size_t length, uint8_t *digest);
+
+#endif // !__CRYPTO_H__
@@ -0,0 +1,475 @@
+#include <cstring>
+
+#include "decode.h"
+#include "err.h"
+#include "opcodes.h"
+
+/*
+ * Operand layouts of the instruction set.
+ */
+enum {
+    FMT_INVALID,            // Unknown opcode.
+    FMT_NONE,               // op
+    FMT_R,                  // op reg
+    FMT_RR,                 // op reg, reg
+    FMT_RRR,                // op reg, reg, reg
+    FMT_RRRR,               // op reg, reg, reg, reg
+    FMT_RI8,                // op reg, imm8
+    FMT_RRI8,               // op reg, reg, imm8
+    FMT_RI16,               // op reg, imm16
+    FMT_RI32,               // op reg, imm32
+    FMT_I32,                // op imm32
+    FMT_J32,                // op imm32 (absolute branch target)
+    FMT_JR32,               // op imm32 (relative branch target)
+    FMT_RC4C,               // op reg, reg, imm32, reg
+    FMT_RC4M,               // op reg, reg, reg, imm32, imm8, imm8
+    FMT_PASSTHRU            // op imm32, native code
+};
+
+static int format(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_HLT:
+        case VM_PUSHAD:
+        case VM_POPAD:
+        case VM_RET:
+        case VM_NOP:
+            return FMT_NONE;
+
+        case VM_INC:
+        case VM_DEC:
+        case VM_NEG:
+        case VM_NOT:
+        case VM_PUSH:
+        case VM_POP:
+        case VM_JMP:
+        case VM_JE:
+        case VM_JNE:
+        case VM_JL:
+        case VM_JLE:
+        case VM_JNL:
+        case VM_JNLE:
+        case VM_JB:
+        case VM_JBE:
+        case VM_JNB:
+        case VM_JNBE:
+        case VM_JC:
+        case VM_JNC:
+        case VM_JS:
+        case VM_JNS:
+        case VM_JO:
+        case VM_JNO:
+        case VM_CONOUT:
+            return FMT_R;
+
+        case VM_MOV:
+        case VM_ADD:
+        case VM_SUB:
+        case VM_ADC:
+        case VM_SBB:
+        case VM_LEA:
+        case VM_OR:
+        case VM_AND:
+        case VM_NOR:
+        case VM_XOR:
+        case VM_TEST:
+        case VM_SHR:
+        case VM_SHL:
+        case VM_SAR:
+        case VM_SAL:
+        case VM_DIV:
+        case VM_IDIV:
+        case VM_MUL:
+        case VM_IMUL:
+        case VM_MOD:
+        case VM_XCHG:
+        case VM_LOADB:
+        case VM_LOADBI:
+        case VM_LOADW:
+        case VM_LOADWI:
+        case VM_LOADD:
+        case VM_LOADDI:
+        case VM_STORB:
+        case VM_STORW:
+        case VM_STORD:
+        case VM_VLOAD:
+        case VM_VSTORE:
+        case VM_VMOV:
+        case VM_VBCASTD:
+        case VM_VXOR:
+        case VM_VAND:
+        case VM_VOR:
+        case VM_VADDB:
+        case VM_VADDW:
+        case VM_VADDD:
+        case VM_VSUBB:
+        case VM_VSUBW:
+        case VM_VSUBD:
+        case VM_VHADDB:
+        case VM_VHADDD:
+        case VM_VHXORD:
+            return FMT_RR;
+
+        case VM_VEXTRD:
+        case VM_VSHUFD:
+            return FMT_RRI8;
+
+        case VM_MEMCPY:
+        case VM_MEMSET:
+        case VM_AESE:
+        case VM_AESD:
+        case VM_CRC32C:
+        case VM_SHA256:
+            return FMT_RRR;
+
+        case VM_MEMCMP:
+        case VM_MEMCHR:
+        case VM_AESCTR:
+            return FMT_RRRR;
+
+        case VM_STORBI:
+        case VM_AESK:
+        case VM_VSHLD:
+        case VM_VSHRD:
+            return FMT_RI8;
+
+        case VM_STORWI:
+            return FMT_RI16;
+
+        case VM_MOVI:
+        case VM_ADDI:
+        case VM_SUBI:
+        case VM_CMP:
+        case VM_XORI:
+        case VM_STORDI:
+        case VM_RC4K:
+            return FMT_RI32;
+
+        case VM_PUSHI:
+            return FMT_I32;
+
+        case VM_JMPI:
+        case VM_JEI:
+        case VM_JNEI:
+        case VM_JLI:
+        case VM_JLEI:
+        case VM_JNLI:
+        case VM_JNLEI:
+        case VM_JBI:
+        case VM_JBEI:
+        case VM_JNBI:
+        case VM_JNBEI:
+        case VM_JCI:
+        case VM_JNCI:
+        case VM_JSI:
+        case VM_JNSI:
+        case VM_JOI:
+        case VM_JNOI:
+        case VM_CALL:
+            return FMT_J32;
+
+        case VM_RCALL:
+            return FMT_JR32;
+
+        case VM_RC4C:
+            return FMT_RC4C;
+
+        case VM_RC4M:
+            return FMT_RC4M;
+
+        case VM_PASSTHRU:
+            return FMT_PASSTHRU;
+
+        default:
+            return FMT_INVALID;
+    }
+}
+
+/*
+ * Read an unaligned immediate from the code section.
+ */
+template <typename T>
+static T imm(const OPCODE *code, const uint32_t vpc) {
+    T value;
+    memcpy(&value, &code[vpc], sizeof(value));
+    return value;
+}
+
+uint32_t insn_length(const OPCODE *code, const uint32_t size, const uint32_t vpc) {
+    uint64_t length = 0;
+
+    switch (format(code[vpc])) {
+        case FMT_NONE:
+            length = 1;
+            break;
+
+        case FMT_R:
+            length = 2;
+            break;
+
+        case FMT_RR:
+        case FMT_RI8:
+            length = 3;
+            break;
+
+        case FMT_RI16:
+        case FMT_RRR:
+        case FMT_RRI8:
+            length = 4;
+            break;
+
+        case FMT_RRRR:
+            length = 5;
+            break;
+
+        case FMT_I32:
+        case FMT_J32:
+        case FMT_JR32:
+            length = 5;
+            break;
+
+        case FMT_RI32:
+            length = 6;
+            break;
+
+        case FMT_RC4C:
+            length = 8;
+            break;
+
+        case FMT_RC4M:
+            length = 10;
+            break;
+
+        case FMT_PASSTHRU:
+            /*
+             * vm_passthru, native code and the trailing vm_passend.
+             */
+            if ((uint64_t)vpc + 5 > size)
+                return 0;
+            length = 6 + (uint64_t)imm<IMM32>(code, vpc + 1);
+            break;
+
+        default:
+            return 0;
+    }
+
+    /*
+     * Reject instructions truncated by the end of the code section.
+     */
+    if ((uint64_t)vpc + length > size)
+        return 0;
+
+    /*
+     * AES keys are 128 or 256 bits.
+     */
+    if (code[vpc] == VM_AESK && code[vpc + 2] != 16 && code[vpc + 2] != 32)
+        return 0;
+
+    /*
+     * Vector shifts count below the dword width and extracts index one 
+     * of the 8 dword lanes.
+     */
+    if ((code[vpc] == VM_VSHLD || code[vpc] == VM_VSHRD) && code[vpc + 2] >= 32)
+        return 0;
+    if (code[vpc] == VM_VEXTRD && code[vpc + 3] >= VECTOR_SIZE / 4)
+        return 0;
+
+    return (uint32_t)length;
+}
+
+uint32_t decode_insn(const OPCODE *code, const uint32_t size, const uint32_t vpc, vinsn& insn) {
+    const uint32_t length = insn_length(code, size, vpc);
+
+    insn = vinsn();
+
+    if (length == 0) {
+        insn.opcode = VM_FAULT;
+        insn.imm = ERR_OPCODE_INVALID;
+        return 1;
+    }
+
+    insn.opcode = code[vpc];
+
+    switch (format(insn.opcode)) {
+        case FMT_R:
+            insn.ra = code[vpc + 1];
+            break;
+
+        case FMT_RR:
+            insn.ra = code[vpc + 1];
+            insn.rb = code[vpc + 2];
+            break;
+
+        case FMT_RRR:
+            insn.ra = code[vpc + 1];
+            insn.rb = code[vpc + 2];
+            insn.rc = code[vpc + 3];
+            break;
+
+        case FMT_RRRR:
+            insn.ra = code[vpc + 1];
+            insn.rb = code[vpc + 2];
+            insn.rc = code[vpc + 3];
+            insn.imm = code[vpc + 4];
+            break;
+
+        case FMT_RI8:
+            insn.ra = code[vpc + 1];
+            insn.imm = imm<IMM8>(code, vpc + 2);
+            break;
+
+        case FMT_RRI8:
+            insn.ra = code[vpc + 1];
+            insn.rb = code[vpc + 2];
+            insn.imm = code[vpc + 3];
+            break;
+
+        case FMT_RI16:
+            insn.ra = code[vpc + 1];
+            insn.imm = imm<IMM16>(code, vpc + 2);
+            break;
+
+        case FMT_RI32:
+            insn.ra = code[vpc + 1];
+            insn.imm = imm<IMM32>(code, vpc + 2);
+            break;
+
+        case FMT_I32:
+        case FMT_PASSTHRU:
+            insn.imm = imm<IMM32>(code, vpc + 1);
+            break;
+
+        case FMT_J32:
+            insn.target = imm<IMM32>(code, vpc + 1);
+            insn.imm = vpc + length;
+            break;
+
+        case FMT_JR32:
+            insn.target = vpc + length + imm<IMM32>(code, vpc + 1);
+            insn.imm = vpc + length;
+            break;
+
+        case FMT_RC4C:
+            insn.ra = code[vpc + 1];
+            insn.rb = code[vpc + 2];
+            insn.imm = imm<IMM32>(code, vpc + 3);
+            insn.rc = code[vpc + 7];
+            break;
+
+        case FMT_RC4M:
+            insn.ra = code[vpc + 1];
+            insn.rb = code[vpc + 2];
+            insn.rc = code[vpc + 3];
+            insn.imm = imm<IMM32>(code, vpc + 4);
+            insn.target = code[vpc + 8] | code[vpc + 9] << 8;
+            break;
+
+        default:
+            break;
+    }
+
+    return length;
+}
+
+bool insn_has_target(const vinsn& insn) {
+    const int fmt = format(insn.opcode);
+
+    return fmt == FMT_J32 || fmt == FMT_JR32;
+}
+
+bool insn_is_jcc(const OPCODE opcode) {
+    return opcode >= VM_JE && opcode <= VM_JNOI;
+}
+
+/*
+ * Returns whether the opcode is a branch, call or return, which charge 
+ * the basic block they end to the time slice budget.
+ */
+static bool insn_is_jump(const OPCODE opcode) {
+    if (insn_is_jcc(opcode))
+        return true;
+
+    switch (opcode) {
+        case VM_JMP:
+        case VM_JMPI:
+        case VM_CALL:
+        case VM_RCALL:
+        case VM_RET:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+void decode_stream(const OPCODE *code, const uint32_t size, vstream& stream) {
+    stream.insns.clear();
+    stream.vaddr.clear();
+    stream.vindex.assign((size_t)size + 1, VINSN_NONE);
+    stream.vsize = size;
+
+    /*
+     * Linear sweep of the code section. Invalid bytes decode to one 
+     * byte faults so the sweep resynchronises on the next byte.
+     */
+    for (uint32_t vpc = 0; vpc < size;) {
+        vinsn insn;
+        const uint32_t length = decode_insn(code, size, vpc, insn);
+
+        stream.vindex[vpc] = stream.insns.size();
+        stream.vaddr.push_back(vpc);
+        stream.insns.push_back(insn);
+        vpc += length;
+    }
+
+    /*
+     * Sentinels for running off the end of the code section and for 
+     * branching into the middle of an instruction.
+     */
+    const uint32_t end = stream.insns.size();
+    vinsn fault = vinsn();
+
+    fault.opcode = VM_FAULT;
+    fault.imm = ERR_CODE_OUT_OF_BOUNDS;
+    stream.insns.push_back(fault);
+    stream.vaddr.push_back(size);
+
+    fault.imm = ERR_CODE_MISALIGNED;
+    stream.insns.push_back(fault);
+    stream.vaddr.push_back(size);
+
+    for (auto& index : stream.vindex)
+        if (index == VINSN_NONE)
+            index = end + 1;
+    stream.vindex[size] = end;
+
+    /*
+     * Resolve immediate branch targets to decoded indices.
+     */
+    for (auto& insn : stream.insns)
+        if (insn_has_target(insn))
+            insn.target = stream.index(insn.target);
+
+    /*
+     * Cost of each jump: the instructions from the start of its basic 
+     * block. Blocks start at branch targets and after jumps, so a loop 
+     * is charged its body once per iteration.
+     */
+    std::vector<bool> leader(end + 1, false);
+
+    leader[0] = true;
+    for (uint32_t i = 0; i < end; i++) {
+        const vinsn& insn = stream.insns[i];
+
+        if (insn_has_target(insn) && insn.target < end)
+            leader[insn.target] = true;
+        if (insn_is_jump(insn.opcode))
+            leader[i + 1] = true;
+    }
+
+    for (uint32_t i = 0, first = 0; i < end; i++) {
+        if (leader[i])
+            first = i;
+        if (insn_is_jump(stream.insns[i].opcode))
+            stream.insns[i].cost = i - first + 1;
+    }
+}
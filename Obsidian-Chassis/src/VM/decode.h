@@ -0,0 +1,53 @@
+/*
+ * decode.h
+ *
+ * Decoder that turns the byte-level code section into the fixed-width 
+ * decoded instruction stream executed by the VM.
+ */
+
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <cstdint>
+
+#include "vm.h"
+
+/*
+ * Index used in vstream::vindex for offsets that are not the start of 
+ * an instruction.
+ */
+#define VINSN_NONE UINT32_MAX
+
+/*
+ * Returns the length of the instruction at code offset vpc or 0 if the 
+ * opcode is invalid or the instruction is truncated by the end of the 
+ * code section.
+ */
+uint32_t insn_length(const OPCODE *code, const uint32_t size, const uint32_t vpc);
+
+/*
+ * Decodes the instruction at code offset vpc into insn. Branch targets 
+ * are left as code offsets in insn.target. Invalid instructions are 
+ * decoded as a one byte VM_FAULT. Returns the instruction length.
+ */
+uint32_t decode_insn(const OPCODE *code, const uint32_t size, const uint32_t vpc, vinsn& insn);
+
+/*
+ * Returns whether the decoded instruction has an immediate branch 
+ * target in its target field.
+ */
+bool insn_has_target(const vinsn& insn);
+
+/*
+ * Returns whether the opcode is a conditional jump (VM_JE to VM_JNOI), 
+ * i.e. reads EFLAGS.
+ */
+bool insn_is_jcc(const OPCODE opcode);
+
+/*
+ * Decodes a whole code section into stream and resolves immediate 
+ * branch targets to decoded indices.
+ */
+void decode_stream(const OPCODE *code, const uint32_t size, vstream& stream);
+
+#endif // !__DECODE_H__
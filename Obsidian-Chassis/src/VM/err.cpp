@@ -6,7 +6,15 @@ std::map<uint32_t, std::string> errmsg {
     { ERR_CODE_OUT_OF_BOUNDS, "Code section exceeded bounds" },
     { ERR_DATA_OUT_OF_BOUNDS, "Data section exceeded bounds" },
     { ERR_STACK_UNDERFLOW, "Stack underflow" },
-    { ERR_STACK_OVERFLOW, "Stack overflow" }
+    { ERR_STACK_OVERFLOW, "Stack overflow" },
+    { ERR_CODE_MISALIGNED, "Branch target not on an instruction boundary" },
+    { ERR_DATA_READ_ONLY, "Write to read-only data" },
+    { ERR_TRACE_DIVERGED, "Replay diverged from the trace" },
+    { ERR_REGISTER_INVALID, "Invalid register operand" },
+    { ERR_STACK_UNBALANCED, "Stack depth differs between paths" },
+    { ERR_CODE_INDIRECT, "Register jump target cannot be verified" },
+    { ERR_PROGRAM_UNVERIFIED, "Program failed verification" },
+    { ERR_DIVIDE_BY_ZERO, "Division by zero" }
 };
 
 std::string strerr(uint32_t code) {
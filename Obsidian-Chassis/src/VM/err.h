@@ -11,6 +11,14 @@
 #define ERR_DATA_OUT_OF_BOUNDS 4            // Data segmentation fault.
 #define ERR_STACK_UNDERFLOW 5               // Popping value beneath stack base.
 #define ERR_STACK_OVERFLOW 6                // Stack pointer somehow greater than stack size.
+#define ERR_CODE_MISALIGNED 7               // Branch into the middle of an instruction.
+#define ERR_DATA_READ_ONLY 8                // Write to a read-only binding.
+#define ERR_TRACE_DIVERGED 9                // Replay left the recorded path.
+#define ERR_REGISTER_INVALID 10             // Register operand past the register file.
+#define ERR_STACK_UNBALANCED 11             // Stack depth not the same on every path.
+#define ERR_CODE_INDIRECT 12                // Register jump the verifier cannot follow.
+#define ERR_PROGRAM_UNVERIFIED 13           // Program failed verification (VM_VERIFIED builds).
+#define ERR_DIVIDE_BY_ZERO 14               // vm_div or vm_idiv by a zero register.
 
 extern std::map<uint32_t, std::string> errmsg;
 
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <map>
+
+#include "decode.h"
+#include "opcodes.h"
+#include "vm.h"
+
+/*
+ * Copies the operands of a matched sequence into the fused 
+ * instruction. Returns false if the sequence cannot be fused.
+ */
+static bool pack(const vinsn *seq, vinsn& fused) {
+    switch (fused.opcode) {
+        case VM_TEST_JEI:
+        case VM_TEST_JNEI:
+            fused.ra = seq[0].ra;
+            fused.rb = seq[0].rb;
+            fused.target = seq[1].target;
+            fused.cost = seq[1].cost;
+            return true;
+
+        case VM_CMP_JEI:
+        case VM_CMP_JNEI:
+            fused.ra = seq[0].ra;
+            fused.imm = seq[0].imm;
+            fused.target = seq[1].target;
+            fused.cost = seq[1].cost;
+            return true;
+
+        case VM_PUSH_DEC_CALL:
+            fused.ra = seq[0].ra;
+            fused.rb = seq[1].ra;
+            fused.imm = seq[2].imm;                                         // Return address.
+            fused.target = seq[2].target;
+            fused.cost = seq[2].cost;
+            return true;
+
+        case VM_POP_MUL:
+            fused.ra = seq[0].ra;
+            fused.rb = seq[1].ra;
+            fused.rc = seq[1].rb;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Returns whether the instruction may transfer control anywhere but 
+ * the next instruction.
+ */
+static bool transfers(const OPCODE opcode) {
+    if (insn_is_jcc(opcode))
+        return true;
+
+    switch (opcode) {
+        case VM_HLT:
+        case VM_JMP:
+        case VM_JMPI:
+        case VM_CALL:
+        case VM_RCALL:
+        case VM_RET:
+        case VM_PASSTHRU:
+        case VM_FAULT:
+        case VM_JITBLOCK:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+const std::vector<vfusion>& default_fusions() {
+    static const std::vector<vfusion> fusions = {
+        { VM_PUSH_DEC_CALL, 3, { VM_PUSH, VM_DEC, VM_CALL } },
+        { VM_TEST_JEI, 2, { VM_TEST, VM_JEI } },
+        { VM_TEST_JNEI, 2, { VM_TEST, VM_JNEI } },
+        { VM_CMP_JEI, 2, { VM_CMP, VM_JEI } },
+        { VM_CMP_JNEI, 2, { VM_CMP, VM_JNEI } },
+        { VM_POP_MUL, 2, { VM_POP, VM_MUL } }
+    };
+
+    return fusions;
+}
+
+uint32_t fuse_stream(vstream& stream, const std::vector<vfusion>& fusions) {
+    /*
+     * Real instructions end at the out of bounds sentinel.
+     */
+    const uint32_t end = stream.vindex[stream.vsize];
+    uint32_t count = 0;
+
+    /*
+     * Match against the unfused instructions so sequences may overlap, 
+     * e.g. the second instruction of one sequence can start another 
+     * one for when it is reached by a branch.
+     */
+    const std::vector<vinsn> original(stream.insns.begin(), stream.insns.begin() + end);
+
+    for (uint32_t i = 0; i < end; i++) {
+        for (const auto& fusion : fusions) {
+            if (fusion.length < 2 || fusion.length > VM_FUSE_MAX || i + fusion.length > end)
+                continue;
+
+            bool match = true;
+            for (uint32_t k = 0; k < fusion.length && match; k++)
+                match = original[i + k].opcode == fusion.sequence[k];
+
+            vinsn fused = vinsn();
+            fused.opcode = fusion.fused;
+
+            if (match && pack(&original[i], fused)) {
+                stream.insns[i] = fused;
+                count++;
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+vinsn unfuse(const vinsn& insn) {
+    vinsn first = vinsn();
+    first.ra = insn.ra;
+
+    switch (insn.opcode) {
+        case VM_TEST_JEI:
+        case VM_TEST_JNEI:
+            first.opcode = VM_TEST;
+            first.rb = insn.rb;
+            return first;
+
+        case VM_CMP_JEI:
+        case VM_CMP_JNEI:
+            first.opcode = VM_CMP;
+            first.imm = insn.imm;
+            return first;
+
+        case VM_PUSH_DEC_CALL:
+            first.opcode = VM_PUSH;
+            return first;
+
+        case VM_POP_MUL:
+            first.opcode = VM_POP;
+            return first;
+
+        default:
+            return insn;
+    }
+}
+
+const char *opcode_name(const OPCODE opcode) {
+    switch (opcode) {
+#define X(op) case op: return #op;
+        VM_OPCODE_LIST(X)
+#undef X
+        default:
+            return "?";
+    }
+}
+
+void fuse_stats(const vstream& stream, const unsigned n, const unsigned top, std::ostream& out) {
+    const uint32_t end = stream.vindex[stream.vsize];
+    std::map<std::vector<OPCODE>, uint32_t> counts;
+
+    for (uint32_t i = 0; i + n <= end; i++) {
+        std::vector<OPCODE> gram;
+
+        for (uint32_t k = 0; k < n; k++) {
+            const OPCODE opcode = stream.insns[i + k].opcode;
+
+            if (k + 1 < n && transfers(opcode))
+                break;
+            gram.push_back(opcode);
+        }
+
+        if (gram.size() == n)
+            counts[gram]++;
+    }
+
+    std::vector<std::pair<std::vector<OPCODE>, uint32_t>> sorted(counts.begin(), counts.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.second > b.second;
+    });
+
+    out << "[*] Most frequent " << n << "-grams:\n";
+    for (size_t i = 0; i < sorted.size() && i < top; i++) {
+        out << "    " << sorted[i].second;
+        for (const auto opcode : sorted[i].first)
+            out << " " << opcode_name(opcode);
+        out << "\n";
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * fuse.h
+ *
+ * Superinstruction fusion for the decoded stream.
+ *
+ * Common instruction sequences (e.g. vm_test followed by vm_jei) are 
+ * rewritten at load time into a single fused opcode whose handler 
+ * performs the whole sequence with one dispatch. The fused opcode 
+ * replaces the first instruction of the sequence only. The remaining 
+ * instructions stay in the stream untouched and are skipped by the 
+ * fused handler, so branches into the middle of a sequence and code 
+ * offset mapping keep working without any relocation.
+ *
+ * The patterns are read from a table (see default_fusions) that can be 
+ * replaced per VM with VM::set_fusions before the VM is started.
+ *
+ * Compile with -DVM_FUSE_STATS to print the most frequent opcode 
+ * n-grams of the program when it is loaded, to pick new patterns.
+ *
+ * Included by vm.h after the decoded stream types.
+ */
+
+#ifndef __FUSE_H__
+#define __FUSE_H__
+
+#include <ostream>
+
+/*
+ * Maximum number of instructions in a fused sequence.
+ */
+#define VM_FUSE_MAX 3
+
+/*
+ * Fusion pattern.
+ */
+typedef struct _vfusion {
+	OPCODE fused;						// Fused opcode installed on the first instruction.
+	uint8_t length;						// Number of instructions in the sequence.
+	OPCODE sequence[VM_FUSE_MAX];		// Opcodes of the sequence.
+} vfusion;
+
+/*
+ * Returns the built-in fusion table.
+ */
+const std::vector<vfusion>& default_fusions();
+
+/*
+ * Fuses the instructions of stream matching the patterns in fusions. 
+ * Patterns are tried in table order and patterns with a fused opcode 
+ * the VM does not know are ignored. Returns the number of sequences 
+ * fused.
+ */
+uint32_t fuse_stream(vstream& stream, const std::vector<vfusion>& fusions);
+
+/*
+ * Returns the first instruction of the sequence a fused instruction 
+ * was built from, or the instruction itself if it is not fused.
+ */
+vinsn unfuse(const vinsn& insn);
+
+/*
+ * Returns the name of an opcode.
+ */
+const char *opcode_name(const OPCODE opcode);
+
+/*
+ * Prints the top most frequent opcode n-grams of the stream that could 
+ * be fused, i.e. where only the last instruction may transfer control.
+ */
+void fuse_stats(const vstream& stream, const unsigned n, const unsigned top, std::ostream& out);
+
+#endif // !__FUSE_H__
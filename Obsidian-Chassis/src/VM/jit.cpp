@@ -0,0 +1,902 @@
+#include <cstddef>
+#include <cstring>
+
+#include "decode.h"
+#include "opcodes.h"
+#include "vm.h"
+
+#ifdef VM_JIT
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+/*
+ * Returns whether the instruction reads EFLAGS.
+ */
+static bool reads_flags(const vinsn& insn) {
+    return insn_is_jcc(insn.opcode);
+}
+
+/*
+ * Returns whether the instruction writes EFLAGS.
+ */
+static bool writes_flags(const vinsn& insn) {
+    switch (insn.opcode) {
+        case VM_SUB:
+        case VM_SUBI:
+        case VM_CMP:
+        case VM_TEST:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Returns whether the instruction ends a basic block.
+ */
+static bool ends_block(const vinsn& insn) {
+    if (insn_is_jcc(insn.opcode))
+        return true;
+
+    switch (insn.opcode) {
+        case VM_HLT:
+        case VM_JMP:
+        case VM_JMPI:
+        case VM_CALL:
+        case VM_RCALL:
+        case VM_RET:
+        case VM_PASSTHRU:
+        case VM_FAULT:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+JIT::JIT() : m_stream(nullptr), m_buffer(nullptr), m_used(0) {
+#if defined(__x86_64__)
+    void *buffer = mmap(nullptr, VM_JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (buffer != MAP_FAILED)
+        m_buffer = (uint8_t *)buffer;
+#endif
+}
+
+JIT::~JIT() {
+#if defined(__x86_64__)
+    if (m_buffer)
+        munmap(m_buffer, VM_JIT_BUFFER_SIZE);
+#endif
+}
+
+void JIT::attach(vstream& stream) {
+    m_stream = &stream;
+    m_blocks.clear();
+
+    /*
+     * Real instructions end at the out of bounds sentinel.
+     */
+    const uint32_t end = stream.vindex[stream.vsize];
+    std::vector<bool> leader(end, false);
+
+    if (end == 0)
+        return;
+
+    leader[0] = true;
+    for (uint32_t i = 0; i < end; i++) {
+        const vinsn& insn = stream.insns[i];
+
+        if (insn_has_target(insn) && insn.target < end)
+            leader[insn.target] = true;
+        if (ends_block(insn) && i + 1 < end)
+            leader[i + 1] = true;
+    }
+
+    /*
+     * Build the blocks and their cold copies. A cold copy is the
+     * original leader followed by a jump to the second instruction of
+     * the block, appended after the sentinels so code offsets still
+     * resolve through vaddr.
+     */
+    for (uint32_t i = 0; i < end; i++) {
+        if (!leader[i])
+            continue;
+
+        vblock block = vblock();
+        block.first = i;
+        block.last = i;
+        while (block.last + 1 < end && !leader[block.last + 1])
+            block.last++;
+
+        for (uint32_t j = block.first; j <= block.last; j++) {
+            const vinsn& insn = stream.insns[j];
+
+            if (reads_flags(insn) && !block.writes)
+                block.reads = true;
+            if (writes_flags(insn))
+                block.writes = true;
+        }
+
+        vinsn resume = vinsn();
+        resume.opcode = VM_JMPI;
+        resume.target = i + 1;
+
+        const vinsn original = stream.insns[i];
+
+        block.cold = stream.insns.size();
+        stream.insns.push_back(original);
+        stream.vaddr.push_back(stream.vaddr[i]);
+        stream.insns.push_back(resume);
+        stream.vaddr.push_back(stream.vaddr[i + 1]);
+
+        m_blocks.push_back(block);
+    }
+
+    liveness();
+
+    /*
+     * Install the counting instructions on the leaders.
+     */
+    for (uint32_t id = 0; id < m_blocks.size(); id++) {
+        vinsn counter = vinsn();
+        counter.opcode = VM_JITBLOCK;
+        counter.imm = id;
+        counter.cost = m_blocks[id].last - m_blocks[id].first + 1;          // Charged like a jump, compiled blocks run whole.
+        stream.insns[m_blocks[id].first] = counter;
+    }
+}
+
+void JIT::liveness() {
+    const uint32_t end = m_stream->vindex[m_stream->vsize];
+    std::vector<uint32_t> block_of(end + 1, UINT32_MAX);
+
+    for (uint32_t id = 0; id < m_blocks.size(); id++)
+        block_of[m_blocks[id].first] = id;
+
+    /*
+     * Successors of each block. Unknown successors (register indirect
+     * jumps and returns) make EFLAGS live out.
+     */
+    std::vector<std::vector<uint32_t>> succs(m_blocks.size());
+    std::vector<bool> unknown(m_blocks.size(), false);
+
+    for (uint32_t id = 0; id < m_blocks.size(); id++) {
+        const vinsn& last = m_stream->insns[m_blocks[id].last];
+        const uint32_t next = m_blocks[id].last + 1;
+        bool falls = true;
+
+        switch (last.opcode) {
+            case VM_HLT:
+            case VM_FAULT:
+                falls = false;
+                break;
+
+            case VM_JMPI:
+            case VM_CALL:
+            case VM_RCALL:
+                falls = false;
+                break;
+
+            case VM_JMP:
+            case VM_RET:
+                falls = false;
+                unknown[id] = true;
+                break;
+
+            case VM_JE:
+            case VM_JNE:
+                unknown[id] = true;
+                break;
+
+            default:
+                break;
+        }
+
+        if (insn_has_target(last)) {
+            if (last.target < end)
+                succs[id].push_back(block_of[last.target]);
+            else
+                unknown[id] = true;
+        }
+        if (falls && next < end)
+            succs[id].push_back(block_of[next]);
+    }
+
+    /*
+     * Iterate to a fixed point. Liveness only ever grows.
+     */
+    for (bool changed = true; changed;) {
+        changed = false;
+
+        for (uint32_t id = 0; id < m_blocks.size(); id++) {
+            bool live_out = unknown[id];
+
+            for (const auto succ : succs[id]) {
+                const vblock& s = m_blocks[succ];
+                live_out = live_out || s.reads || (!s.writes && s.live_out);
+            }
+
+            if (live_out != m_blocks[id].live_out) {
+                m_blocks[id].live_out = live_out;
+                changed = true;
+            }
+        }
+    }
+}
+
+vinsn JIT::original(const vblock& block, const uint32_t index) const {
+    /*
+     * The leader in the stream is the VM_JITBLOCK counter. Fused 
+     * instructions are compiled as their first instruction, the rest 
+     * of the sequence follows them in the stream.
+     */
+    return index == block.first ? m_stream->insns[block.cold] : unfuse(m_stream->insns[index]);
+}
+
+uint32_t JIT::enter(const uint32_t id, REG *vreg, vflags *flags, int64_t *budget) {
+    vblock& block = m_blocks[id];
+
+    if (block.code == nullptr) {
+        if (block.failed || ++block.count < VM_JIT_THRESHOLD)
+            return block.cold;
+
+        if (!compile(block)) {
+            /*
+             * Nothing to compile. Put the original leader back so the
+             * block no longer pays for the counter.
+             */
+            block.failed = true;
+            m_stream->insns[block.first] = m_stream->insns[block.cold];
+            return block.cold;
+        }
+    }
+
+    return block.code(vreg, flags, budget);
+}
+
+#if defined(__x86_64__)
+
+/*
+ * Host registers.
+ */
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/*
+ * Host condition codes.
+ */
+enum {
+    CC_O = 0x0,
+    CC_NO = 0x1,
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+    CC_NS = 0x9,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF
+};
+
+/*
+ * Returns the host condition code of an immediate conditional jump. 
+ * The VM flags have x86 semantics so the codes map one to one.
+ */
+static int condition(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_JEI:    return CC_E;
+        case VM_JNEI:   return CC_NE;
+        case VM_JLI:    return CC_L;
+        case VM_JLEI:   return CC_LE;
+        case VM_JNLI:   return CC_GE;
+        case VM_JNLEI:  return CC_G;
+        case VM_JBI:
+        case VM_JCI:    return CC_B;
+        case VM_JBEI:   return CC_BE;
+        case VM_JNBI:
+        case VM_JNCI:   return CC_AE;
+        case VM_JNBEI:  return CC_A;
+        case VM_JSI:    return CC_S;
+        case VM_JNSI:   return CC_NS;
+        case VM_JOI:    return CC_O;
+        case VM_JNOI:   return CC_NO;
+        default:        return -1;
+    }
+}
+
+/*
+ * Group 1 ALU operations (the /digit of opcode 0x81).
+ */
+enum {
+    ALU_ADD = 0,
+    ALU_OR = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7
+};
+
+/*
+ * Host registers guest registers are allocated to. rax and rdx are
+ * scratch, rdi holds m_vreg and rsi holds m_vflags. The budget pointer
+ * passed in rdx is kept on the host stack.
+ */
+static const int host_regs[] = { RCX, R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15 };
+
+static bool callee_saved(const int reg) {
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+
+/*
+ * Location of a guest register in compiled code: a host register or
+ * its slot in m_vreg addressed through rdi.
+ */
+typedef struct _vloc {
+    bool mem;
+    int reg;                // Host register, or guest register if mem.
+} vloc;
+
+static vloc host(const int reg) {
+    return { false, reg };
+}
+
+/*
+ * Minimal x86-64 instruction emitter for 32-bit operations.
+ */
+class emitter {
+    public:
+    std::vector<uint8_t> code;
+
+    void byte(const uint8_t b) {
+        code.push_back(b);
+    }
+
+    void dword(const uint32_t d) {
+        for (int i = 0; i < 4; i++)
+            byte((d >> (i * 8)) & 0xFF);
+    }
+
+    void patch(const size_t at, const uint32_t d) {
+        for (int i = 0; i < 4; i++)
+            code[at + i] = (d >> (i * 8)) & 0xFF;
+    }
+
+    /*
+     * Emit [REX] opcode ModRM [disp8] for a reg, r/m operand pair.
+     */
+    void op(const uint8_t *opcode, const size_t length, const int reg, const vloc& rm) {
+        const uint8_t rex = 0x40 | (reg >= 8 ? 0x4 : 0) | (!rm.mem && rm.reg >= 8 ? 0x1 : 0);
+
+        if (rex != 0x40)
+            byte(rex);
+        for (size_t i = 0; i < length; i++)
+            byte(opcode[i]);
+
+        if (rm.mem) {
+            byte(0x40 | ((reg & 7) << 3) | RDI);
+            byte(rm.reg * sizeof(REG));
+        } else {
+            byte(0xC0 | ((reg & 7) << 3) | (rm.reg & 7));
+        }
+    }
+
+    void op(const uint8_t opcode, const int reg, const vloc& rm) {
+        op(&opcode, 1, reg, rm);
+    }
+
+    void mov(const vloc& dst, const vloc& src) {
+        if (!dst.mem)
+            op(0x8B, dst.reg, src);
+        else if (!src.mem)
+            op(0x89, src.reg, dst);
+        else {
+            op(0x8B, RAX, src);
+            op(0x89, RAX, dst);
+        }
+    }
+
+    void mov(const vloc& dst, const uint32_t imm) {
+        op(0xC7, 0, dst);
+        dword(imm);
+    }
+
+    void alu(const int alu, const vloc& dst, const vloc& src) {
+        if (!dst.mem)
+            op((alu << 3) | 3, dst.reg, src);
+        else if (!src.mem)
+            op((alu << 3) | 1, src.reg, dst);
+        else {
+            op(0x8B, RAX, src);
+            op((alu << 3) | 1, RAX, dst);
+        }
+    }
+
+    void alu(const int alu, const vloc& dst, const uint32_t imm) {
+        op(0x81, alu, dst);
+        dword(imm);
+    }
+
+    void test(const vloc& a, const vloc& b) {
+        if (!b.mem)
+            op(0x85, b.reg, a);
+        else if (!a.mem)
+            op(0x85, a.reg, b);
+        else {
+            op(0x8B, RAX, b);
+            op(0x85, RAX, a);
+        }
+    }
+
+    void unary(const uint8_t opcode, const int ext, const vloc& dst) {
+        op(opcode, ext, dst);
+    }
+
+    void imul(const vloc& dst, const vloc& src) {
+        static const uint8_t opcode[] = { 0x0F, 0xAF };
+
+        if (!dst.mem)
+            op(opcode, 2, dst.reg, src);
+        else {
+            op(0x8B, RAX, dst);
+            op(opcode, 2, RAX, src);
+            op(0x89, RAX, dst);
+        }
+    }
+
+    /*
+     * Emit [REX] opcode ModRM disp8 for a reg, [rsi + disp] operand pair.
+     */
+    void flags(const uint8_t opcode, const int reg, const size_t disp) {
+        if (reg >= 8)
+            byte(0x44);
+        byte(opcode);
+        byte(0x40 | ((reg & 7) << 3) | RSI);
+        byte(disp);
+    }
+
+    /*
+     * Store a guest register or an immediate into a m_vflags field.
+     */
+    void store(const size_t disp, const vloc& src) {
+        if (src.mem) {
+            op(0x8B, RAX, src);
+            flags(0x89, RAX, disp);
+        } else {
+            flags(0x89, src.reg, disp);
+        }
+    }
+
+    void store(const size_t disp, const uint32_t imm) {
+        flags(0xC7, 0, disp);
+        dword(imm);
+    }
+
+    /*
+     * Subtract count from the 64-bit counter whose address is stored 
+     * at [rsp + disp].
+     */
+    void charge(const size_t disp, const uint32_t count) {
+        byte(0x48);                                                         // mov rax, [rsp + disp8]
+        byte(0x8B);
+        byte(0x44);
+        byte(0x24);
+        byte(disp);
+        byte(0x48);                                                         // sub qword [rax], imm32
+        byte(0x81);
+        byte(0x28);
+        dword(count);
+    }
+
+    /*
+     * Emit a jcc rel32 and return the offset of its displacement.
+     */
+    size_t jcc(const int cc) {
+        byte(0x0F);
+        byte(0x80 | cc);
+        dword(0);
+        return code.size() - 4;
+    }
+
+    void push(const int reg) {
+        if (reg >= 8)
+            byte(0x41);
+        byte(0x50 | (reg & 7));
+    }
+
+    void pop(const int reg) {
+        if (reg >= 8)
+            byte(0x41);
+        byte(0x58 | (reg & 7));
+    }
+};
+
+/*
+ * Returns whether the JIT can compile the instruction.
+ */
+static bool supported(const vinsn& insn) {
+    switch (insn.opcode) {
+        case VM_MOV:
+        case VM_ADD:
+        case VM_SUB:
+        case VM_LEA:
+        case VM_OR:
+        case VM_AND:
+        case VM_NOR:
+        case VM_XOR:
+        case VM_TEST:
+        case VM_MUL:
+        case VM_IMUL:
+        case VM_XCHG:
+            return insn.ra < NUM_REGISTERS && insn.rb < NUM_REGISTERS;
+
+        case VM_MOVI:
+        case VM_ADDI:
+        case VM_SUBI:
+        case VM_XORI:
+        case VM_CMP:
+        case VM_INC:
+        case VM_DEC:
+        case VM_NEG:
+        case VM_NOT:
+            return insn.ra < NUM_REGISTERS;
+
+        case VM_NOP:
+        case VM_JMPI:
+            return true;
+
+        default:
+            return condition(insn.opcode) >= 0;
+    }
+}
+
+bool JIT::compile(vblock& block) {
+    if (m_buffer == nullptr)
+        return false;
+
+    /*
+     * Compile up to the first unsupported instruction.
+     */
+    uint32_t stop = block.first;
+    while (stop <= block.last && supported(original(block, stop)))
+        stop++;
+    if (stop == block.first)
+        return false;
+
+    /*
+     * Allocate host registers to the guest registers the block uses.
+     */
+    vloc loc[NUM_REGISTERS];
+    bool used[NUM_REGISTERS] = {};
+    bool written[NUM_REGISTERS] = {};
+    size_t allocated = 0;
+
+    for (uint32_t i = block.first; i < stop; i++) {
+        const vinsn insn = original(block, i);
+
+        if (reads_flags(insn))
+            continue;
+
+        switch (insn.opcode) {
+            case VM_NOP:
+            case VM_JMPI:
+                break;
+
+            case VM_MOVI:
+            case VM_ADDI:
+            case VM_SUBI:
+            case VM_XORI:
+            case VM_CMP:
+            case VM_INC:
+            case VM_DEC:
+            case VM_NEG:
+            case VM_NOT:
+                used[insn.ra] = true;
+                written[insn.ra] = written[insn.ra] || insn.opcode != VM_CMP;
+                break;
+
+            default:
+                used[insn.ra] = used[insn.rb] = true;
+                written[insn.ra] = written[insn.ra] || insn.opcode != VM_TEST;
+                written[insn.rb] = written[insn.rb] || insn.opcode == VM_XCHG;
+                break;
+        }
+    }
+
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        if (used[r] && allocated < sizeof(host_regs) / sizeof(host_regs[0]))
+            loc[r] = host(host_regs[allocated++]);
+        else
+            loc[r] = { true, r };
+    }
+
+    emitter e;
+
+    /*
+     * Prologue: save the budget pointer and callee-saved host registers 
+     * and load guest registers.
+     */
+    size_t budget = 0;
+
+    e.push(RDX);
+    for (size_t i = 0; i < allocated; i++) {
+        if (callee_saved(host_regs[i])) {
+            e.push(host_regs[i]);
+            budget += 8;
+        }
+    }
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        if (!loc[r].mem)
+            e.mov(loc[r], vloc { true, r });
+
+    /*
+     * Branches back to the leader stay in native code.
+     */
+    const size_t body = e.code.size();
+
+    /*
+     * Exit: write back guest registers, restore host registers and
+     * return the next decoded index. Branches back to the leader charge 
+     * the block to the budget first and only leave once it is used up, 
+     * so the interpreter can end the time slice.
+     */
+    auto exit = [&](const uint32_t next) {
+        if (next == block.first) {
+            e.charge(budget, block.last - block.first + 1);
+
+            const size_t loop = e.jcc(CC_G);
+            e.patch(loop, body - (loop + 4));
+        }
+
+        for (int r = 0; r < NUM_REGISTERS; r++)
+            if (!loc[r].mem && written[r])
+                e.mov(vloc { true, r }, loc[r]);
+        for (size_t i = allocated; i-- > 0;)
+            if (callee_saved(host_regs[i]))
+                e.pop(host_regs[i]);
+        e.pop(RDX);
+        e.byte(0xB8);                                                       // mov eax, imm32
+        e.dword(next);
+        e.byte(0xC3);                                                       // ret
+    };
+
+    /*
+     * Returns whether the flags written at index i may be read later.
+     * When the only reader is the block terminator right behind the
+     * writer, the host flags are used directly and nothing is stored.
+     */
+    bool host_flags = false;
+    auto flags_needed = [&](const uint32_t i) {
+        for (uint32_t j = i + 1; j <= block.last; j++) {
+            const vinsn insn = original(block, j);
+
+            if (reads_flags(insn))
+                return true;
+            if (writes_flags(insn))
+                return false;
+        }
+        return block.live_out;
+    };
+    auto host_flags_only = [&](const uint32_t i) {
+        return i + 1 == block.last && i + 1 < stop && reads_flags(original(block, i + 1)) && !block.live_out;
+    };
+
+    /*
+     * Decide how the flags of the writer at index i are kept. Returns 
+     * whether its operands and result must be stored to m_vflags.
+     */
+    auto writer = [&](const uint32_t i) {
+        host_flags = host_flags_only(i);
+        return !host_flags && flags_needed(i);
+    };
+
+    const size_t DST = offsetof(vflags, dst);
+    const size_t SRC = offsetof(vflags, src);
+    const size_t RES = offsetof(vflags, res);
+
+    bool terminated = false;
+
+    for (uint32_t i = block.first; i < stop; i++) {
+        const vinsn insn = original(block, i);
+        const vloc& a = loc[insn.ra < NUM_REGISTERS ? insn.ra : 0];
+        const vloc& b = loc[insn.rb < NUM_REGISTERS ? insn.rb : 0];
+
+        switch (insn.opcode) {
+            case VM_MOV:
+            case VM_LEA:
+                if (insn.ra != insn.rb)
+                    e.mov(a, b);
+                break;
+
+            case VM_MOVI:
+                e.mov(a, insn.imm);
+                break;
+
+            case VM_ADD:
+                e.alu(ALU_ADD, a, b);
+                break;
+
+            case VM_ADDI:
+                e.alu(ALU_ADD, a, insn.imm);
+                break;
+
+            case VM_SUB:
+                if (writer(i)) {
+                    e.store(DST, a);
+                    e.store(SRC, b);
+                    e.alu(ALU_SUB, a, b);
+                    e.store(RES, a);
+                } else {
+                    e.alu(ALU_SUB, a, b);
+                }
+                break;
+
+            case VM_SUBI:
+                if (writer(i)) {
+                    e.store(DST, a);
+                    e.store(SRC, insn.imm);
+                    e.alu(ALU_SUB, a, insn.imm);
+                    e.store(RES, a);
+                } else {
+                    e.alu(ALU_SUB, a, insn.imm);
+                }
+                break;
+
+            case VM_CMP:
+                if (writer(i)) {
+                    e.mov(host(RAX), a);
+                    e.store(DST, host(RAX));
+                    e.store(SRC, insn.imm);
+                    e.alu(ALU_SUB, host(RAX), insn.imm);
+                    e.store(RES, host(RAX));
+                } else {
+                    e.alu(ALU_CMP, a, insn.imm);
+                }
+                break;
+
+            case VM_TEST:
+                /*
+                 * Recorded as the result of the AND minus zero.
+                 */
+                if (writer(i)) {
+                    e.mov(host(RAX), a);
+                    e.alu(ALU_AND, host(RAX), b);
+                    e.store(DST, host(RAX));
+                    e.store(SRC, 0);
+                    e.store(RES, host(RAX));
+                } else {
+                    e.test(a, b);
+                }
+                break;
+
+            case VM_OR:
+                e.alu(ALU_OR, a, b);
+                break;
+
+            case VM_AND:
+                e.alu(ALU_AND, a, b);
+                break;
+
+            case VM_NOR:
+                e.alu(ALU_OR, a, b);
+                e.unary(0xF7, 2, a);                                        // not
+                break;
+
+            case VM_XOR:
+                e.alu(ALU_XOR, a, b);
+                break;
+
+            case VM_XORI:
+                e.alu(ALU_XOR, a, insn.imm);
+                break;
+
+            case VM_INC:
+                e.unary(0xFF, 0, a);
+                break;
+
+            case VM_DEC:
+                e.unary(0xFF, 1, a);
+                break;
+
+            case VM_NEG:
+            case VM_NOT:
+                e.unary(0xF7, 2, a);                                        // NEG is bitwise in the VM.
+                break;
+
+            case VM_MUL:
+            case VM_IMUL:
+                e.imul(a, b);
+                break;
+
+            case VM_XCHG:
+                /*
+                 * The interpreter swaps with XOR, so exchanging a
+                 * register with itself clears it.
+                 */
+                if (insn.ra == insn.rb)
+                    e.mov(a, 0);
+                else {
+                    e.mov(host(RAX), a);
+                    e.mov(host(RDX), b);
+                    e.mov(a, host(RDX));
+                    e.mov(b, host(RAX));
+                }
+                break;
+
+            case VM_NOP:
+                break;
+
+            case VM_JMPI:
+                exit(insn.target);
+                terminated = true;
+                break;
+
+            default: {
+                const int cc = condition(insn.opcode);
+
+                if (cc < 0)
+                    return false;
+
+                /*
+                 * Recreate the host flags of the last writer from its 
+                 * operands unless they are still live.
+                 */
+                if (!host_flags) {
+                    e.flags(0x8B, RAX, DST);                                // mov eax, [rsi + dst]
+                    e.flags(0x3B, RAX, SRC);                                // cmp eax, [rsi + src]
+                }
+                const size_t taken = e.jcc(cc);
+                exit(i + 1);
+                e.patch(taken, e.code.size() - (taken + 4));
+                exit(insn.target);
+                terminated = true;
+                break;
+            }
+        }
+
+        if (!writes_flags(insn))
+            host_flags = false;
+    }
+
+    if (!terminated)
+        exit(stop);
+
+    /*
+     * Copy the code into the executable buffer.
+     */
+    if (m_used + e.code.size() > VM_JIT_BUFFER_SIZE)
+        return false;
+
+    if (mprotect(m_buffer, VM_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    memcpy(m_buffer + m_used, e.code.data(), e.code.size());
+    mprotect(m_buffer, VM_JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+    block.code = (vjitcode)(m_buffer + m_used);
+    m_used += (e.code.size() + 15) & ~(size_t)15;
+
+    return true;
+}
+
+#else
+
+bool JIT::compile(vblock& block) {
+    /*
+     * No native backend for this host.
+     */
+    (void)block;
+    return false;
+}
+
+#endif // __x86_64__
+
+#endif // VM_JIT
@@ -0,0 +1,137 @@
+/*
+ * jit.h
+ *
+ * Baseline JIT for hot basic blocks.
+ *
+ * The decoded stream is split into basic blocks at branch targets and 
+ * after control transfers. The leader of every block is replaced with 
+ * an internal VM_JITBLOCK instruction that counts block executions and runs 
+ * a copy of the original leader (the cold copy) until the block becomes 
+ * hot. Hot blocks are compiled to native x86-64 code that keeps the 
+ * guest registers it uses in host registers and returns the decoded 
+ * index of the next instruction to the interpreter.
+ *
+ * A block is compiled up to the first instruction the JIT does not 
+ * support. That instruction (e.g. VM_PASSTHRU, VM_RC4C or VM_CONOUT) 
+ * and the rest of the block are executed by the interpreter. Blocks 
+ * that start with an unsupported instruction get their original leader 
+ * restored so they cost nothing.
+ *
+ * EFLAGS are only written back to m_vflags when a later instruction, 
+ * in the block or in a successor block, may read them. Conditional 
+ * jumps recreate the host flags from the recorded operands.
+ *
+ * Enabled with -DVM_JIT. Native code is only generated on x86-64 hosts, 
+ * elsewhere every block stays interpreted.
+ *
+ * Included by vm.h after the decoded stream types.
+ */
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#ifdef VM_JIT
+
+/*
+ * Number of executions after which a block is compiled.
+ */
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD 64
+#endif
+
+/*
+ * Size of the executable code buffer.
+ */
+#ifndef VM_JIT_BUFFER_SIZE
+#define VM_JIT_BUFFER_SIZE 0x100000
+#endif
+
+/*
+ * Compiled block entry point. Returns the decoded index of the next 
+ * instruction to execute. Branches back to the leader stay native and 
+ * charge the block to budget until it is used up.
+ */
+typedef uint32_t (*vjitcode)(REG *vreg, vflags *flags, int64_t *budget);
+
+/*
+ * Basic block in the decoded stream.
+ */
+typedef struct _vblock {
+	uint32_t first;				// Decoded index of the leader.
+	uint32_t last;				// Decoded index of the last instruction.
+	uint32_t cold;				// Decoded index of the cold copy of the leader.
+	uint32_t count;				// Number of interpreted executions.
+	bool reads;					// Reads EFLAGS before writing them.
+	bool writes;				// Writes EFLAGS.
+	bool live_out;				// EFLAGS may be read after the block.
+	bool failed;				// Compilation failed, never retry.
+	vjitcode code;				// Compiled code or nullptr.
+} vblock;
+
+class JIT {
+	private:
+	/*
+	 * Decoded stream the blocks belong to.
+	 */
+	vstream *m_stream;
+
+	/*
+	 * Basic blocks indexed by the VM_JITBLOCK immediate of their leader.
+	 */
+	std::vector<vblock> m_blocks;
+
+	/*
+	 * Executable code buffer and bytes used.
+	 */
+	uint8_t *m_buffer;
+	size_t m_used;
+
+	/*
+	 * Compute EFLAGS liveness across blocks.
+	 */
+	void liveness();
+
+	/*
+	 * Returns the original instruction at a decoded index.
+	 */
+	vinsn original(const vblock& block, const uint32_t index) const;
+
+	/*
+	 * Compile a block to native code.
+	 */
+	bool compile(vblock& block);
+
+	public:
+	JIT();
+	~JIT();
+
+	JIT(const JIT&) = delete;
+	JIT& operator=(const JIT&) = delete;
+
+	/*
+	 * Split the decoded stream into basic blocks and install 
+	 * VM_JITBLOCK instructions on their leaders. Must be called before the stream 
+	 * handlers are bound.
+	 */
+	void attach(vstream& stream);
+
+	/*
+	 * Enter a block. Runs its native code when compiled, otherwise 
+	 * counts the execution and returns the index of the cold copy of 
+	 * its leader. Native loops charge their iterations to the time 
+	 * slice budget.
+	 */
+	uint32_t enter(const uint32_t id, REG *vreg, vflags *flags, int64_t *budget);
+
+	/*
+	 * Returns the index of the cold copy of a block's leader without 
+	 * counting the execution.
+	 */
+	uint32_t cold(const uint32_t id) const {
+		return m_blocks[id].cold;
+	}
+};
+
+#endif // VM_JIT
+
+#endif // !__JIT_H__
@@ -0,0 +1,609 @@
+#include "err.h"
+#include "lanes.h"
+
+/*
+ * Lane mask of the lanes whose bit is set in bits.
+ */
+static inline void lanes_select(SLANES& sel, const uint32_t bits) {
+    LANES bit;
+
+    for (uint32_t i = 0; i < VM_LANES; i++)
+        bit[i] = 1u << i;
+    sel = (((LANES){} + bits) & bit) != (LANES){};
+}
+
+/*
+ * Bits of the lanes set in a lane mask.
+ */
+static inline uint32_t lanes_bits(const SLANES& sel) {
+    uint32_t bits = 0;
+
+    for (uint32_t i = 0; i < VM_LANES; i++)
+        bits |= (uint32_t)(sel[i] & 1) << i;
+    return bits;
+}
+
+static inline void blend(LANES& dst, const SLANES& sel, const LANES& value) {
+    dst = sel ? value : dst;
+}
+
+void vlflags::condition(const OPCODE opcode, SLANES& taken) const {
+    switch (opcode) {
+    case VM_JE:
+    case VM_JEI:
+        taken = res == 0;
+        break;
+    case VM_JNE:
+    case VM_JNEI:
+        taken = res != 0;
+        break;
+    case VM_JL:
+    case VM_JLI:
+        taken = (SLANES)dst < (SLANES)src;
+        break;
+    case VM_JLE:
+    case VM_JLEI:
+        taken = (SLANES)dst <= (SLANES)src;
+        break;
+    case VM_JNL:
+    case VM_JNLI:
+        taken = (SLANES)dst >= (SLANES)src;
+        break;
+    case VM_JNLE:
+    case VM_JNLEI:
+        taken = (SLANES)dst > (SLANES)src;
+        break;
+    case VM_JB:
+    case VM_JBI:
+    case VM_JC:
+    case VM_JCI:
+        taken = dst < src;
+        break;
+    case VM_JBE:
+    case VM_JBEI:
+        taken = dst <= src;
+        break;
+    case VM_JNB:
+    case VM_JNBI:
+    case VM_JNC:
+    case VM_JNCI:
+        taken = dst >= src;
+        break;
+    case VM_JNBE:
+    case VM_JNBEI:
+        taken = dst > src;
+        break;
+    case VM_JS:
+    case VM_JSI:
+        taken = (SLANES)res < 0;
+        break;
+    case VM_JNS:
+    case VM_JNSI:
+        taken = (SLANES)res >= 0;
+        break;
+    case VM_JO:
+    case VM_JOI:
+        taken = (SLANES)((dst ^ src) & (dst ^ res)) < 0;
+        break;
+    case VM_JNO:
+    case VM_JNOI:
+        taken = (SLANES)((dst ^ src) & (dst ^ res)) >= 0;
+        break;
+    default:
+        taken = (SLANES){} - 1;                                             // VM_JMP and VM_JMPI.
+        break;
+    }
+}
+
+VMLanes::VMLanes() : VMLanes(Program::builtin()) {}
+
+VMLanes::VMLanes(std::shared_ptr<const Program> program) : m_program(std::move(program)) {
+    m_vstream = &m_program->stream();
+    m_vinsns = m_vstream->insns.data();
+
+    /*
+     * The lane VMs only ever execute single instructions of the plain
+     * stream on behalf of the lanes, so they get an unfused copy
+     * without JIT leaders. decode() keeps a stream that is already
+     * there.
+     */
+    for (int i = 0; i < VM_LANES; i++) {
+        m_vms.emplace_back(new VM(m_program));
+
+        VM& vm = *m_vms.back();
+
+        vm.m_vstream = *m_vstream;
+        vm.m_vinsns = vm.m_vstream.insns.data();
+    }
+}
+
+void VMLanes::set_stack_size(const uint32_t size) {
+    for (auto& vm : m_vms)
+        vm->set_stack_size(size);
+}
+
+void VMLanes::begin(const std::vector<uint8_t> *inputs, const size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        VM& vm = *m_vms[i];
+        const size_t size = inputs[i].size() < VM_DATA_LIMIT ? inputs[i].size() : VM_DATA_LIMIT;
+
+        vm.reset();
+        vm.m_vdata.write(0, inputs[i].data(), size);
+    }
+
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        m_vreg[i] = (LANES){};
+    m_vflags.clear();
+
+    /*
+     * Unused lanes never run.
+     */
+    const uint32_t start = m_vstream->index(0);
+
+    for (uint32_t i = 0; i < VM_LANES; i++)
+        m_pc[i] = i < count ? start : UINT32_MAX;
+
+    m_active = count < 32 ? (1u << count) - 1 : ~0u;
+    m_pending = 0;
+    m_resume = false;
+    select();
+}
+
+void VMLanes::select(void) {
+    if (m_active == 0)
+        return;
+
+    uint32_t min = UINT32_MAX;
+
+    for (uint32_t i = 0; i < VM_LANES; i++)
+        min = m_pc[i] < min ? m_pc[i] : min;
+
+    m_cur = min;
+    m_mask = lanes_bits(m_pc == (LANES){} + min);
+}
+
+void VMLanes::advance(void) {
+    /*
+     * Converged lanes just move on. Otherwise the lanes waiting at the
+     * next instruction, if any, join in there.
+     */
+    if (m_mask == m_active) {
+        m_cur++;
+        return;
+    }
+
+    if (m_mask == 0) {
+        select();
+        return;
+    }
+
+    m_cur++;
+    m_mask |= lanes_bits(m_pc == (LANES){} + m_cur);
+}
+
+void VMLanes::branch(const SLANES& taken, const vinsn& insn, const bool indirect) {
+    LANES next = (LANES){} + (m_cur + 1);
+
+    if (indirect) {
+        for (uint32_t bits = m_mask & lanes_bits(taken); bits; bits &= bits - 1) {
+            const uint32_t lane = __builtin_ctz(bits);
+
+            next[lane] = m_vstream->index(m_vreg[insn.ra][lane]);
+        }
+    } else
+        next = taken ? (LANES){} + insn.target : next;
+
+    SLANES sel;
+
+    lanes_select(sel, m_mask);
+    blend(m_pc, sel, next);
+    select();
+}
+
+void VMLanes::halt(const uint32_t lane) {
+    m_results[lane] = { m_vreg[0][lane], 0 };
+    m_pc[lane] = UINT32_MAX;
+    m_active &= ~(1u << lane);
+    m_mask &= ~(1u << lane);
+    m_pending &= ~(1u << lane);
+}
+
+void VMLanes::trap(const uint32_t lane, const uint32_t code) {
+    halt(lane);
+    m_results[lane].error = code;
+}
+
+void VMLanes::fallback(const uint32_t lane) {
+    VM& vm = *m_vms[lane];
+
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        vm.m_vreg[i] = m_vreg[i][lane];
+    vm.m_vflags = { m_vflags.dst[lane], m_vflags.src[lane], m_vflags.res[lane] };
+    vm.m_vip = vm.m_vinsns + m_cur;
+    vm.m_vbudget = VM_BUDGET_UNLIMITED;
+    vm.m_vfault = m_fault;
+    vm.m_vdata.enter(m_fault);
+
+    const bool running = vm.execute(vm.m_vip->opcode);
+
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        m_vreg[i][lane] = vm.m_vreg[i];
+    m_vflags.dst[lane] = vm.m_vflags.dst;
+    m_vflags.src[lane] = vm.m_vflags.src;
+    m_vflags.res[lane] = vm.m_vflags.res;
+
+    if (running)
+        m_pc[lane] = vm.m_vip - vm.m_vinsns;
+    else
+        halt(lane);
+}
+
+template <typename T>
+void VMLanes::load(const vinsn& insn, const bool indirect) {
+    while (m_pending) {
+        m_lane = __builtin_ctz(m_pending);
+
+        Memory& data = m_vms[m_lane]->m_vdata;
+
+        data.enter(m_fault);
+        m_vreg[insn.ra][m_lane] = data.load<T>(indirect ? m_vreg[insn.rb][m_lane] : insn.rb);
+        m_pending &= m_pending - 1;
+    }
+    advance();
+}
+
+template <typename T>
+void VMLanes::store(const vinsn& insn, const bool indirect) {
+    while (m_pending) {
+        m_lane = __builtin_ctz(m_pending);
+
+        Memory& data = m_vms[m_lane]->m_vdata;
+
+        data.enter(m_fault);
+        data.store<T>(insn.ra, (T)(indirect ? m_vreg[insn.rb][m_lane] : insn.imm));
+        m_pending &= m_pending - 1;
+    }
+    advance();
+}
+
+void VMLanes::dispatch(void) {
+    /*
+     * The loop runs on a copy of m_cur, so the lane vector stores do
+     * not force it back through memory on every instruction. The
+     * member is kept for the helpers.
+     */
+    uint32_t cur = m_cur;
+
+    while (m_active) {
+        const vinsn& insn = m_vinsns[cur];
+        SLANES sel;
+
+        lanes_select(sel, m_mask);
+
+        /*
+         * Instructions run lane by lane pick up after the lane that
+         * panicked.
+         */
+        if (!m_resume)
+            m_pending = m_mask;
+        m_resume = false;
+        m_cur = cur;
+
+        switch (insn.opcode) {
+        case VM_MOV:
+        case VM_LEA:
+            blend(m_vreg[insn.ra], sel, m_vreg[insn.rb]);
+            break;
+        case VM_MOVI:
+            blend(m_vreg[insn.ra], sel, (LANES){} + insn.imm);
+            break;
+        case VM_ADD:
+            blend(m_vreg[insn.ra], sel, ADD(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_ADDI:
+            blend(m_vreg[insn.ra], sel, ADD(m_vreg[insn.ra], insn.imm));
+            break;
+        case VM_SUB:
+            m_vflags.sub(sel, m_vreg[insn.ra], m_vreg[insn.rb]);           // Record operands for the lazy flags.
+            blend(m_vreg[insn.ra], sel, m_vflags.res);
+            break;
+        case VM_SUBI:
+            m_vflags.sub(sel, m_vreg[insn.ra], (LANES){} + insn.imm);
+            blend(m_vreg[insn.ra], sel, m_vflags.res);
+            break;
+        case VM_ADC:
+            blend(m_vreg[insn.ra], sel, ADC(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_INC:
+            blend(m_vreg[insn.ra], sel, m_vreg[insn.ra] + 1);
+            break;
+        case VM_DEC:
+            blend(m_vreg[insn.ra], sel, m_vreg[insn.ra] - 1);
+            break;
+        case VM_CMP:
+            m_vflags.sub(sel, m_vreg[insn.ra], (LANES){} + insn.imm);
+            break;
+        case VM_NEG:
+        case VM_NOT:
+            blend(m_vreg[insn.ra], sel, NEG(m_vreg[insn.ra]));
+            break;
+        case VM_OR:
+            blend(m_vreg[insn.ra], sel, OR(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_AND:
+            blend(m_vreg[insn.ra], sel, AND(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_NOR:
+            blend(m_vreg[insn.ra], sel, NOR(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_XOR:
+            blend(m_vreg[insn.ra], sel, XOR(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_XORI:
+            blend(m_vreg[insn.ra], sel, XOR(m_vreg[insn.ra], insn.imm));
+            break;
+        case VM_TEST:
+            m_vflags.test(sel, AND(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_SHR:
+            /*
+             * Shift counts are taken modulo 32 like x86 does.
+             */
+            blend(m_vreg[insn.ra], sel, m_vreg[insn.ra] >> (m_vreg[insn.rb] & 31));
+            break;
+        case VM_SHL:
+            blend(m_vreg[insn.ra], sel, m_vreg[insn.ra] << (m_vreg[insn.rb] & 31));
+            break;
+        case VM_MUL:
+        case VM_IMUL:
+            blend(m_vreg[insn.ra], sel, m_vreg[insn.ra] * m_vreg[insn.rb]);
+            break;
+        case VM_XCHG:
+            blend(m_vreg[insn.ra], sel, XOR(m_vreg[insn.ra], m_vreg[insn.rb]));    // XOR swap.
+            blend(m_vreg[insn.rb], sel, XOR(m_vreg[insn.rb], m_vreg[insn.ra]));
+            blend(m_vreg[insn.ra], sel, XOR(m_vreg[insn.ra], m_vreg[insn.rb]));
+            break;
+        case VM_NOP:
+            break;
+
+        case VM_LOADB:
+            load<IMM8>(insn, true);
+            cur = m_cur;
+            continue;
+        case VM_LOADBI:
+            load<IMM8>(insn, false);
+            cur = m_cur;
+            continue;
+        case VM_LOADW:
+            load<IMM16>(insn, true);
+            cur = m_cur;
+            continue;
+        case VM_LOADWI:
+            load<IMM16>(insn, false);
+            cur = m_cur;
+            continue;
+        case VM_LOADD:
+            load<IMM32>(insn, true);
+            cur = m_cur;
+            continue;
+        case VM_LOADDI:
+            load<IMM32>(insn, false);
+            cur = m_cur;
+            continue;
+        case VM_STORB:
+            store<IMM8>(insn, true);
+            cur = m_cur;
+            continue;
+        case VM_STORBI:
+            store<IMM8>(insn, false);
+            cur = m_cur;
+            continue;
+        case VM_STORW:
+            store<IMM16>(insn, true);
+            cur = m_cur;
+            continue;
+        case VM_STORWI:
+            store<IMM16>(insn, false);
+            cur = m_cur;
+            continue;
+        case VM_STORD:
+            store<IMM32>(insn, true);
+            cur = m_cur;
+            continue;
+        case VM_STORDI:
+            store<IMM32>(insn, false);
+            cur = m_cur;
+            continue;
+
+        case VM_PUSH:
+        case VM_PUSHI:
+            for (uint32_t bits = m_mask; bits; bits &= bits - 1) {
+                const uint32_t lane = __builtin_ctz(bits);
+                VM& vm = *m_vms[lane];
+
+                if (vm.m_vsp == vm.m_vstack.size())                         // Check stack capacity.
+                    trap(lane, ERR_STACK_OVERFLOW);
+                else
+                    vm.m_vstack[vm.m_vsp++] = insn.opcode == VM_PUSH ? m_vreg[insn.ra][lane] : insn.imm;
+            }
+            break;
+        case VM_POP:
+            for (uint32_t bits = m_mask; bits; bits &= bits - 1) {
+                const uint32_t lane = __builtin_ctz(bits);
+                VM& vm = *m_vms[lane];
+
+                if (vm.m_vsp == 0)                                          // Check stack pointer.
+                    trap(lane, ERR_STACK_UNDERFLOW);
+                else
+                    m_vreg[insn.ra][lane] = vm.m_vstack[--vm.m_vsp];
+            }
+            break;
+        case VM_CALL:
+        case VM_RCALL:
+            for (uint32_t bits = m_mask; bits; bits &= bits - 1) {
+                const uint32_t lane = __builtin_ctz(bits);
+                VM& vm = *m_vms[lane];
+
+                if (vm.m_vsp == vm.m_vstack.size()) {                       // Check stack capacity.
+                    trap(lane, ERR_STACK_OVERFLOW);
+                } else {
+                    vm.m_vstack[vm.m_vsp++] = insn.imm;                     // Save pc of next instruction onto stack for return.
+                    m_pc[lane] = insn.target;
+                }
+            }
+            select();
+            cur = m_cur;
+            continue;
+        case VM_RET:
+            for (uint32_t bits = m_mask; bits; bits &= bits - 1) {
+                const uint32_t lane = __builtin_ctz(bits);
+                VM& vm = *m_vms[lane];
+
+                if (vm.m_vsp == 0)                                          // Check stack pointer.
+                    trap(lane, ERR_STACK_UNDERFLOW);
+                else
+                    m_pc[lane] = m_vstream->index(vm.m_vstack[--vm.m_vsp]); // Retrieve saved pc value.
+            }
+            select();
+            cur = m_cur;
+            continue;
+
+        /*
+         * Jumps. Odd opcodes take an immediate target, even ones a 
+         * register.
+         */
+        case VM_JMP:
+        case VM_JMPI:
+        case VM_JE:
+        case VM_JEI:
+        case VM_JNE:
+        case VM_JNEI:
+        case VM_JL:
+        case VM_JLI:
+        case VM_JLE:
+        case VM_JLEI:
+        case VM_JNL:
+        case VM_JNLI:
+        case VM_JNLE:
+        case VM_JNLEI:
+        case VM_JB:
+        case VM_JBI:
+        case VM_JBE:
+        case VM_JBEI:
+        case VM_JNB:
+        case VM_JNBI:
+        case VM_JNBE:
+        case VM_JNBEI:
+        case VM_JC:
+        case VM_JCI:
+        case VM_JNC:
+        case VM_JNCI:
+        case VM_JS:
+        case VM_JSI:
+        case VM_JNS:
+        case VM_JNSI:
+        case VM_JO:
+        case VM_JOI:
+        case VM_JNO:
+        case VM_JNOI: {
+            SLANES taken;
+
+            m_vflags.condition(insn.opcode, taken);
+            branch(taken, insn, !(insn.opcode & 1));
+            cur = m_cur;
+            continue;
+        }
+
+        case VM_HLT:
+            for (uint32_t bits = m_mask; bits; bits &= bits - 1)
+                halt(__builtin_ctz(bits));
+            select();
+            cur = m_cur;
+            continue;
+        case VM_FAULT:
+            for (uint32_t bits = m_mask; bits; bits &= bits - 1)
+                trap(__builtin_ctz(bits), insn.imm);                        // Invalid instruction or code access! Panic!
+            select();
+            cur = m_cur;
+            continue;
+
+        default:
+            /*
+             * Everything else runs on the lane VMs, one lane at a time.
+             * The instruction may branch, so the lanes are placed again
+             * afterwards.
+             */
+            while (m_pending) {
+                m_lane = __builtin_ctz(m_pending);
+                fallback(m_lane);
+                m_pending &= ~(1u << m_lane);
+            }
+            select();
+            cur = m_cur;
+            continue;
+        }
+
+        if (m_mask == m_active) {
+            cur++;
+            continue;
+        }
+
+        advance();
+        cur = m_cur;
+    }
+}
+
+void VMLanes::loop(void) {
+    /*
+     * Panics of a lane (from the lane VM's handlers or the SIGSEGV
+     * handler of its data section) return here. The lane stops and the
+     * instruction continues with the next lane.
+     */
+    sigjmp_buf fault;
+
+    if (const int code = sigsetjmp(fault, 0)) {
+        m_vms[m_lane]->m_vdata.leave();
+        trap(m_lane, code);
+        m_resume = true;
+    }
+
+    m_fault = &fault;
+
+    dispatch();
+
+    for (auto& vm : m_vms) {
+        vm->m_vdata.leave();
+        vm->m_vdata.sync();
+        vm->m_vfault = nullptr;
+    }
+    m_fault = nullptr;
+}
+
+std::vector<vresult> VMLanes::run(const std::vector<std::vector<uint8_t>>& inputs) {
+    std::vector<vresult> results(inputs.size());
+
+    for (size_t i = 0; i < inputs.size(); i += VM_LANES) {
+        const size_t count = inputs.size() - i < VM_LANES ? inputs.size() - i : VM_LANES;
+
+        begin(&inputs[i], count);
+
+#ifdef VM_VERIFIED
+        /*
+         * Fallbacks run the unchecked handlers of the lane VMs (see 
+         * VM::loop).
+         */
+        if (!m_vms[0]->verified()) {
+            for (size_t j = 0; j < count; j++)
+                results[i + j] = vresult{ 0, ERR_PROGRAM_UNVERIFIED };
+            continue;
+        }
+#endif
+
+        loop();
+
+        for (size_t j = 0; j < count; j++)
+            results[i + j] = m_results[j];
+    }
+
+    return results;
+}
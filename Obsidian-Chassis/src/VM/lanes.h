@@ -0,0 +1,257 @@
+/*
+ * lanes.h
+ *
+ * Runs one program on many inputs in lockstep, VM_LANES inputs at a
+ * time (SPMD).
+ *
+ * Each lane is a run of the program on one input. The registers, flags
+ * and program counters of all lanes are held as arrays of lane vectors
+ * (lane i of m_vreg[r] is register r of input i), so the ALU opcodes,
+ * compares and conditional jumps execute once for all lanes as single
+ * SIMD instructions: SSE2 for 4 lanes by default, AVX2 for 8 lanes with
+ * -mavx2 and AVX-512 for 16 lanes with -mavx512f.
+ *
+ * Lanes that take different branches diverge. The engine then always
+ * executes the instruction with the lowest decoded index among the
+ * running lanes, masked to the lanes waiting there, so the lanes ahead
+ * wait at the join point until the others catch up and run together
+ * again from there (MinPC reconvergence). While all lanes are on the
+ * same instruction, straight-line code costs no bookkeeping.
+ *
+ * Every lane is backed by a VM that holds its data section, stack and
+ * crypto state. Loads, stores, pushes, calls and returns are executed
+ * lane by lane on those. Opcodes without a lane-wise implementation
+ * (bulk memory, crypto, vector, division, ...) run one lane at a time
+ * through the handlers of the lane's VM, so every program runs, it is
+ * just only faster where it spends its time in the opcodes above.
+ *
+ * Panics stop the lane and never exit the process, the other lanes
+ * keep running. Traces, profiles and samples are not recorded and the
+ * JIT and fusion are not used.
+ */
+
+#ifndef __LANES_H__
+#define __LANES_H__
+
+#include <memory>
+#include <vector>
+
+#include "pool.h"
+#include "vm.h"
+
+/*
+ * Number of lanes run in lockstep. Defaults to the number of dword
+ * lanes of the widest vector unit the VM is built for.
+ */
+#ifndef VM_LANES
+#if defined(__AVX512F__)
+#define VM_LANES 16
+#elif defined(__AVX2__)
+#define VM_LANES 8
+#else
+#define VM_LANES 4
+#endif
+#endif
+
+#if VM_LANES < 1 || VM_LANES > 32 || (VM_LANES & (VM_LANES - 1)) != 0
+#error "VM_LANES must be a power of two up to 32"
+#endif
+
+/*
+ * One 32-bit value per lane and the lane masks their compares produce.
+ */
+typedef uint32_t LANES __attribute__((vector_size(VM_LANES * 4)));
+typedef int32_t SLANES __attribute__((vector_size(VM_LANES * 4)));
+
+/*
+ * Lazily evaluated EFLAGS of all lanes (see vflags). Writers only
+ * record the lanes selected by sel. Like the vector registers (see
+ * simd.h), lane vectors are only passed by reference.
+ */
+typedef struct _vlflags {
+	LANES dst;					// First operand.
+	LANES src;					// Second operand.
+	LANES res;					// Result (dst - src).
+
+	/*
+	 * Record a subtraction. The result of the selected lanes is in 
+	 * res.
+	 */
+	void sub(const SLANES& sel, const LANES& a, const LANES& b) {
+		const LANES r = a - b;
+
+		dst = sel ? a : dst;
+		src = sel ? b : src;
+		res = sel ? r : res;
+	}
+
+	/*
+	 * Record a logical compare of the result of an AND.
+	 */
+	void test(const SLANES& sel, const LANES& r) {
+		dst = sel ? r : dst;
+		src = sel ? (LANES){} : src;
+		res = sel ? r : res;
+	}
+
+	/*
+	 * Clear all flags.
+	 */
+	void clear() {
+		dst = (LANES){} + 1;
+		src = (LANES){};
+		res = (LANES){} + 1;
+	}
+
+	/*
+	 * Set taken to the lanes where the condition of a jump opcode
+	 * holds.
+	 */
+	void condition(const OPCODE opcode, SLANES& taken) const;
+} vlflags;
+
+class VMLanes {
+	private:
+	/*
+	 * Program being run and its decoded stream, shared by all lanes.
+	 */
+	std::shared_ptr<const Program> m_program;
+	const vstream *m_vstream;
+	const vinsn *m_vinsns;
+
+	/*
+	 * VM backing each lane.
+	 */
+	std::vector<std::unique_ptr<VM>> m_vms;
+
+	/*
+	 * Registers and lazy flags of all lanes (see vflags).
+	 */
+	LANES m_vreg[NUM_REGISTERS];
+	vlflags m_vflags;
+
+	/*
+	 * Decoded index of the next instruction of each lane. Only kept up
+	 * to date for lanes outside m_mask, lanes that stopped are at
+	 * UINT32_MAX.
+	 */
+	LANES m_pc;
+
+	/*
+	 * Instruction executed next and the lanes that execute it. All
+	 * other running lanes are at a higher index.
+	 */
+	uint32_t m_cur;
+	uint32_t m_mask;
+
+	/*
+	 * Lanes still running.
+	 */
+	uint32_t m_active;
+
+	/*
+	 * Lanes of m_mask not yet done with the current instruction when
+	 * it is executed lane by lane, and the lane being executed.
+	 */
+	uint32_t m_pending;
+	uint32_t m_lane;
+
+	/*
+	 * Whether a panic interrupted the current instruction.
+	 */
+	bool m_resume;
+
+	/*
+	 * Jump buffer of the running loop, taken on panic.
+	 */
+	sigjmp_buf *m_fault = nullptr;
+
+	/*
+	 * Result of each lane of the current batch.
+	 */
+	vresult m_results[VM_LANES];
+
+	/*
+	 * Initialise the lanes to run the given inputs.
+	 */
+	void begin(const std::vector<uint8_t> *inputs, const size_t count);
+
+	/*
+	 * Execute until every lane halted or trapped.
+	 */
+	void loop();
+
+	/*
+	 * Execute the current instruction for the lanes of m_mask until
+	 * every lane halted or trapped.
+	 */
+	void dispatch();
+
+	/*
+	 * Continue after a straight-line instruction or after the lanes of
+	 * m_mask moved to arbitrary instructions (select).
+	 */
+	void advance();
+	void select();
+
+	/*
+	 * Continue the lanes of m_mask at next if taken, otherwise at the
+	 * following instruction. Register forms take the code offset in
+	 * vreg[ra].
+	 */
+	void branch(const SLANES& taken, const vinsn& insn, const bool indirect);
+
+	/*
+	 * Stop a lane with its result.
+	 */
+	void halt(const uint32_t lane);
+	void trap(const uint32_t lane, const uint32_t code);
+
+	/*
+	 * Execute the current instruction for one lane through its VM.
+	 */
+	void fallback(const uint32_t lane);
+
+	/*
+	 * Execute a load or store lane by lane. Indirect forms take the
+	 * address (loads) or the value (stores) from vreg[rb].
+	 */
+	template <typename T>
+	void load(const vinsn& insn, const bool indirect);
+
+	template <typename T>
+	void store(const vinsn& insn, const bool indirect);
+
+	public:
+	/*
+	 * Run the program linked into the binary.
+	 */
+	VMLanes();
+
+	/*
+	 * Run the given program.
+	 */
+	explicit VMLanes(std::shared_ptr<const Program> program);
+
+	VMLanes(const VMLanes&) = delete;
+	VMLanes& operator=(const VMLanes&) = delete;
+
+	/*
+	 * Set the capacity of the virtual stack of every lane in 32-bit
+	 * slots (see VM::set_stack_size).
+	 */
+	void set_stack_size(const uint32_t size);
+
+	/*
+	 * Run the program once per input and return the results in the
+	 * same order. Inputs are copied into the data section like
+	 * VM::start does.
+	 */
+	std::vector<vresult> run(const std::vector<std::vector<uint8_t>>& inputs);
+
+	size_t size() const {
+		return VM_LANES;
+	}
+};
+
+#endif // !__LANES_H__
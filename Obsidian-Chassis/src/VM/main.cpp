@@ -2,6 +2,7 @@
 #include <cstdlib>
 #include <iostream>
 
+#include "err.h"
 #include "opcodes.h"
 #include "rc4.h"
 #include "vm.h"
@@ -29,5 +30,15 @@ int main(int argc, char *argv[]) {
     VM vm;
     vm.start();
 
+    /*
+     * Report a trap and exit with its code, like a panic used to.
+     */
+    if (const uint32_t code = vm.error()) {
+        const vtrap& trap = vm.trap();
+
+        std::cerr << "[-] Error (0x" << std::hex << code << ") at 0x" << trap.vpc << " (opcode 0x" << (uint32_t)trap.opcode << ")" << std::dec << ": " << strerr(code) << ".\n";
+        return code;
+    }
+
     return 0;
 }
\ No newline at end of file
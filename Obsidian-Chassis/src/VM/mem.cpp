@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <mutex>
+#include <new>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "vm.h"
+
+/*
+ * Memory of the VM running on this thread.
+ */
+static thread_local Memory *active = nullptr;
+
+/*
+ * SIGSEGV action installed before ours.
+ */
+static struct sigaction previous;
+static std::once_flag installed;
+
+static size_t page_size(void) {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static size_t round_up(const size_t size, const size_t align) {
+    return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Leave the SIGSEGV handler for the loop of the VM. The loop does not 
+ * save the signal mask, which would cost a system call per run, so 
+ * unblock SIGSEGV, the only signal blocked while the handler runs.
+ */
+[[noreturn]] static void escape(sigjmp_buf *fault, const int code) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGSEGV);
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    siglongjmp(*fault, code);
+}
+
+Memory::Memory() : m_base(nullptr), m_reserved(0), m_committed(0), m_fault(nullptr), m_snapshot(false) {
+    std::call_once(installed, [] {
+        struct sigaction action = {};
+
+        action.sa_sigaction = segv;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous);
+    });
+
+#if UINTPTR_MAX > 0xFFFFFFFF
+    m_reserved = 0x100000000ULL + page_size();
+#else
+    m_reserved = VM_DATA_LIMIT + page_size();
+#endif
+
+    void *base = mmap(nullptr, m_reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (base == MAP_FAILED)
+        throw std::bad_alloc();
+    m_base = (uint8_t *)base;
+}
+
+Memory::~Memory() {
+    if (active == this)
+        leave();
+    munmap(m_base, m_reserved);
+}
+
+void Memory::reset(const size_t size) {
+    discard();
+
+    /*
+     * Map fresh zero pages over everything committed so far.
+     */
+    if (m_committed != 0) {
+        if (mmap(m_base, m_committed, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+            throw std::bad_alloc();
+        m_committed = 0;
+    }
+
+    commit(size);
+}
+
+bool Memory::commit(const size_t size) {
+    if (size > VM_DATA_LIMIT)
+        return false;
+
+    return unprotect(0, round_up(size, page_size()));
+}
+
+void Memory::dirty(const size_t page) {
+    if (!m_dirty[page]) {
+        m_dirty[page] = 1;
+        m_dirty_pages.push_back(page);
+    }
+}
+
+bool Memory::unprotect(const size_t start, const size_t end) {
+    const size_t size = page_size();
+
+    if (start >= end)
+        return true;
+
+    /*
+     * Nothing to do if the range is committed and every snapshot page 
+     * in it is dirty already.
+     */
+    bool protect = end > m_committed;
+
+    for (size_t page = start / size; page * size < end && page * size < m_saved.size(); page++) {
+        protect |= !m_dirty[page];
+        dirty(page);
+    }
+
+    if (protect && mprotect(m_base + start, end - start, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    if (end > m_committed)
+        m_committed = end;
+
+    return true;
+}
+
+uint8_t *Memory::range(const REG addr, const uint64_t length) const {
+    /*
+     * Without bindings the guard page follows the limit on 32-bit 
+     * hosts and the 32-bit address space on 64-bit hosts.
+     */
+    if ((uint64_t)addr + length > m_reserved - page_size())
+        return nullptr;
+
+    return m_base + addr;
+}
+
+bool Memory::write(const REG addr, const void *src, const size_t length) {
+    if (length == 0)
+        return true;
+    if ((uint64_t)addr + length > VM_DATA_LIMIT)
+        return false;
+    if (!unprotect(addr & ~(page_size() - 1), round_up(addr + length, page_size())))
+        return false;
+
+    memcpy(ptr(addr), src, length);
+    return true;
+}
+
+void Memory::snapshot(void) {
+    discard();
+
+    const size_t pages = m_committed / page_size();
+
+    /*
+     * The committed range has no holes (see fault), so it can be 
+     * copied and protected in one go.
+     */
+    m_saved.assign(m_base, m_base + m_committed);
+    m_dirty.assign(pages, 0);
+    m_dirty_pages.clear();
+    m_dirty_pages.reserve(pages);
+    m_snapshot = true;
+
+    mprotect(m_base, m_committed, PROT_READ);
+}
+
+void Memory::restore(void) {
+    if (!m_snapshot)
+        return;
+
+    const size_t size = page_size();
+
+    /*
+     * Copy back and protect each run of dirty pages.
+     */
+    std::sort(m_dirty_pages.begin(), m_dirty_pages.end());
+
+    for (size_t i = 0; i < m_dirty_pages.size();) {
+        size_t j = i + 1;
+
+        while (j < m_dirty_pages.size() && m_dirty_pages[j] == m_dirty_pages[j - 1] + 1)
+            j++;
+
+        const size_t start = m_dirty_pages[i] * size;
+        const size_t length = (j - i) * size;
+
+        memcpy(m_base + start, m_saved.data() + start, length);
+        mprotect(m_base + start, length, PROT_READ);
+
+        for (; i < j; i++)
+            m_dirty[m_dirty_pages[i]] = 0;
+    }
+    m_dirty_pages.clear();
+
+    /*
+     * Drop the pages committed since the snapshot.
+     */
+    if (m_committed > m_saved.size()) {
+        mmap(m_base + m_saved.size(), m_committed - m_saved.size(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        m_committed = m_saved.size();
+    }
+}
+
+void Memory::discard(void) {
+    if (!m_snapshot)
+        return;
+
+    mprotect(m_base, m_saved.size(), PROT_READ | PROT_WRITE);
+
+    std::vector<uint8_t>().swap(m_saved);
+    std::vector<uint8_t>().swap(m_dirty);
+    std::vector<uint32_t>().swap(m_dirty_pages);
+    m_snapshot = false;
+}
+
+void Memory::enter(sigjmp_buf *fault) {
+    m_fault = fault;
+    active = this;
+}
+
+void Memory::leave(void) {
+    active = nullptr;
+    m_fault = nullptr;
+}
+
+void Memory::fault(const uint8_t *addr) {
+    const size_t offset = addr - m_base;
+
+    if (offset < m_saved.size()) {
+        /*
+         * A write to a page of the snapshot. Mark it dirty and retry.
+         */
+        const size_t start = offset & ~(page_size() - 1);
+
+        if (unprotect(start, start + page_size()))
+            return;
+    } else if (offset < VM_DATA_LIMIT) {
+        /*
+         * Commit everything up to the end of the chunk around an 
+         * address below the limit and retry the access. Committing 
+         * from the end of the committed range keeps it free of holes, 
+         * untouched pages cost nothing.
+         */
+        const size_t chunk = (offset & ~((size_t)VM_DATA_COMMIT - 1)) + VM_DATA_COMMIT;
+        const size_t end = chunk < VM_DATA_LIMIT ? chunk : VM_DATA_LIMIT;
+
+        if (unprotect(m_committed, end))
+            return;
+    }
+
+    for (auto& binding : m_bindings) {
+        if (offset >= binding.start && offset < binding.end) {
+            if (fault(binding, offset))
+                return;
+            escape(m_fault, ERR_DATA_READ_ONLY);
+        }
+    }
+
+    escape(m_fault, ERR_DATA_OUT_OF_BOUNDS);
+}
+
+bool Memory::fault(vbinding& binding, const size_t offset) {
+    const size_t size = page_size();
+    const size_t page = (offset - binding.start) / size;
+
+    if (binding.buffer == nullptr || binding.present[page])
+        return false;
+
+    /*
+     * Copy the page in. The tail of the last page stays zero.
+     */
+    uint8_t *dst = m_base + binding.start + page * size;
+    const size_t length = binding.length - page * size < size ? binding.length - page * size : size;
+
+    if (mprotect(dst, size, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    memcpy(dst, binding.buffer + page * size, length);
+    if (!binding.writable)
+        mprotect(dst, size, PROT_READ);
+
+    binding.present[page] = 1;
+    binding.touched.push_back(page);
+    return true;
+}
+
+bool Memory::bindable(const REG addr, const size_t length) const {
+    const uint64_t end = (uint64_t)addr + round_up(length, page_size());
+
+    if (length == 0 || addr < VM_DATA_LIMIT || (addr & (page_size() - 1)))
+        return false;
+    if (end > m_reserved - page_size())
+        return false;
+
+    for (const auto& binding : m_bindings) {
+        if (addr < binding.end && end > binding.start)
+            return false;
+    }
+
+    return true;
+}
+
+bool Memory::bind(const REG addr, uint8_t *buffer, const size_t length, const bool writable) {
+    if (!bindable(addr, length))
+        return false;
+
+    const size_t pages = round_up(length, page_size()) / page_size();
+
+    /*
+     * The pages stay inaccessible until first touched. The lists are 
+     * sized now so the fault handler never allocates.
+     */
+    vbinding binding = { addr, addr + pages * page_size(), buffer, length, writable, std::vector<uint8_t>(pages, 0), {} };
+
+    binding.touched.reserve(pages);
+    m_bindings.push_back(std::move(binding));
+    return true;
+}
+
+bool Memory::bind(const REG addr, const int fd, const size_t length, const bool writable) {
+    if (!bindable(addr, length))
+        return false;
+
+    /*
+     * A private mapping shares the page cache and keeps guest writes 
+     * out of the file.
+     */
+    if (mmap(m_base + addr, length, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        return false;
+
+    m_bindings.push_back({ addr, addr + round_up(length, page_size()), nullptr, length, writable, {}, {} });
+    return true;
+}
+
+void Memory::unbind(const REG addr) {
+    for (auto it = m_bindings.begin(); it != m_bindings.end(); ++it) {
+        if (it->start == addr) {
+            mmap(m_base + it->start, it->end - it->start, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            m_bindings.erase(it);
+            return;
+        }
+    }
+}
+
+void Memory::unbind(void) {
+    while (!m_bindings.empty())
+        unbind(m_bindings.back().start);
+}
+
+void Memory::sync(void) {
+    const size_t size = page_size();
+
+    for (auto& binding : m_bindings) {
+        for (const uint32_t page : binding.touched) {
+            uint8_t *src = m_base + binding.start + page * size;
+
+            if (binding.writable) {
+                const size_t length = binding.length - page * size < size ? binding.length - page * size : size;
+                memcpy(binding.buffer + page * size, src, length);
+            }
+
+            mmap(src, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            binding.present[page] = 0;
+        }
+        binding.touched.clear();
+    }
+}
+
+void Memory::segv(int sig, siginfo_t *info, void *context) {
+    Memory *mem = active;
+    const uint8_t *addr = (const uint8_t *)info->si_addr;
+
+    if (mem != nullptr && addr >= mem->m_base && addr < mem->m_base + mem->m_reserved) {
+        mem->fault(addr);
+        return;
+    }
+
+    /*
+     * Not a guest access. Pass it on to the previous handler, or
+     * restore the default action and let the access fault again.
+     */
+    if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction != nullptr) {
+        previous.sa_sigaction(sig, info, context);
+    } else if (!(previous.sa_flags & SA_SIGINFO) && previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(sig);
+    } else {
+        signal(sig, SIG_DFL);
+    }
+}
@@ -0,0 +1,257 @@
+/*
+ * mem.h
+ *
+ * Guest address space backing the virtual data section.
+ *
+ * A large region is reserved up front with PROT_NONE and pages are
+ * committed on demand up to the data section limit. On 64-bit hosts
+ * the reservation covers the whole 32-bit guest address space plus a
+ * guard page, so every guest address maps into it and loads and stores
+ * need no bounds check: touching an uncommitted page below the limit
+ * commits it, touching anything above the limit raises SIGSEGV which
+ * is turned into ERR_DATA_OUT_OF_BOUNDS. On 32-bit hosts only the
+ * limit and a guard page are reserved and addresses above the limit
+ * are redirected to the guard page.
+ *
+ * Faults are only handled for the memory of the VM running on the
+ * current thread (see enter/leave). Other faults are passed on to the
+ * previously installed SIGSEGV handler.
+ *
+ * A snapshot saves the committed pages and write protects them. The
+ * first write to each page faults, marks the page dirty and unprotects
+ * it, so restore only copies back the pages written since and drops
+ * the pages committed since.
+ *
+ * Caller buffers and files can be bound into the guest address space
+ * above the data section limit (see bind). Files are mapped straight
+ * into the reservation, so their pages come from the page cache and
+ * nothing is copied. Buffers cannot be aliased, so each page is copied
+ * in on first touch and, if writable, copied back by sync() when the
+ * VM stops. Only the pages the program touches cost anything either
+ * way. Bindings need the full 32-bit reservation of 64-bit hosts.
+ *
+ * Included by vm.h after the base types.
+ */
+
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <csetjmp>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/*
+ * Maximum size of the data section. Must be a multiple of the page size.
+ */
+#ifndef VM_DATA_LIMIT
+#define VM_DATA_LIMIT 0x1000000
+#endif
+
+/*
+ * Granularity of on demand commits.
+ */
+#ifndef VM_DATA_COMMIT
+#define VM_DATA_COMMIT 0x10000
+#endif
+
+class Memory {
+	private:
+	/*
+	 * Base of the reservation. Guest address 0 maps to the base.
+	 */
+	uint8_t *m_base;
+
+	/*
+	 * Size of the reservation including the guard page.
+	 */
+	size_t m_reserved;
+
+	/*
+	 * Number of bytes committed from the base.
+	 */
+	size_t m_committed;
+
+	/*
+	 * Jump buffer of the running VM loop, taken on out of range
+	 * accesses.
+	 */
+	sigjmp_buf *m_fault;
+
+	/*
+	 * Snapshot of the first m_saved.size() bytes, empty if none.
+	 */
+	std::vector<uint8_t> m_saved;
+
+	/*
+	 * Per page dirty flags of the snapshot and the list of dirty 
+	 * pages. Both are sized when the snapshot is taken so the fault 
+	 * handler never allocates.
+	 */
+	std::vector<uint8_t> m_dirty;
+	std::vector<uint32_t> m_dirty_pages;
+
+	/*
+	 * Whether a snapshot is held.
+	 */
+	bool m_snapshot;
+
+	/*
+	 * Caller memory bound above the data section limit.
+	 */
+	typedef struct _vbinding {
+		size_t start;					// Guest offset, page aligned.
+		size_t end;						// End of the bound pages.
+		uint8_t *buffer;				// Caller buffer or null for a file.
+		size_t length;					// Length of the buffer or file.
+		bool writable;					// Whether the guest may write.
+		std::vector<uint8_t> present;	// Buffer pages copied in.
+		std::vector<uint32_t> touched;	// List of the present pages.
+	} vbinding;
+
+	std::vector<vbinding> m_bindings;
+
+	/*
+	 * Handles a fault in a binding. Copies in a buffer page on first 
+	 * touch, otherwise the access was a write to a read-only binding.
+	 */
+	bool fault(vbinding& binding, const size_t offset);
+
+	/*
+	 * Check that [addr, addr + length) can be bound.
+	 */
+	bool bindable(const REG addr, const size_t length) const;
+
+	/*
+	 * Mark a snapshot page dirty and make it writable.
+	 */
+	void dirty(const size_t page);
+
+	/*
+	 * Make [start, end) writable, marking snapshot pages dirty.
+	 */
+	bool unprotect(const size_t start, const size_t end);
+
+	/*
+	 * Handles a fault at a host address. Commits the page if it is
+	 * below the limit and returns, otherwise jumps to m_fault.
+	 */
+	void fault(const uint8_t *addr);
+
+	/*
+	 * SIGSEGV handler.
+	 */
+	static void segv(int sig, siginfo_t *info, void *context);
+
+	public:
+	Memory();
+	~Memory();
+
+	Memory(const Memory&) = delete;
+	Memory& operator=(const Memory&) = delete;
+
+	/*
+	 * Decommit all pages so the memory reads as zero again, then
+	 * commit size bytes from address 0.
+	 */
+	void reset(const size_t size);
+
+	/*
+	 * Commit size bytes from address 0. Returns false if size
+	 * exceeds the limit.
+	 */
+	bool commit(const size_t size);
+
+	/*
+	 * Copy length bytes to a guest address, committing pages as 
+	 * needed. Returns false if the range exceeds the limit.
+	 */
+	bool write(const REG addr, const void *src, const size_t length);
+
+	/*
+	 * Save the committed pages and track writes from now on.
+	 */
+	void snapshot();
+
+	/*
+	 * Restore the pages written since the snapshot and decommit the 
+	 * pages committed since.
+	 */
+	void restore();
+
+	/*
+	 * Drop the snapshot and stop tracking writes.
+	 */
+	void discard();
+
+	/*
+	 * Bind length bytes of a caller buffer at a page aligned guest 
+	 * address at or above VM_DATA_LIMIT. Writes of a writable binding 
+	 * reach the buffer when the VM stops. The buffer must stay valid 
+	 * until unbound. Returns false if the range is misaligned, out of 
+	 * range or overlaps another binding.
+	 */
+	bool bind(const REG addr, uint8_t *buffer, const size_t length, const bool writable);
+
+	/*
+	 * Map length bytes of a file at a page aligned guest address at or 
+	 * above VM_DATA_LIMIT. Writes of a writable binding are private to 
+	 * the VM and never reach the file.
+	 */
+	bool bind(const REG addr, const int fd, const size_t length, const bool writable);
+
+	/*
+	 * Remove the binding at a guest address, or all of them.
+	 */
+	void unbind(const REG addr);
+	void unbind();
+
+	/*
+	 * Copy writable buffer pages back to their buffers and drop all 
+	 * copied pages, so the next run sees the current buffer contents.
+	 */
+	void sync();
+
+	/*
+	 * Handle faults on this memory on the current thread until leave()
+	 * by jumping to fault.
+	 */
+	void enter(sigjmp_buf *fault);
+	void leave();
+
+	/*
+	 * Returns the host address of a guest address.
+	 */
+	uint8_t *ptr(const REG addr) const {
+#if UINTPTR_MAX > 0xFFFFFFFF
+		return m_base + addr;
+#else
+		return m_base + (addr < VM_DATA_LIMIT ? addr : VM_DATA_LIMIT);
+#endif
+	}
+
+	/*
+	 * Returns the host address of [addr, addr + length) or null if the
+	 * range runs past the reservation. Bulk operations check this once,
+	 * accesses within the range fault like loads and stores.
+	 */
+	uint8_t *range(const REG addr, const uint64_t length) const;
+
+	/*
+	 * Unchecked loads and stores. Out of range accesses fault.
+	 */
+	template <typename T>
+	T load(const REG addr) const {
+		T value;
+		memcpy(&value, ptr(addr), sizeof(value));
+		return value;
+	}
+
+	template <typename T>
+	void store(const REG addr, const T value) {
+		memcpy(ptr(addr), &value, sizeof(value));
+	}
+};
+
+#endif // !__MEM_H__
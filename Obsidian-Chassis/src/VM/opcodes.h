@@ -53,7 +53,7 @@
 #define VM_JNLE 0x2A
 #define VM_JNLEI 0x2B
 #define VM_JG VM_JNLE
-#define VM_JGI VM_JNLI
+#define VM_JGI VM_JNLEI
 #define VM_JGE VM_JNL
 #define VM_JGEI VM_JNLI
 #define VM_JNG VM_JLE
@@ -98,6 +98,22 @@
 #define VM_RET 0x47                 // ret
 #define VM_XCHG 0x48                // xchg reg, reg
 
+/*
+ * Internal opcodes. These are never emitted by the assembler and are 
+ * rejected when found in the code section.
+ *
+ * Fused opcodes are superinstructions installed by the fusion pass 
+ * (see fuse.h) on the first instruction of a matching sequence.
+ */
+#define VM_TEST_JEI 0x49            // test reg, reg; jei imm32
+#define VM_TEST_JNEI 0x4A           // test reg, reg; jnei imm32
+#define VM_CMP_JEI 0x4B             // cmp reg, imm32; jei imm32
+#define VM_CMP_JNEI 0x4C            // cmp reg, imm32; jnei imm32
+#define VM_PUSH_DEC_CALL 0x4D       // push reg; dec reg; call imm32
+#define VM_POP_MUL 0x4E             // pop reg; mul reg, reg
+#define VM_JITBLOCK 0x7E            // Enter the JIT block numbered by the immediate.
+#define VM_FAULT 0x7F               // Panic with the error code in the immediate.
+
 /*
  * Memory interaction opcodes.
  */
@@ -114,9 +130,80 @@
 #define VM_STORD 0x8A               // stord mem, reg (32 bits)
 #define VM_STORDI 0x8B              // storid mem, imm32 (32 bits)
 
+/*
+ * Bulk memory opcodes over data section ranges (see bulk.h). Addresses, 
+ * lengths and values are taken from registers and each range is 
+ * checked once per instruction.
+ *
+ * vm_memcpy copies as if through a temporary buffer, so the ranges may 
+ * overlap. vm_memset and vm_memchr use the low byte of value. vm_memcmp 
+ * and vm_memchr store the offset of the first differing or matching 
+ * byte in index, or length if there is none. vm_memcmp sets the flags 
+ * like vm_cmp of the two differing bytes (equal if there are none) and 
+ * vm_memchr like vm_sub of index and length (equal if not found).
+ */
+#define VM_MEMCPY 0x90              // memcpy dst, src, length
+#define VM_MEMSET 0x91              // memset dst, value, length
+#define VM_MEMCMP 0x92              // memcmp index, a, b, length
+#define VM_MEMCHR 0x93              // memchr index, mem, value, length
+
+/*
+ * Vector opcodes (see simd.h). Operate on the 16 256-bit vector 
+ * registers v0-v15, as 32 byte, 16 word or 8 dword lanes. Loads and 
+ * stores take the address from a general purpose register and are 
+ * unchecked like the scalar ones. Shift counts must be below 32.
+ *
+ * vm_vshufd picks the dwords of each 128-bit half of src by the two bit 
+ * fields of order, like x86 pshufd. The horizontal opcodes store their 
+ * result in a general purpose register.
+ */
+#define VM_VLOAD 0xA0               // vload vec, mem[reg] (256 bits)
+#define VM_VSTORE 0xA1              // vstore mem[reg], vec (256 bits)
+#define VM_VMOV 0xA2                // vmov vec, vec
+#define VM_VBCASTD 0xA3             // vbcastd vec, reg (reg to every dword)
+#define VM_VEXTRD 0xA4              // vextrd reg, vec, imm8 (dword lane)
+#define VM_VXOR 0xA5                // vxor vec, vec
+#define VM_VAND 0xA6                // vand vec, vec
+#define VM_VOR 0xA7                 // vor vec, vec
+#define VM_VADDB 0xA8               // vaddb vec, vec (32 x 8 bits)
+#define VM_VADDW 0xA9               // vaddw vec, vec (16 x 16 bits)
+#define VM_VADDD 0xAA               // vaddd vec, vec (8 x 32 bits)
+#define VM_VSUBB 0xAB               // vsubb vec, vec
+#define VM_VSUBW 0xAC               // vsubw vec, vec
+#define VM_VSUBD 0xAD               // vsubd vec, vec
+#define VM_VSHLD 0xAE               // vshld vec, imm8
+#define VM_VSHRD 0xAF               // vshrd vec, imm8 (logical)
+#define VM_VSHUFD 0xB0              // vshufd vec, vec, imm8 (order)
+#define VM_VHADDB 0xB1              // vhaddb reg, vec (sum of bytes)
+#define VM_VHADDD 0xB2              // vhaddd reg, vec (sum of dwords)
+#define VM_VHXORD 0xB3              // vhxord reg, vec (xor of dwords)
+
 /*
  * Special opcodes.
  */
+/*
+ * Crypto and hash opcodes over data section ranges (see crypto.h). 
+ * Addresses and lengths are taken from registers.
+ *
+ * vm_aesk sets the AES-128 or AES-256 key used by the others. vm_aesctr 
+ * advances the 16 byte big endian counter block at ctr past the blocks 
+ * it used. vm_crc32c continues the CRC in its register, which starts 
+ * at 0. vm_sha256 stores the 32 byte digest.
+ */
+#define VM_AESK 0xE0                // aesk key, len (16 or 32)
+#define VM_AESE 0xE1                // aese in, out, blocks
+#define VM_AESD 0xE2                // aesd in, out, blocks
+#define VM_AESCTR 0xE3              // aesctr in, out, length, ctr
+#define VM_CRC32C 0xE4              // crc32c crc, mem, length
+#define VM_SHA256 0xE5              // sha256 digest, mem, length
+
+/*
+ * Encrypts length bytes at in with count keys of key length bytes 
+ * stored back to back at keys, into count outputs of length bytes 
+ * stored back to back at out. Addresses are taken from registers. The 
+ * same as vm_rc4k and vm_rc4c per key, without the keystream.
+ */
+#define VM_RC4M 0xFA                // rc4m keys, in, out, length, key length, count
 #define VM_RC4K 0xFB                // rc4k mem, len
 #define VM_RC4C 0xFC                // rc4d in, out, length, key
 /*
@@ -134,4 +221,145 @@
  */
 #define VM_PASSTHRU 0xFF			// passthru
 
+/*
+ * X-macro list of every opcode that has a handler in handlers.inc.
+ * Used to build the dispatch tables of the threaded CPU loops.
+ */
+#define VM_OPCODE_LIST(X) \
+    X(VM_HLT) \
+    X(VM_MOV) \
+    X(VM_MOVI) \
+    X(VM_ADD) \
+    X(VM_ADDI) \
+    X(VM_SUB) \
+    X(VM_SUBI) \
+    X(VM_ADC) \
+    X(VM_SBB) \
+    X(VM_INC) \
+    X(VM_DEC) \
+    X(VM_CMP) \
+    X(VM_LEA) \
+    X(VM_NEG) \
+    X(VM_OR) \
+    X(VM_AND) \
+    X(VM_NOT) \
+    X(VM_NOR) \
+    X(VM_XOR) \
+    X(VM_XORI) \
+    X(VM_TEST) \
+    X(VM_SHR) \
+    X(VM_SHL) \
+    X(VM_SAR) \
+    X(VM_SAL) \
+    X(VM_PUSH) \
+    X(VM_PUSHI) \
+    X(VM_POP) \
+    X(VM_PUSHAD) \
+    X(VM_POPAD) \
+    X(VM_JMP) \
+    X(VM_JMPI) \
+    X(VM_JE) \
+    X(VM_JEI) \
+    X(VM_JNE) \
+    X(VM_JNEI) \
+    X(VM_JL) \
+    X(VM_JLI) \
+    X(VM_JLE) \
+    X(VM_JLEI) \
+    X(VM_JNL) \
+    X(VM_JNLI) \
+    X(VM_JNLE) \
+    X(VM_JNLEI) \
+    X(VM_JB) \
+    X(VM_JBI) \
+    X(VM_JBE) \
+    X(VM_JBEI) \
+    X(VM_JNB) \
+    X(VM_JNBI) \
+    X(VM_JNBE) \
+    X(VM_JNBEI) \
+    X(VM_JC) \
+    X(VM_JCI) \
+    X(VM_JNC) \
+    X(VM_JNCI) \
+    X(VM_JS) \
+    X(VM_JSI) \
+    X(VM_JNS) \
+    X(VM_JNSI) \
+    X(VM_JO) \
+    X(VM_JOI) \
+    X(VM_JNO) \
+    X(VM_JNOI) \
+    X(VM_DIV) \
+    X(VM_IDIV) \
+    X(VM_MUL) \
+    X(VM_IMUL) \
+    X(VM_MOD) \
+    X(VM_CALL) \
+    X(VM_RCALL) \
+    X(VM_RET) \
+    X(VM_XCHG) \
+    X(VM_LOADB) \
+    X(VM_LOADBI) \
+    X(VM_LOADW) \
+    X(VM_LOADWI) \
+    X(VM_LOADD) \
+    X(VM_LOADDI) \
+    X(VM_STORB) \
+    X(VM_STORBI) \
+    X(VM_STORW) \
+    X(VM_STORWI) \
+    X(VM_STORD) \
+    X(VM_STORDI) \
+    X(VM_MEMCPY) \
+    X(VM_MEMSET) \
+    X(VM_MEMCMP) \
+    X(VM_MEMCHR) \
+    X(VM_VLOAD) \
+    X(VM_VSTORE) \
+    X(VM_VMOV) \
+    X(VM_VBCASTD) \
+    X(VM_VEXTRD) \
+    X(VM_VXOR) \
+    X(VM_VAND) \
+    X(VM_VOR) \
+    X(VM_VADDB) \
+    X(VM_VADDW) \
+    X(VM_VADDD) \
+    X(VM_VSUBB) \
+    X(VM_VSUBW) \
+    X(VM_VSUBD) \
+    X(VM_VSHLD) \
+    X(VM_VSHRD) \
+    X(VM_VSHUFD) \
+    X(VM_VHADDB) \
+    X(VM_VHADDD) \
+    X(VM_VHXORD) \
+    X(VM_AESK) \
+    X(VM_AESE) \
+    X(VM_AESD) \
+    X(VM_AESCTR) \
+    X(VM_CRC32C) \
+    X(VM_SHA256) \
+    X(VM_RC4M) \
+    X(VM_RC4K) \
+    X(VM_RC4C) \
+    X(VM_CONOUT) \
+    X(VM_NOP) \
+    X(VM_PASSTHRU) \
+    X(VM_FAULT) \
+    X(VM_TEST_JEI) \
+    X(VM_TEST_JNEI) \
+    X(VM_CMP_JEI) \
+    X(VM_CMP_JNEI) \
+    X(VM_PUSH_DEC_CALL) \
+    X(VM_POP_MUL) \
+    VM_OPCODE_LIST_JIT(X)
+
+#ifdef VM_JIT
+#define VM_OPCODE_LIST_JIT(X) X(VM_JITBLOCK)
+#else
+#define VM_OPCODE_LIST_JIT(X)
+#endif
+
 #endif // !__OPCODES_H__
\ No newline at end of file
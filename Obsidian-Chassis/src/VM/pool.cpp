@@ -0,0 +1,149 @@
+#include "pool.h"
+
+VMPool::VMPool(size_t threads) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    for (size_t i = 0; i < threads; i++)
+        m_queues.emplace_back(new vqueue);
+
+    for (size_t i = 0; i < threads; i++)
+        m_workers.emplace_back(&VMPool::work, this, i);
+}
+
+VMPool::~VMPool() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_start.notify_all();
+
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+std::vector<vresult> VMPool::run(const std::vector<vjob>& jobs) {
+    std::vector<vresult> results(jobs.size());
+
+    if (jobs.empty())
+        return results;
+
+    /*
+     * Deal the jobs round-robin. Workers are idle between batches so
+     * the deques can be filled without contention.
+     */
+    for (size_t i = 0; i < jobs.size(); i++) {
+        vqueue& queue = *m_queues[i % m_queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.jobs.push_back(i);
+    }
+
+    std::unique_lock<std::mutex> guard(m_lock);
+
+    m_jobs = &jobs;
+    m_results = &results;
+    m_pending = jobs.size();
+    m_batch++;
+    m_start.notify_all();
+
+    /*
+     * Also wait for workers still searching the deques, so none of them 
+     * picks up a job of the next batch with this batch's pointers.
+     */
+    m_done.wait(guard, [this] { return m_pending == 0 && m_active == 0; });
+
+    m_jobs = nullptr;
+    m_results = nullptr;
+
+    return results;
+}
+
+bool VMPool::take(const size_t id, size_t& job) {
+    /*
+     * Own deque, newest job first.
+     */
+    {
+        vqueue& queue = *m_queues[id];
+        std::lock_guard<std::mutex> guard(queue.lock);
+
+        if (!queue.jobs.empty()) {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+            return true;
+        }
+    }
+
+    /*
+     * Steal the oldest job of another worker.
+     */
+    for (size_t i = 1; i < m_queues.size(); i++) {
+        vqueue& queue = *m_queues[(id + i) % m_queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+
+        if (!queue.jobs.empty()) {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void VMPool::work(const size_t id) {
+    std::unique_ptr<VM> vm;
+    uint64_t batch = 0;
+
+    for (;;) {
+        const std::vector<vjob> *jobs;
+        std::vector<vresult> *results;
+
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+
+            m_start.wait(guard, [&] { return m_stop || m_batch != batch; });
+            if (m_stop)
+                return;
+
+            batch = m_batch;
+            m_active++;
+            jobs = m_jobs;
+            results = m_results;
+        }
+
+        size_t finished = 0;
+        size_t job;
+
+        /*
+         * A worker that wakes after its batch was already finished by 
+         * the others sees no batch and goes back to sleep.
+         */
+        while (jobs != nullptr && take(id, job)) {
+            const vjob& j = (*jobs)[job];
+
+            /*
+             * Reuse the VM while the program stays the same.
+             */
+            if (!vm)
+                vm.reset(new VM(j.program));
+            else if (vm->program() != j.program)
+                vm->load(j.program);
+
+            const uint32_t value = vm->start(j.data);
+
+            (*results)[job] = vresult{ value, vm->error() };
+            finished++;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            m_active--;
+            m_pending -= finished;
+            if (m_pending == 0 && m_active == 0)
+                m_done.notify_all();
+        }
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * pool.h
+ *
+ * Runs batches of independent VM jobs on a fixed set of worker threads.
+ *
+ * Each job is a program and the input copied into its data section. A
+ * batch is dealt round-robin into one deque per worker. Workers take
+ * jobs from the back of their own deque and, once it is empty, steal
+ * from the front of the others, so uneven jobs still keep every worker
+ * busy. Each worker keeps one VM and only reloads it when the program
+ * of the next job differs, so the decoded stream (and JIT code) is
+ * reused across jobs of the same program.
+ *
+ * Panics do not exit the process. The error code of a failed job is
+ * returned in its result instead.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vm.h"
+
+/*
+ * A single job: a program and the data section input.
+ */
+typedef struct _vjob {
+	std::shared_ptr<const Program> program;
+	std::vector<uint8_t> data;
+} vjob;
+
+/*
+ * Result of a job.
+ */
+typedef struct _vresult {
+	uint32_t value;				// vreg[0] when the VM stopped.
+	uint32_t error;				// Panic code or 0 if the VM halted.
+} vresult;
+
+class VMPool {
+	private:
+	/*
+	 * Job deque of one worker.
+	 */
+	typedef struct _vqueue {
+		std::mutex lock;
+		std::deque<size_t> jobs;	// Indices into m_jobs.
+	} vqueue;
+
+	std::vector<std::thread> m_workers;
+	std::vector<std::unique_ptr<vqueue>> m_queues;
+
+	/*
+	 * Current batch.
+	 */
+	const std::vector<vjob> *m_jobs = nullptr;
+	std::vector<vresult> *m_results = nullptr;
+
+	/*
+	 * Batch bookkeeping, guarded by m_lock.
+	 */
+	std::mutex m_lock;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	uint64_t m_batch = 0;		// Incremented for every batch.
+	size_t m_pending = 0;		// Jobs of the batch not yet finished.
+	size_t m_active = 0;		// Workers taking jobs of the batch.
+	bool m_stop = false;
+
+	/*
+	 * Worker thread body.
+	 */
+	void work(const size_t id);
+
+	/*
+	 * Take a job for worker id, from its own deque first and then
+	 * from the others. Returns false if all deques are empty.
+	 */
+	bool take(const size_t id, size_t& job);
+
+	public:
+	/*
+	 * Start the given number of workers, one per hardware thread by
+	 * default.
+	 */
+	explicit VMPool(size_t threads = 0);
+	~VMPool();
+
+	VMPool(const VMPool&) = delete;
+	VMPool& operator=(const VMPool&) = delete;
+
+	/*
+	 * Run all jobs and return their results in the same order.
+	 * Blocks until the batch is done. Not reentrant.
+	 */
+	std::vector<vresult> run(const std::vector<vjob>& jobs);
+
+	size_t size() const {
+		return m_workers.size();
+	}
+};
+
+#endif // !__POOL_H__
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "vm.h"
+
+Profile::Profile() {
+    reset();
+}
+
+void Profile::begin(const vstream& stream, const std::shared_ptr<const Program>& program) {
+    /*
+     * Counts of a different program do not carry over.
+     */
+    if (program != m_program || stream.vaddr.size() != m_vaddr.size()) {
+        reset();
+        m_program = program;
+        m_vaddr = stream.vaddr;
+        m_hits.assign(stream.insns.size(), 0);
+    }
+
+    m_frame = 0;
+    m_running = false;
+    m_call = false;
+    m_ret = false;
+}
+
+void Profile::enter(const uint32_t function) {
+    const auto it = m_frames[m_frame].children.find(function);
+    uint32_t frame;
+
+    if (it != m_frames[m_frame].children.end()) {
+        frame = it->second;
+    } else {
+        frame = m_frames.size();
+        m_frames[m_frame].children[function] = frame;
+        m_frames.push_back({ m_frame, function, 0, 0, {} });
+    }
+
+    m_frames[frame].calls++;
+    m_frame = frame;
+}
+
+void Profile::end(void) {
+    const uint64_t time = now();
+
+    if (m_running) {
+        m_cycles[m_opcode] += time - m_last;
+        m_frames[m_frame].cycles += time - m_last;
+    }
+
+    m_running = false;
+}
+
+void Profile::reset(void) {
+    m_counts.fill(0);
+    m_cycles.fill(0);
+    std::fill(m_hits.begin(), m_hits.end(), 0);
+    m_frames.assign(1, { 0, 0, 0, 0, {} });
+    m_frame = 0;
+    m_running = false;
+    m_call = false;
+    m_ret = false;
+}
+
+std::string Profile::name(const uint32_t function) const {
+    if (m_program) {
+        for (const auto& symbol : m_program->symbols()) {
+            if (symbol.second == function)
+                return symbol.first;
+        }
+    }
+
+    std::ostringstream name;
+    name << "0x" << std::hex << function;
+    return name.str();
+}
+
+void Profile::dump_opcodes(std::ostream& out) const {
+    std::vector<unsigned> opcodes;
+
+    for (unsigned i = 0; i < 256; i++) {
+        if (m_counts[i] != 0)
+            opcodes.push_back(i);
+    }
+
+    std::sort(opcodes.begin(), opcodes.end(), [this](const unsigned a, const unsigned b) {
+        return m_cycles[a] > m_cycles[b];
+    });
+
+    out << std::left << std::setw(24) << "opcode" << std::right << std::setw(16) << "count" << std::setw(20) << "cycles" << std::setw(12) << "per op" << "\n";
+    for (const unsigned opcode : opcodes) {
+        out << std::left << std::setw(24) << opcode_name(opcode) << std::right
+            << std::setw(16) << m_counts[opcode]
+            << std::setw(20) << m_cycles[opcode]
+            << std::setw(12) << m_cycles[opcode] / m_counts[opcode] << "\n";
+    }
+}
+
+void Profile::dump_pcs(std::ostream& out) const {
+    for (size_t i = 0; i < m_hits.size(); i++) {
+        if (m_hits[i] != 0)
+            out << "0x" << std::hex << m_vaddr[i] << std::dec << " " << m_hits[i] << "\n";
+    }
+}
+
+void Profile::dump_folded(std::ostream& out) const {
+    for (size_t i = 0; i < m_frames.size(); i++) {
+        if (m_frames[i].cycles == 0)
+            continue;
+
+        /*
+         * Walk up to the entry point and print root first.
+         */
+        std::vector<uint32_t> stack;
+
+        for (uint32_t frame = i; frame != 0; frame = m_frames[frame].parent)
+            stack.push_back(frame);
+
+        out << name(0);
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it)
+            out << ";" << name(m_frames[*it].function);
+        out << " " << m_frames[i].cycles << "\n";
+    }
+}
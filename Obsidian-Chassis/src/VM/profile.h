@@ -0,0 +1,152 @@
+/*
+ * profile.h
+ *
+ * Execution profiler for the CPU loop.
+ *
+ * Compile with -DVM_PROFILE and attach a Profile to a VM with
+ * VM::set_profile to record, for every dispatched instruction:
+ *
+ *   - the execution count and cycles (rdtsc, or steady_clock ticks on
+ *     other hosts) per opcode, where an instruction is charged the
+ *     time until the next dispatch,
+ *   - the hit count per code offset,
+ *   - the cycles per call stack. Calls (VM_CALL, VM_RCALL and fused
+ *     calls) push the offset of the next dispatched instruction as a
+ *     new frame and VM_RET pops one.
+ *
+ * Without VM_PROFILE none of this is compiled in. With it, a VM without
+ * a profile pays one predictable branch per dispatch. Instructions run
+ * by the JIT are charged to the VM_JITBLOCK that entered them.
+ *
+ * Counts accumulate over runs until reset. The call stacks are dumped
+ * in the folded format read by flamegraph.pl and speedscope, with
+ * functions named by their symbol (see container.h) or code offset:
+ *
+ *   0x0;0x1a;0x1a 1234
+ *
+ * Included by vm.h after the program type.
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class Profile {
+	private:
+	/*
+	 * Node of the call tree. Node 0 is the entry point.
+	 */
+	typedef struct _vframe {
+		uint32_t parent;			// Caller node.
+		uint32_t function;			// Code offset of the callee.
+		uint64_t calls;				// Number of calls along this edge.
+		uint64_t cycles;			// Cycles spent in the frame itself.
+		std::map<uint32_t, uint32_t> children;	// Callee offset to node.
+	} vframe;
+
+	std::array<uint64_t, 256> m_counts {};		// Executions per opcode.
+	std::array<uint64_t, 256> m_cycles {};		// Cycles per opcode.
+	std::vector<uint64_t> m_hits;				// Hits per decoded index.
+	std::vector<uint32_t> m_vaddr;				// Decoded index to code offset.
+	std::vector<vframe> m_frames;				// Call tree.
+	std::shared_ptr<const Program> m_program;	// For symbol names.
+
+	uint64_t m_last = 0;			// Timestamp of the last dispatch.
+	OPCODE m_opcode = 0;			// Opcode of the last dispatch.
+	uint32_t m_frame = 0;			// Current call tree node.
+	bool m_running = false;			// Whether m_last and m_opcode are valid.
+	bool m_call = false;			// Whether the last dispatch was a call.
+	bool m_ret = false;				// Whether the last dispatch was VM_RET.
+
+	static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+
+	/*
+	 * Returns the name of a function, its symbol if the program has one.
+	 */
+	std::string name(const uint32_t function) const;
+
+	public:
+	Profile();
+
+	/*
+	 * Start recording a run of a program.
+	 */
+	void begin(const vstream& stream, const std::shared_ptr<const Program>& program);
+
+	/*
+	 * Record the dispatch of the instruction at a decoded index.
+	 */
+	void step(const uint32_t index, const OPCODE opcode) {
+		const uint64_t time = now();
+
+		if (m_running) {
+			m_cycles[m_opcode] += time - m_last;
+			m_frames[m_frame].cycles += time - m_last;
+		}
+
+		/*
+		 * The instruction after a call is the entry of the callee, 
+		 * the one after a return is back in the caller.
+		 */
+		if (m_call)
+			enter(m_vaddr[index]);
+		else if (m_ret && m_frame != 0)
+			m_frame = m_frames[m_frame].parent;
+
+		m_counts[opcode]++;
+		m_hits[index]++;
+		m_last = time;
+		m_opcode = opcode;
+		m_running = true;
+		m_call = opcode == VM_CALL || opcode == VM_RCALL || opcode == VM_PUSH_DEC_CALL;
+		m_ret = opcode == VM_RET;
+	}
+
+	/*
+	 * Push a call tree frame for a function.
+	 */
+	void enter(const uint32_t function);
+
+	/*
+	 * Charge the last instruction of a run.
+	 */
+	void end();
+
+	/*
+	 * Clear all counts.
+	 */
+	void reset();
+
+	/*
+	 * Print the opcode counts and cycles, busiest first.
+	 */
+	void dump_opcodes(std::ostream& out) const;
+
+	/*
+	 * Print the hit count of every executed code offset.
+	 */
+	void dump_pcs(std::ostream& out) const;
+
+	/*
+	 * Print the call stacks in folded format, weighted by cycles.
+	 */
+	void dump_folded(std::ostream& out) const;
+};
+
+#endif // !__PROFILE_H__
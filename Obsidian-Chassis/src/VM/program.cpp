@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "container.h"
+#include "decode.h"
+#include "err.h"
+#include "vm.h"
+
+Program::Program(const OPCODE *code, const uint32_t size, const bool native) : m_code(code), m_size(size), m_native(native) {
+    decode();
+}
+
+Program::Program(std::vector<OPCODE> code) : m_owned(std::move(code)) {
+    m_code = m_owned.data();
+    m_size = m_owned.size();
+    decode();
+}
+
+void Program::decode(void) {
+    decode_stream(m_code, m_size, m_stream);
+
+    /*
+     * Native instructions can only run from executable code. Anywhere
+     * else the call would fault outside guest memory and kill the host.
+     */
+    if (!m_native) {
+        for (auto& insn : m_stream.insns) {
+            if (insn.opcode == VM_PASSTHRU) {
+                insn = vinsn();
+                insn.opcode = VM_FAULT;
+                insn.imm = ERR_OPCODE_INVALID;
+            }
+        }
+    }
+
+    for (const auto& insn : m_stream.insns) {
+        if (insn.opcode == VM_CALL || insn.opcode == VM_RCALL)
+            m_calls.emplace_back(insn.imm, m_stream.vaddr[insn.target]);
+    }
+
+    std::sort(m_calls.begin(), m_calls.end());
+
+    verify_stream(m_stream, m_verify);
+}
+
+/*
+ * Returns whether [offset, offset + size) lies within a file of the
+ * given size.
+ */
+static bool within(const uint32_t offset, const uint32_t size, const size_t file) {
+    return (uint64_t)offset + size <= file;
+}
+
+Program::Program(void *map, const size_t size, const std::string& path) : m_code(nullptr), m_size(0) {
+    const uint8_t *base = (const uint8_t *)map;
+    vheader header;
+
+    if (size < sizeof(header))
+        throw std::runtime_error(path + ": file too small for a container header");
+    memcpy(&header, base, sizeof(header));
+
+    if (header.magic != VM_CONTAINER_MAGIC)
+        throw std::runtime_error(path + ": not a bytecode container");
+    if (header.version != VM_CONTAINER_VERSION)
+        throw std::runtime_error(path + ": unsupported container version " + std::to_string(header.version));
+    if (!within(header.code_offset, header.code_size, size) ||
+        !within(header.data_offset, header.data_size, size) ||
+        !within(header.symbols_offset, header.symbols_size, size))
+        throw std::runtime_error(path + ": section exceeds the end of the file");
+
+    /*
+     * Walk the symbol table.
+     */
+    const uint8_t *symbol = base + header.symbols_offset;
+    const uint8_t *end = symbol + header.symbols_size;
+
+    while (symbol != end) {
+        uint32_t value;
+
+        if (end - symbol < 5 || end - symbol < 5 + symbol[4])
+            throw std::runtime_error(path + ": truncated symbol table");
+
+        memcpy(&value, symbol, sizeof(value));
+        m_symbols[std::string((const char *)symbol + 5, symbol[4])] = value;
+        symbol += 5 + symbol[4];
+    }
+
+    m_code = base + header.code_offset;
+    m_size = header.code_size;
+    m_data = base + header.data_offset;
+    m_data_size = header.data_size;
+
+    decode();
+
+    /*
+     * Only take the mapping once nothing can throw, the caller unmaps
+     * it otherwise.
+     */
+    m_map = map;
+    m_map_size = size;
+}
+
+Program::~Program() {
+    if (m_map)
+        munmap(m_map, m_map_size);
+}
+
+std::shared_ptr<const Program> Program::builtin(void) {
+    /*
+     * Decoded once and shared by every VM started without a program.
+     */
+    static const std::shared_ptr<const Program> program = std::make_shared<const Program>(&_vm_start, _vm_size, true);
+
+    return program;
+}
+
+std::shared_ptr<const Program> Program::open(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        throw std::runtime_error(path + ": " + strerror(errno));
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error(path + ": cannot map an empty or unreadable file");
+    }
+
+    /*
+     * A private read-only mapping is backed by the page cache, so
+     * nothing is copied and every process that loads the file shares
+     * the same pages.
+     */
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int error = errno;
+
+    close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error(path + ": " + strerror(error));
+
+    Program *program;
+
+    try {
+        program = new Program(map, st.st_size, path);
+    } catch (...) {
+        munmap(map, st.st_size);
+        throw;
+    }
+
+    return std::shared_ptr<const Program>(program);
+}
+
+bool Program::callee(const REG ret, uint32_t& offset) const {
+    const auto it = std::lower_bound(m_calls.begin(), m_calls.end(), std::make_pair(ret, (uint32_t)0));
+
+    if (it == m_calls.end() || it->first != ret)
+        return false;
+
+    offset = it->second;
+    return true;
+}
+
+bool Program::symbol(const std::string& name, uint32_t& value) const {
+    const auto it = m_symbols.find(name);
+
+    if (it == m_symbols.end())
+        return false;
+
+    value = it->second;
+    return true;
+}
@@ -0,0 +1,161 @@
+/*
+ * program.h
+ *
+ * Immutable program shared between VM instances.
+ *
+ * A program is a code section and its decoded stream. It is decoded
+ * once when constructed and never modified afterwards, so any number
+ * of VMs on any number of threads can run it at the same time. Each VM
+ * copies the decoded stream when it loads the program and applies its
+ * own fusion patterns and JIT state to the copy.
+ *
+ * The code bytes are either borrowed (e.g. the _vm_start section linked
+ * into the binary), owned by the program, or mapped read-only from a
+ * container file (see container.h). Mapped programs run straight from
+ * the mapping, which the page cache shares between every process that
+ * loads the file.
+ *
+ * VM_PASSTHRU calls into the code bytes, so it only runs in native
+ * programs: the builtin program and borrowed code marked native. Owned
+ * code lives on the heap and mapped code is read-only, neither is
+ * executable. Everywhere else VM_PASSTHRU traps with an invalid opcode
+ * error instead of crashing the host.
+ *
+ * Included by vm.h after the decoded stream types.
+ */
+
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+
+#include <map>
+#include <memory>
+#include <string>
+
+class Program {
+	private:
+	/*
+	 * Code bytes owned by the program. Empty if borrowed.
+	 */
+	std::vector<OPCODE> m_owned;
+
+	/*
+	 * Code section.
+	 */
+	const OPCODE *m_code;
+
+	/*
+	 * Size of the code section.
+	 */
+	uint32_t m_size;
+
+	/*
+	 * Whether the code bytes are executable host memory. VM_PASSTHRU 
+	 * decodes as a fault otherwise.
+	 */
+	bool m_native = false;
+
+	/*
+	 * Initial data section, copied into the data section when a VM 
+	 * is started without input.
+	 */
+	const uint8_t *m_data = nullptr;
+	uint32_t m_data_size = 0;
+
+	/*
+	 * Symbol table.
+	 */
+	std::map<std::string, uint32_t> m_symbols;
+
+	/*
+	 * Read-only mapping of a container file or null.
+	 */
+	void *m_map = nullptr;
+	size_t m_map_size = 0;
+
+	/*
+	 * Decoded code section without fusion.
+	 */
+	vstream m_stream;
+
+	/*
+	 * Return address to callee offset of every VM_CALL and VM_RCALL, 
+	 * sorted by return address.
+	 */
+	std::vector<std::pair<uint32_t, uint32_t>> m_calls;
+
+	/*
+	 * Outcome of verifying the decoded stream.
+	 */
+	vverify m_verify;
+
+	/*
+	 * Decode the code section, index its calls and verify it.
+	 * VM_PASSTHRU decodes as an invalid opcode fault unless the code 
+	 * is native.
+	 */
+	void decode();
+
+	/*
+	 * Take ownership of a mapped container file. Validates the header 
+	 * and throws std::runtime_error if the file is malformed.
+	 */
+	Program(void *map, const size_t size, const std::string& path);
+
+	public:
+	/*
+	 * Borrow size bytes of code. The code must outlive the program. 
+	 * Set native only if the code is executable host memory that 
+	 * VM_PASSTHRU may call into.
+	 */
+	Program(const OPCODE *code, const uint32_t size, const bool native = false);
+
+	/*
+	 * Take ownership of a copy of the code.
+	 */
+	explicit Program(std::vector<OPCODE> code);
+
+	~Program();
+
+	Program(const Program&) = delete;
+	Program& operator=(const Program&) = delete;
+
+	/*
+	 * Returns the program linked into the binary at _vm_start.
+	 */
+	static std::shared_ptr<const Program> builtin();
+
+	/*
+	 * Map a container file read-only and decode its code section. 
+	 * Throws std::runtime_error if the file cannot be read or is not 
+	 * a valid container.
+	 */
+	static std::shared_ptr<const Program> open(const std::string& path);
+
+	const OPCODE *code() const { return m_code; }
+	uint32_t size() const { return m_size; }
+	const vstream& stream() const { return m_stream; }
+	const uint8_t *data() const { return m_data; }
+	uint32_t data_size() const { return m_data_size; }
+	const std::map<std::string, uint32_t>& symbols() const { return m_symbols; }
+	bool native() const { return m_native; }
+
+	/*
+	 * Returns the outcome of verifying the program (see verify.h). The 
+	 * program verified if error is 0.
+	 */
+	const vverify& verification() const { return m_verify; }
+
+	/*
+	 * Returns whether a value is the return address of a call and the 
+	 * offset of the callee. Safe to call from a signal handler.
+	 */
+	bool callee(const REG ret, uint32_t& offset) const;
+
+	/*
+	 * Look up a symbol. Returns false if the program has no symbol of 
+	 * that name.
+	 */
+	bool symbol(const std::string& name, uint32_t& value) const;
+};
+
+#endif // !__PROGRAM_H__
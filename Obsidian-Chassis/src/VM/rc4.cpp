@@ -2,36 +2,122 @@
 
 #include "rc4.h"
 
+/*
+ * Key schedule of n streams with keys of kl bytes, 0 < kl <= MAX_VALUE,
+ * interleaved. Returns j in j[s].
+ */
+template <size_t N>
+static void schedule(uint8_t (*S)[MAX_VALUE], uint8_t *j, const uint8_t *const *keys, size_t kl) {
+	for (size_t s = 0; s < N; ++s) {
+		for (int i = 0; i < MAX_VALUE; ++i) S[s][i] = i;
+		j[s] = 0;
+	}
+
+	/*
+	 * Keys longer than MAX_VALUE bytes are cut to MAX_VALUE bytes, so
+	 * the index wraps at kl as it would at the full key length.
+	 */
+	for (size_t i = 0, k = 0; i < MAX_VALUE; ++i, k = k + 1 == kl ? 0 : k + 1) {
+		for (size_t s = 0; s < N; ++s) {
+			const uint8_t a = S[s][i];
+
+			j[s] += a + keys[s][k];
+			S[s][i] = S[s][j[s]];
+			S[s][j[s]] = a;
+		}
+	}
+}
+
+/*
+ * Encrypt len bytes of in with N scheduled streams, interleaved.
+ */
+template <size_t N>
+static void generate(uint8_t (*S)[MAX_VALUE], uint8_t *j, const uint8_t *in, size_t len, uint8_t *const *out) {
+	uint8_t *o[N];
+	uint8_t i = 0;
+
+	/*
+	 * Byte stores may alias the pointer array, so keep a copy.
+	 */
+	for (size_t s = 0; s < N; ++s) o[s] = out[s];
+
+	for (size_t k = 0; k < len; ++k) {
+		const uint8_t c = in[k];
+
+		++i;
+		for (size_t s = 0; s < N; ++s) {
+			const uint8_t a = S[s][i];
+
+			j[s] += a;
+
+			const uint8_t b = S[s][j[s]];
+
+			S[s][i] = b;
+			S[s][j[s]] = a;
+			o[s][k] = c ^ S[s][(uint8_t)(a + b)];
+		}
+	}
+}
+
+template <size_t N>
+static void streams(uint8_t *const *keys, size_t kl, const uint8_t *in, size_t len, uint8_t *const *out) {
+	uint8_t S[N][MAX_VALUE];
+	uint8_t j[N];
+
+	schedule<N>(S, j, keys, kl);
+	generate<N>(S, j, in, len, out);
+}
+
 void RC4::set_for_cipher(int kl=8,uint8_t *_key=NULL) {
 	keylen = kl;
+	if (kl <= 0) kl = 1;
+	if (kl > MAX_VALUE) kl = MAX_VALUE;
 	if (_key == NULL) {
 		srand(time(0));
-		K.push_back(rand()%MAX_VALUE);
+		K.resize(kl);
+		for (int i=0; i<kl; ++i) K[i] = rand()%MAX_VALUE;
 	} else {
-		for (int i=0; i<kl; ++i) K.push_back(_key[i]);
+		K.assign(_key, _key + kl);
 	}
+
+	const uint8_t *key = K.data();
+
+	schedule<1>(&S, &j0, &key, K.size());
+}
+
+void RC4::set_key(int kl, const std::vector<uint8_t>& key) {
+	keylen = kl;
+	K = key;
+	if (K.size() > MAX_VALUE) K.resize(MAX_VALUE);
+	if (K.empty()) K.push_back(0);
+
+	const uint8_t *k = K.data();
+
+	schedule<1>(&S, &j0, &k, K.size());
 }
 
 void RC4::cipher(uint8_t *in, size_t len, uint8_t *out, uint8_t *ks) {
-	int i,j,t;
-	for(i=0;i<256;++i){
-		S[i]=i;
-		T[i]=K[i%keylen];
-	}
+	uint8_t s[MAX_VALUE];
+	uint8_t i = 0, j = j0;
 
-	j=0;
-	for (i=0; i<256; ++i) {
-		j=(j+S[i]+T[i])%256;
-		std::swap(S[i],S[j]);
-	}
+	memcpy(s, S, sizeof(s));
 
 	for (size_t k=0; k<len; ++k) {
-		i=(i+1)%256;
-		j=(j+S[i])%256;
-		std::swap(S[i],S[j]);
-		t=(S[i]+S[j])%256;
-		ks[k] = S[t]; 
-		out[k] = ks[k]^in[k];
+		++i;
+
+		const uint8_t a = s[i];
+
+		j += a;
+
+		const uint8_t b = s[j];
+
+		s[i] = b;
+		s[j] = a;
+
+		const uint8_t t = s[(uint8_t)(a + b)];
+
+		if (ks) ks[k] = t;
+		out[k] = t^in[k];
 	}
 }
 
@@ -39,4 +125,18 @@ void RC4::decipher(uint8_t *in, size_t len, uint8_t *out, uint8_t *ks) {
 	for (size_t k=0; k<len; ++k) {
 		out[k] = ks[k]^in[k];
 	}
-}
\ No newline at end of file
+}
+
+void RC4::cipher_streams(size_t n, uint8_t *const *keys, int kl, const uint8_t *in, size_t len, uint8_t *const *out) {
+	if (kl <= 0) kl = 1;
+	if (kl > MAX_VALUE) kl = MAX_VALUE;
+
+	for (; n >= RC4_STREAMS; n -= RC4_STREAMS, keys += RC4_STREAMS, out += RC4_STREAMS)
+		streams<RC4_STREAMS>(keys, kl, in, len, out);
+	if (n >= RC4_STREAMS / 2 && RC4_STREAMS / 2 > 1) {
+		streams<(RC4_STREAMS / 2 > 1 ? RC4_STREAMS / 2 : 1)>(keys, kl, in, len, out);
+		n -= RC4_STREAMS / 2, keys += RC4_STREAMS / 2, out += RC4_STREAMS / 2;
+	}
+	for (; n > 0; --n, ++keys, ++out)
+		streams<1>(keys, kl, in, len, out);
+}
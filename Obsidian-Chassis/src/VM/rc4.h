@@ -13,20 +13,48 @@
 #define BITS_PER_BYTES 8
 #define MAX_VALUE (1<<(BITS_PER_BYTES))
 
+/*
+ * Number of independent streams cipher_streams runs interleaved. Every
+ * step of a stream depends on the S-box swap of the step before, so one
+ * stream is bound by load latency. Interleaved streams overlap it, up
+ * to the point where their indices no longer fit in host registers.
+ */
+#ifndef RC4_STREAMS
+#define RC4_STREAMS 4
+#endif
+
 class RC4{
 public:
-	RC4(){};
+	RC4(){set_for_decipher();}
 	~RC4(){}
+	/*
+	 * Set the key and run the key schedule, which cipher() then reuses.
+	 * Only the first MAX_VALUE bytes of longer keys are scheduled. A null
+	 * key is random.
+	 */
 	void set_for_cipher(int kl, uint8_t *_key);
-	void set_for_decipher(){K.clear();memset(S,0,sizeof(S)),memset(T,0,sizeof(T));}
+	void set_for_decipher(){K.clear();keylen=0;memset(S,0,sizeof(S));j0=0;}
+	/*
+	 * Encrypt len bytes with the scheduled key, storing the keystream
+	 * to ks unless it is null.
+	 */
 	void cipher(uint8_t *in, size_t len, uint8_t *out, uint8_t *ks);
 	void decipher(uint8_t *in, size_t len, uint8_t *out, uint8_t *ks);
-    
+	/*
+	 * Encrypt len bytes of in with n keys of kl bytes, as cipher() does
+	 * after set_for_cipher(kl, keys[k]), into out[k]. Runs RC4_STREAMS
+	 * streams at a time. The outputs must not overlap in.
+	 */
+	static void cipher_streams(size_t n, uint8_t *const *keys, int kl, const uint8_t *in, size_t len, uint8_t *const *out);
+	const std::vector<uint8_t>& key() const {return K;}
+	int key_length() const {return keylen;}
+	void set_key(int kl, const std::vector<uint8_t>& key);
+
 private:
-	int keylen;
+	int keylen = 0;
 	std::vector<uint8_t> K;
-	uint8_t S[256];
-	uint8_t T[256];
+	uint8_t S[256];				// S-box scheduled from K.
+	uint8_t j0 = 0;				// j at the end of the schedule.
 };
 
-#endif
\ No newline at end of file
+#endif
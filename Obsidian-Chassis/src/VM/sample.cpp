@@ -0,0 +1,195 @@
+#include <csignal>
+#include <sstream>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+#ifdef VM_SAMPLE
+
+/*
+ * Older C libraries only expose the thread id of SIGEV_THREAD_ID through
+ * the union.
+ */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+ * VM running on this thread and the ring of this thread.
+ */
+static thread_local const VM *t_running = nullptr;
+static thread_local void *t_ring = nullptr;
+
+static std::once_flag installed;
+
+Sampler::Sampler(const unsigned rate, const size_t capacity) : m_period(1000000000L / (rate ? rate : 1)), m_capacity(capacity ? capacity : 1) {
+    std::call_once(installed, [] {
+        struct sigaction action = {};
+
+        action.sa_sigaction = handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, nullptr);
+    });
+}
+
+Sampler::~Sampler() {
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    for (auto& ring : m_rings) {
+        if (ring->attached)
+            timer_delete(ring->timer);
+    }
+}
+
+bool Sampler::attach(void) {
+    std::unique_ptr<vring> ring(new vring);
+
+    ring->attached = false;
+    ring->samples.resize(m_capacity);
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+
+    /*
+     * Measure the CPU time of this thread and signal this thread.
+     */
+    struct sigevent event = {};
+
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &ring->timer) != 0)
+        return false;
+
+    /*
+     * Touch the thread locals before the first signal can arrive.
+     */
+    t_running = nullptr;
+    t_ring = ring.get();
+
+    ring->attached = true;
+
+    const struct itimerspec spec = { { 0, m_period }, { 0, m_period } };
+
+    if (timer_settime(ring->timer, 0, &spec, nullptr) != 0) {
+        timer_delete(ring->timer);
+        t_ring = nullptr;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_rings.push_back(std::move(ring));
+    return true;
+}
+
+void Sampler::detach(void) {
+    vring *ring = (vring *)t_ring;
+
+    if (ring == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    timer_delete(ring->timer);
+    ring->attached = false;
+    t_ring = nullptr;
+}
+
+void Sampler::running(const VM *vm) {
+    t_running = vm;
+}
+
+void Sampler::handler(int sig, siginfo_t *info, void *context) {
+    (void)sig;
+    (void)info;
+    (void)context;
+
+    vring *ring = (vring *)t_ring;
+    const VM *vm = t_running;
+
+    if (ring == nullptr || vm == nullptr)
+        return;
+
+    const size_t head = ring->head.load(std::memory_order_relaxed);
+
+    if (head - ring->tail.load(std::memory_order_acquire) == ring->samples.size()) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    vm->sample(ring->samples[head % ring->samples.size()]);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string Sampler::name(const Program *program, const uint32_t offset) {
+    std::string best;
+    uint32_t value = 0;
+
+    for (const auto& symbol : program->symbols()) {
+        if (symbol.second <= offset && (best.empty() || symbol.second > value)) {
+            best = symbol.first;
+            value = symbol.second;
+        }
+    }
+
+    std::ostringstream name;
+
+    if (best.empty())
+        name << "0x" << std::hex << offset;
+    else if (value == offset)
+        name << best;
+    else
+        name << best << "+0x" << std::hex << offset - value;
+
+    return name.str();
+}
+
+void Sampler::flush(void) {
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    for (auto& ring : m_rings) {
+        const size_t head = ring->head.load(std::memory_order_acquire);
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+
+        for (; tail != head; tail++) {
+            const vsample& sample = ring->samples[tail % ring->samples.size()];
+            std::string stack = name(sample.program, 0);
+
+            for (uint32_t i = 0; i < sample.depth; i++)
+                stack += ";" + name(sample.program, sample.frames[i]);
+
+            /*
+             * The leaf is the executing offset unless it is the entry
+             * of the innermost function.
+             */
+            if (sample.pc != (sample.depth ? sample.frames[sample.depth - 1] : 0))
+                stack += ";" + name(sample.program, sample.pc);
+
+            m_stacks[stack]++;
+        }
+
+        ring->tail.store(tail, std::memory_order_release);
+        m_dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    /*
+     * Rings of detached threads are no longer written.
+     */
+    for (auto it = m_rings.begin(); it != m_rings.end();) {
+        if (!(*it)->attached)
+            it = m_rings.erase(it);
+        else
+            ++it;
+    }
+}
+
+void Sampler::dump_folded(std::ostream& out) const {
+    for (const auto& stack : m_stacks)
+        out << stack.first << " " << stack.second << "\n";
+}
+
+#endif // VM_SAMPLE
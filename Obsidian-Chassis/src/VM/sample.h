@@ -0,0 +1,152 @@
+/*
+ * sample.h
+ *
+ * Sampling profiler driven by a POSIX interval timer.
+ *
+ * Compile with -DVM_SAMPLE. Every thread that runs VMs calls
+ * Sampler::attach, which creates a timer on the CPU time of the thread
+ * (timer_create with SIGEV_THREAD_ID) delivering SIGPROF. The handler
+ * takes the VM running on the thread, if any, and records its code
+ * offset and call stack into a lock-free ring buffer of the thread.
+ * The call stack is recovered from the return addresses on the virtual
+ * stack (see Program::callee), innermost VM_SAMPLE_DEPTH frames.
+ *
+ * flush() drains the rings from any thread and symbolises the samples
+ * against the symbols of the program (the assembler labels exported
+ * into the container, see container.h), falling back to code offsets.
+ * Samples are aggregated as folded stacks for flamegraph tools.
+ *
+ * The running VM only publishes itself when its loop starts and stops,
+ * and orders its stores before each dispatch with a signal fence, so
+ * the cost between samples is close to nothing. Samples are dropped
+ * when a ring is full. Programs must outlive the flush of their
+ * samples. Thread CPU timers expire on the scheduler tick, so the
+ * effective rate is bounded by the kernel HZ.
+ *
+ * Included by vm.h after the program type.
+ */
+
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include <atomic>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Maximum number of call frames recorded per sample.
+ */
+#ifndef VM_SAMPLE_DEPTH
+#define VM_SAMPLE_DEPTH 32
+#endif
+
+class VM;
+
+/*
+ * A single sample.
+ */
+typedef struct _vsample {
+	const Program *program;				// Program of the VM.
+	uint32_t pc;						// Code offset being executed.
+	uint32_t depth;						// Number of frames.
+	uint32_t frames[VM_SAMPLE_DEPTH];	// Callee offsets, outermost first.
+} vsample;
+
+class Sampler {
+	private:
+	/*
+	 * Single producer (the signal handler of one thread), single
+	 * consumer (flush) ring of samples.
+	 */
+	typedef struct _vring {
+		std::vector<vsample> samples;
+		std::atomic<size_t> head;		// Next slot written by the handler.
+		std::atomic<size_t> tail;		// Next slot read by flush.
+		std::atomic<uint64_t> dropped;	// Samples lost to a full ring.
+		timer_t timer;					// CPU time timer of the thread.
+		bool attached;					// Whether the timer exists.
+	} vring;
+
+	/*
+	 * Sampling period and ring capacity.
+	 */
+	long m_period;
+	size_t m_capacity;
+
+	/*
+	 * Rings of all attached threads, guarded by m_lock.
+	 */
+	std::mutex m_lock;
+	std::vector<std::unique_ptr<vring>> m_rings;
+
+	/*
+	 * Aggregated folded stacks and dropped samples.
+	 */
+	std::map<std::string, uint64_t> m_stacks;
+	uint64_t m_dropped = 0;
+
+	/*
+	 * SIGPROF handler.
+	 */
+	static void handler(int sig, siginfo_t *info, void *context);
+
+	/*
+	 * Returns the name of a code offset: the nearest symbol at or
+	 * below it, or the offset itself.
+	 */
+	static std::string name(const Program *program, const uint32_t offset);
+
+	public:
+	/*
+	 * Sample at the given rate per second of thread CPU time, keeping
+	 * up to capacity unflushed samples per thread.
+	 */
+	explicit Sampler(const unsigned rate = 1000, const size_t capacity = 4096);
+	~Sampler();
+
+	Sampler(const Sampler&) = delete;
+	Sampler& operator=(const Sampler&) = delete;
+
+	/*
+	 * Start sampling the calling thread. Returns false if the timer
+	 * cannot be created.
+	 */
+	bool attach();
+
+	/*
+	 * Stop sampling the calling thread. Its pending samples are kept
+	 * until the next flush.
+	 */
+	void detach();
+
+	/*
+	 * Publish the VM running on the calling thread, or null when it
+	 * stops. Called by VM::loop.
+	 */
+	static void running(const VM *vm);
+
+	/*
+	 * Drain all rings into the aggregated stacks.
+	 */
+	void flush();
+
+	/*
+	 * Print the aggregated stacks in folded format, weighted by sample
+	 * count.
+	 */
+	void dump_folded(std::ostream& out) const;
+
+	/*
+	 * Returns the number of samples dropped because a ring was full.
+	 */
+	uint64_t dropped() const {
+		return m_dropped;
+	}
+};
+
+#endif // !__SAMPLE_H__
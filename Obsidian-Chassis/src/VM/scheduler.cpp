@@ -0,0 +1,35 @@
+#include <algorithm>
+
+#include "scheduler.h"
+
+Scheduler::Scheduler(const uint64_t quantum) : m_quantum(quantum) {}
+
+void Scheduler::add(VM& vm) {
+    if (vm.status() == VSTATUS_YIELDED)
+        m_ready.push_back(&vm);
+}
+
+void Scheduler::remove(VM& vm) {
+    m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), &vm), m_ready.end());
+}
+
+VM *Scheduler::step(void) {
+    if (m_ready.empty())
+        return nullptr;
+
+    VM *vm = m_ready.front();
+
+    m_ready.pop_front();
+
+    /*
+     * Only a VM that used up its slice goes back in the queue.
+     */
+    if (vm->run(m_quantum) == VSTATUS_YIELDED)
+        m_ready.push_back(vm);
+
+    return vm;
+}
+
+void Scheduler::run(void) {
+    while (step() != nullptr);
+}
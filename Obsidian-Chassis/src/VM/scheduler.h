@@ -0,0 +1,90 @@
+/*
+ * scheduler.h
+ *
+ * Runs many VMs on the calling thread by cooperative time slicing.
+ *
+ * VMs are kept in a ready queue. Each step runs the VM at the front for
+ * one quantum of instructions (see VM::run) and puts it back at the end
+ * if it yielded, so every unfinished VM gets a slice in turn and long
+ * running programs cannot hold up short ones. VMs that halt or trap
+ * leave the queue, their exit value and error code stay readable on
+ * the VM (see VM::value and VM::error).
+ *
+ * The scheduler does not own the VMs. They must outlive it or be
+ * removed first, and must not exit on panic (see
+ * VM::set_exit_on_panic). Each VM keeps its own stack of
+ * VM_STACK_SIZE slots, so thousands of VMs should use a smaller one
+ * (see VM::set_stack_size).
+ */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <deque>
+
+#include "vm.h"
+
+/*
+ * Default number of instructions per slice.
+ */
+#ifndef VM_QUANTUM
+#define VM_QUANTUM 10000
+#endif
+
+class Scheduler {
+	private:
+	/*
+	 * VMs waiting for a slice, next one first.
+	 */
+	std::deque<VM *> m_ready;
+
+	/*
+	 * Instructions per slice.
+	 */
+	uint64_t m_quantum;
+
+	public:
+	explicit Scheduler(const uint64_t quantum = VM_QUANTUM);
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	/*
+	 * Queue a prepared or yielded VM (see VM::prepare). VMs that
+	 * already halted or trapped are not queued.
+	 */
+	void add(VM& vm);
+
+	/*
+	 * Remove a VM from the queue, e.g. to stop a runaway program.
+	 * It stays yielded and can be resumed later.
+	 */
+	void remove(VM& vm);
+
+	/*
+	 * Run the next VM for one slice. Returns the VM, or null if none
+	 * is left.
+	 */
+	VM *step();
+
+	/*
+	 * Step until every VM halted or trapped.
+	 */
+	void run();
+
+	/*
+	 * Set the number of instructions per slice.
+	 */
+	void set_quantum(const uint64_t quantum) {
+		m_quantum = quantum;
+	}
+
+	/*
+	 * Returns the number of VMs that have not finished.
+	 */
+	size_t size() const {
+		return m_ready.size();
+	}
+};
+
+#endif // !__SCHEDULER_H__
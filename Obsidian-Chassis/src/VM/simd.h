@@ -0,0 +1,116 @@
+/*
+ * simd.h
+ *
+ * Vector registers of the VM_V* opcodes.
+ *
+ * A vector register is 256 bits wide and holds 32 byte, 16 word or 8
+ * dword lanes. Packed operations use the GCC/Clang vector extensions,
+ * which compile to pairs of SSE2 instructions on x86-64 and to single
+ * AVX2 instructions when built with -mavx2 (and to scalar code on hosts
+ * without vector units). Vectors are only passed by reference, so the
+ * ABI does not depend on the instruction set the VM is built for.
+ *
+ * Included by vm.h before the base types that hold registers.
+ */
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <cstdint>
+#include <cstring>
+
+#define NUM_VECTORS 16
+#define VECTOR_SIZE 32
+
+typedef uint8_t VEC8 __attribute__((vector_size(VECTOR_SIZE)));
+typedef uint16_t VEC16 __attribute__((vector_size(VECTOR_SIZE)));
+typedef uint32_t VEC32 __attribute__((vector_size(VECTOR_SIZE)));
+
+/*
+ * Create a VEC type to represent a vector register and its lanes.
+ */
+typedef union _vvec {
+	VEC8 b;						// 32 byte lanes.
+	VEC16 w;					// 16 word lanes.
+	VEC32 d;					// 8 dword lanes.
+} VEC;
+
+/*
+ * Unaligned loads and stores of a whole register.
+ */
+static inline void vec_load(VEC& v, const uint8_t *p) {
+	memcpy(&v, p, sizeof(v));
+}
+
+static inline void vec_store(uint8_t *p, const VEC& v) {
+	memcpy(p, &v, sizeof(v));
+}
+
+/*
+ * Set every dword lane to value.
+ */
+static inline void vec_broadcast(VEC& v, const uint32_t value) {
+	v.d = (VEC32){} + value;
+}
+
+/*
+ * Shift every dword lane by count < 32 bits.
+ */
+static inline void vec_shl(VEC& v, const unsigned count) {
+	v.d <<= count;
+}
+
+static inline void vec_shr(VEC& v, const unsigned count) {
+	v.d >>= count;
+}
+
+/*
+ * Select dword lanes within each 128-bit half, two bits of order per
+ * lane, like x86 pshufd. dst and src may be the same register.
+ */
+static inline void vec_shuffle(VEC& dst, const VEC& src, const uint8_t order) {
+#if defined(__GNUC__) && !defined(__clang__)
+	/*
+	 * A single vpermd with AVX2.
+	 */
+	const VEC32 lane = { 0, 2, 4, 6, 0, 2, 4, 6 };
+	const VEC32 half = { 0, 0, 0, 0, 4, 4, 4, 4 };
+
+	dst.d = __builtin_shuffle(src.d, (((VEC32){} + order) >> lane & 3) | half);
+#else
+	VEC32 t;
+
+	for (int i = 0; i < 8; i++)
+		t[i] = src.d[(i & 4) | (order >> 2 * (i & 3) & 3)];
+	dst.d = t;
+#endif
+}
+
+/*
+ * Horizontal reductions to a scalar.
+ */
+static inline uint32_t vec_sum8(const VEC& v) {
+	uint32_t sum = 0;
+
+	for (int i = 0; i < VECTOR_SIZE; i++)
+		sum += v.b[i];
+	return sum;
+}
+
+static inline uint32_t vec_sum32(const VEC& v) {
+	uint32_t sum = 0;
+
+	for (int i = 0; i < 8; i++)
+		sum += v.d[i];
+	return sum;
+}
+
+static inline uint32_t vec_xor32(const VEC& v) {
+	uint32_t x = 0;
+
+	for (int i = 0; i < 8; i++)
+		x ^= v.d[i];
+	return x;
+}
+
+#endif // !__SIMD_H__
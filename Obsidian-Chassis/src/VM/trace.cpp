@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "decode.h"
+#include "rc4.h"
+#include "vm.h"
+
+#ifdef VM_TRACE
+
+/*
+ * Packet types. Branch bytes have the top bit set and hold up to six
+ * branch bits below a stop bit, first branch highest.
+ */
+#define VTRACE_PACKET_TARGET 0x01   // varint zigzag delta to the last target
+#define VTRACE_PACKET_KEY 0x02      // varint key length, varint n, n key bytes
+#define VTRACE_PACKET_COPY 0x03     // varint distance, varint length of branch bytes to copy
+#define VTRACE_PACKET_END 0x04      // varint error, varint return value, varint count
+#define VTRACE_PACKET_BRANCH 0x80
+
+constexpr std::array<uint8_t, 256> Trace::make_kinds(void) {
+    std::array<uint8_t, 256> kinds {};
+
+    /*
+     * Conditional jumps alternate between register and immediate
+     * targets, starting with VM_JE.
+     */
+    for (unsigned opcode = VM_JE; opcode <= VM_JNOI; opcode++)
+        kinds[opcode] = (opcode - VM_JE) % 2 ? VTRACE_JCC : VTRACE_JCC_REG;
+
+    kinds[VM_TEST_JEI] = VTRACE_JCC_FUSED;
+    kinds[VM_TEST_JNEI] = VTRACE_JCC_FUSED;
+    kinds[VM_CMP_JEI] = VTRACE_JCC_FUSED;
+    kinds[VM_CMP_JNEI] = VTRACE_JCC_FUSED;
+    kinds[VM_JMP] = VTRACE_JMP;
+    kinds[VM_CALL] = VTRACE_CALL;
+    kinds[VM_RCALL] = VTRACE_CALL;
+    kinds[VM_PUSH_DEC_CALL] = VTRACE_CALL;
+    kinds[VM_RET] = VTRACE_RET;
+
+    return kinds;
+}
+
+const std::array<uint8_t, 256> Trace::s_kinds = Trace::make_kinds();
+
+static_assert(VM_JE % 2 == 0 && VM_JEI == VM_JE + 1, "conditional jumps must alternate register and immediate");
+
+/*
+ * FNV-1a hash identifying the code section a trace was recorded from.
+ */
+static uint32_t hash(const OPCODE *code, const uint32_t size) {
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < size; i++)
+        hash = (hash ^ code[i]) * 16777619u;
+
+    return hash;
+}
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)value | 0x80);
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+bool Trace::get_varint(uint64_t& value) {
+    value = 0;
+
+    for (unsigned shift = 0; shift < 64 && m_pos < m_packets.size(); shift += 7) {
+        const uint8_t byte = m_packets[m_pos++];
+
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+Trace Trace::open(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    vtheader header;
+
+    if (!in)
+        throw std::runtime_error(path + ": " + strerror(errno));
+    if (!in.read((char *)&header, sizeof(header)))
+        throw std::runtime_error(path + ": file too small for a trace header");
+    if (header.magic != VM_TRACE_MAGIC)
+        throw std::runtime_error(path + ": not a trace");
+    if (header.version != VM_TRACE_VERSION)
+        throw std::runtime_error(path + ": unsupported trace version " + std::to_string(header.version));
+
+    Trace trace;
+
+    trace.m_hash = header.hash;
+    trace.m_code_size = header.code_size;
+    trace.m_data.resize(header.data_size);
+    trace.m_packets.resize(header.packets_size);
+
+    if (!in.read((char *)trace.m_data.data(), header.data_size) ||
+        !in.read((char *)trace.m_packets.data(), header.packets_size))
+        throw std::runtime_error(path + ": truncated trace");
+
+    return trace;
+}
+
+void Trace::save(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    const vtheader header = {
+        VM_TRACE_MAGIC, VM_TRACE_VERSION, 0, m_hash, m_code_size,
+        (uint32_t)m_data.size(), (uint32_t)m_packets.size()
+    };
+
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)m_data.data(), m_data.size());
+    out.write((const char *)m_packets.data(), m_packets.size());
+
+    if (!out.flush())
+        throw std::runtime_error(path + ": " + strerror(errno));
+}
+
+void Trace::begin(const vstream& stream) {
+    m_insns = stream.insns.data();
+    m_vaddr = stream.vaddr.data();
+    m_vindex = stream.vindex.data();
+
+    /*
+     * JIT cold copies follow the two sentinels (see decode_stream).
+     */
+    m_cold = stream.vindex[stream.vsize] + 2;
+    m_last = 0;
+    m_insn = nullptr;
+    m_kind = VTRACE_NONE;
+    m_count = 0;
+    m_target = 0;
+    m_shadow.clear();
+    m_targets.clear();
+    m_bits = 1;
+    m_nbits = 0;
+    m_nbytes = 0;
+    m_copy_distance = 0;
+    m_copy_length = 0;
+    m_pos = 0;
+}
+
+void Trace::record(const vstream& stream, const Program& program, const uint8_t *data, const size_t length) {
+    begin(stream);
+    m_replay = false;
+    m_hash = hash(program.code(), program.size());
+    m_code_size = program.size();
+    m_data.assign(data, data + length);
+    m_packets.clear();
+}
+
+void Trace::replay(const vstream& stream, const Program& program) {
+    if (program.size() != m_code_size || hash(program.code(), program.size()) != m_hash)
+        throw std::runtime_error("trace was recorded from a different program");
+
+    begin(stream);
+    m_replay = true;
+}
+
+bool Trace::transfer(const uint32_t index) {
+    const uint32_t next = m_last + 1;
+
+    switch (m_kind) {
+    case VTRACE_JCC:
+        return branch(index != next);
+    case VTRACE_JCC_FUSED:
+        return branch(index != next + 1);
+    case VTRACE_JCC_REG:
+        return branch(index != next) && (index == next || indirect(m_last, m_vaddr[index]));
+    case VTRACE_JMP:
+        return indirect(m_last, m_vaddr[index]);
+    case VTRACE_CALL:
+        if (m_shadow.size() == VM_TRACE_SHADOW)
+            m_shadow.erase(m_shadow.begin());
+        m_shadow.push_back(m_insn->imm);
+        return true;
+    case VTRACE_RET: {
+        /*
+         * Returns are predicted to go back to the address pushed by
+         * the matching call.
+         */
+        const uint32_t vpc = m_vaddr[index];
+        uint32_t predicted = UINT32_MAX;
+
+        if (!m_shadow.empty()) {
+            predicted = m_shadow.back();
+            m_shadow.pop_back();
+        }
+
+        return branch(vpc == predicted) && (vpc == predicted || target(vpc));
+    }
+    }
+
+    return true;
+}
+
+bool Trace::indirect(const uint32_t from, const uint32_t vpc) {
+    auto& seen = m_targets.emplace(from, std::make_pair(UINT32_MAX, UINT32_MAX)).first->second;
+
+    if (!branch(vpc == seen.first))
+        return false;
+    if (vpc == seen.first)
+        return true;
+    if (!branch(vpc == seen.second) || (vpc != seen.second && !target(vpc)))
+        return false;
+
+    seen.second = seen.first;
+    seen.first = vpc;
+    return true;
+}
+
+bool Trace::branch(const bool taken) {
+    if (!m_replay) {
+        m_bits = m_bits << 1 | taken;
+        if (++m_nbits == 6)
+            put_byte();
+        return true;
+    }
+
+    if (m_nbits == 0 && !get_byte())
+        return false;
+
+    return ((m_bits >> --m_nbits) & 1) == taken;
+}
+
+void Trace::put_byte(void) {
+    const uint8_t byte = VTRACE_PACKET_BRANCH | m_bits;
+
+    m_bits = 1;
+    m_nbits = 0;
+
+    if (m_copy_length != 0 && history(m_copy_distance) == byte) {
+        m_copy_length++;
+    } else {
+        put_copy();
+
+        /*
+         * Start a copy from the distance whose history best matches 
+         * the bytes before this one.
+         */
+        uint32_t best = 0, best_score = 0;
+
+        for (uint32_t distance = 1; distance <= VM_TRACE_HISTORY && distance <= m_nbytes; distance++) {
+            if (history(distance) != byte)
+                continue;
+
+            uint32_t score = 0;
+
+            while (score < 8 && distance + score + 1 <= m_nbytes && distance + score + 1 <= VM_TRACE_HISTORY &&
+                   history(score + 1) == history(distance + score + 1))
+                score++;
+
+            if (best == 0 || score > best_score) {
+                best = distance;
+                best_score = score;
+            }
+        }
+
+        m_copy_distance = best;
+        m_copy_length = best != 0;
+
+        if (best == 0)
+            m_packets.push_back(byte);
+    }
+
+    m_history[m_nbytes++ % VM_TRACE_HISTORY] = byte;
+}
+
+void Trace::put_copy(void) {
+    if (m_copy_length == 0)
+        return;
+
+    /*
+     * Short copies are larger than the bytes themselves.
+     */
+    if (m_copy_length < 3) {
+        for (uint64_t i = m_copy_length; i > 0; i--)
+            m_packets.push_back(history(i));
+    } else {
+        m_packets.push_back(VTRACE_PACKET_COPY);
+        put_varint(m_packets, m_copy_distance);
+        put_varint(m_packets, m_copy_length);
+    }
+
+    m_copy_length = 0;
+}
+
+bool Trace::get_byte(void) {
+    uint8_t byte;
+
+    if (m_copy_length == 0 && m_pos < m_packets.size() && m_packets[m_pos] == VTRACE_PACKET_COPY) {
+        uint64_t distance;
+
+        m_pos++;
+        if (!get_varint(distance) || !get_varint(m_copy_length) || m_copy_length == 0 ||
+            distance == 0 || distance > VM_TRACE_HISTORY || distance > m_nbytes)
+            return false;
+        m_copy_distance = distance;
+    }
+
+    if (m_copy_length != 0) {
+        byte = history(m_copy_distance);
+        m_copy_length--;
+    } else if (m_pos < m_packets.size() && (m_packets[m_pos] & VTRACE_PACKET_BRANCH)) {
+        byte = m_packets[m_pos++];
+    } else {
+        return false;
+    }
+
+    m_history[m_nbytes++ % VM_TRACE_HISTORY] = byte;
+    m_bits = byte & ~VTRACE_PACKET_BRANCH;
+    m_nbits = m_bits > 1 ? 31 - __builtin_clz(m_bits) : 0;
+    return m_nbits != 0;
+}
+
+bool Trace::packet(const uint8_t type) {
+    if (!m_replay) {
+        if (m_nbits != 0)
+            put_byte();
+        put_copy();
+
+        m_packets.push_back(type);
+        return true;
+    }
+
+    /*
+     * The recorder flushed its bits, so a replay on the same path has
+     * read them all.
+     */
+    if (m_nbits != 0 || m_copy_length != 0 || m_pos >= m_packets.size() || m_packets[m_pos] != type)
+        return false;
+
+    m_pos++;
+    return true;
+}
+
+bool Trace::target(const uint32_t vpc) {
+    if (!packet(VTRACE_PACKET_TARGET))
+        return false;
+
+    const int32_t delta = vpc - m_target;
+
+    if (!m_replay) {
+        put_varint(m_packets, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+        m_target = vpc;
+        return true;
+    }
+
+    uint64_t zigzag;
+
+    if (!get_varint(zigzag))
+        return false;
+
+    m_target += (uint32_t)(zigzag >> 1) ^ -(uint32_t)(zigzag & 1);
+    return m_target == vpc;
+}
+
+bool Trace::key(RC4& rc4) {
+    if (!packet(VTRACE_PACKET_KEY))
+        return false;
+
+    if (!m_replay) {
+        /*
+         * Only the first key length bytes are used by the key schedule.
+         */
+        const std::vector<uint8_t>& key = rc4.key();
+        size_t length = std::min<size_t>(key.size(), 256);
+
+        if (rc4.key_length() > 0)
+            length = std::min<size_t>(length, rc4.key_length());
+
+        put_varint(m_packets, (uint32_t)rc4.key_length());
+        put_varint(m_packets, length);
+        m_packets.insert(m_packets.end(), key.begin(), key.begin() + length);
+        return true;
+    }
+
+    uint64_t key_length, length;
+
+    if (!get_varint(key_length) || !get_varint(length) || length > m_packets.size() - m_pos)
+        return false;
+
+    rc4.set_key((int)key_length, std::vector<uint8_t>(m_packets.begin() + m_pos, m_packets.begin() + m_pos + length));
+    m_pos += length;
+    return true;
+}
+
+bool Trace::end(const uint32_t error, const uint32_t ret) {
+    if (!packet(VTRACE_PACKET_END))
+        return false;
+
+    if (!m_replay) {
+        put_varint(m_packets, error);
+        put_varint(m_packets, ret);
+        put_varint(m_packets, m_count);
+        return true;
+    }
+
+    uint64_t recorded_error, recorded_ret, recorded_count;
+
+    return get_varint(recorded_error) && get_varint(recorded_ret) && get_varint(recorded_count) &&
+        recorded_error == error && recorded_ret == ret && recorded_count == m_count;
+}
+
+#endif // VM_TRACE
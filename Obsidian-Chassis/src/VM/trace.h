@@ -0,0 +1,273 @@
+/*
+ * trace.h
+ *
+ * Execution trace recording and deterministic replay.
+ *
+ * Compile with -DVM_TRACE and attach a Trace with VM::set_trace to
+ * record the following runs. Given the same inputs a run always takes
+ * the same path, so a trace only holds:
+ *
+ *   - the input copied into the data section by start(),
+ *   - the key of every VM_RC4K, which is random for a null key,
+ *   - the control flow: one bit per conditional branch (taken or not),
+ *     one or two bits per indirect jump and JIT block exit that lands on
+ *     one of its last two targets, and one bit per VM_RET that returns
+ *     to the address pushed by its call (kept on a shadow call stack).
+ *     Mispredicted transfers are followed by their target.
+ *   - the error code, return value and instruction count of the run.
+ *
+ * Branch bits are packed six to a byte, and byte sequences that repeat
+ * recent ones, as loops and recursion produce, are stored as a copy of
+ * the earlier bytes. Targets are stored as the varint delta to the
+ * previous target. A run that settles into a loop costs a few bytes
+ * however long it runs.
+ *
+ * VM::replay runs a trace again: keys come from the trace instead of
+ * the RC4 state, VM_CONOUT and VM_PASSTHRU are skipped, and every branch
+ * is checked against the trace. A run that leaves the recorded path
+ * stops with ERR_TRACE_DIVERGED. A Profile attached to the replaying VM
+ * profiles the recorded run offline.
+ *
+ * Not recorded: memory bound with VM::bind (bind the same contents
+ * before replaying), the effects of passthru code on the host, and the
+ * state of a snapshot the run started from.
+ *
+ * While a trace is attached the JIT neither counts nor enters blocks,
+ * every block runs from the cold copy of its leader. The trace skips
+ * the block counters and the jumps that resume a block after its cold
+ * copy, so a trace does not depend on what the JIT has compiled and
+ * warm VMs record traces that replay on fresh ones.
+ *
+ * Saved traces are a vtheader followed by the input and the packets.
+ *
+ * Included by vm.h after the program type.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define VM_TRACE_MAGIC 0x5254424F               // "OBTR"
+#define VM_TRACE_VERSION 2
+
+/*
+ * Maximum depth of the shadow call stack. Deeper returns are stored
+ * with their target.
+ */
+#ifndef VM_TRACE_SHADOW
+#define VM_TRACE_SHADOW 1024
+#endif
+
+/*
+ * Number of branch bytes a copy can reach back.
+ */
+#define VM_TRACE_HISTORY 64
+
+typedef struct _vtheader {
+	uint32_t magic;				// VM_TRACE_MAGIC.
+	uint16_t version;			// VM_TRACE_VERSION.
+	uint16_t flags;				// Reserved, must be 0.
+	uint32_t hash;				// FNV-1a hash of the code section.
+	uint32_t code_size;			// Size of the code section.
+	uint32_t data_size;			// Size of the input.
+	uint32_t packets_size;		// Size of the packets.
+} vtheader;
+
+static_assert(sizeof(vtheader) == 24, "vtheader must match the on-disk layout");
+
+class RC4;
+
+class Trace {
+	private:
+	/*
+	 * Control transfer recorded on the dispatch after an instruction.
+	 */
+	enum {
+		VTRACE_NONE,			// Falls through or jumps to a fixed target.
+		VTRACE_JCC,				// Conditional jump to an immediate.
+		VTRACE_JCC_FUSED,		// Fused compare and conditional jump.
+		VTRACE_JCC_REG,			// Conditional jump to a register.
+		VTRACE_JMP,				// Indirect jump.
+		VTRACE_CALL,			// Call, pushes the shadow stack.
+		VTRACE_RET				// Return, pops the shadow stack.
+	};
+
+	/*
+	 * Transfer kind indexed by opcode.
+	 */
+	static constexpr std::array<uint8_t, 256> make_kinds();
+	static const std::array<uint8_t, 256> s_kinds;
+
+	/*
+	 * Recorded run.
+	 */
+	uint32_t m_hash = 0;
+	uint32_t m_code_size = 0;
+	std::vector<uint8_t> m_data;		// Input.
+	std::vector<uint8_t> m_packets;		// Packet stream.
+
+	/*
+	 * Decoded stream being run.
+	 */
+	const vinsn *m_insns = nullptr;
+	const uint32_t *m_vaddr = nullptr;
+	const uint32_t *m_vindex = nullptr;
+	uint32_t m_cold = 0;			// Decoded index of the first JIT cold copy.
+
+	bool m_replay = false;			// Whether the run is checked against the packets.
+	uint32_t m_last = 0;			// Decoded index of the last dispatch.
+	const vinsn *m_insn = nullptr;	// Last dispatched instruction.
+	uint8_t m_kind = VTRACE_NONE;	// Transfer of the last dispatch.
+	uint64_t m_count = 0;			// Dispatched instructions.
+	uint32_t m_target = 0;			// Last indirect target.
+	std::vector<uint32_t> m_shadow;	// Return addresses of the calls.
+	std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> m_targets;	// Last two targets of each indirect jump.
+
+	/*
+	 * Branch bit packing. m_bits holds the pending bits below a stop
+	 * bit. The last VM_TRACE_HISTORY branch bytes are kept so a byte
+	 * sequence that repeats earlier ones is stored as a copy of
+	 * m_copy_length bytes from m_copy_distance bytes back.
+	 */
+	uint32_t m_bits = 1;
+	uint32_t m_nbits = 0;
+	uint8_t m_history[VM_TRACE_HISTORY];
+	uint64_t m_nbytes = 0;
+	uint32_t m_copy_distance = 0;
+	uint64_t m_copy_length = 0;
+	size_t m_pos = 0;				// Read position of a replay.
+
+	/*
+	 * Reset the run state.
+	 */
+	void begin(const vstream& stream);
+
+	/*
+	 * Record or check the transfer of the last dispatch, which landed
+	 * on the given decoded index.
+	 */
+	bool transfer(const uint32_t index);
+
+	/*
+	 * Record or check a branch bit or an indirect target.
+	 */
+	bool branch(const bool taken);
+	bool target(const uint32_t vpc);
+
+	/*
+	 * Record or check the target of an indirect jump at a decoded index
+	 * as one bit if it is the last target of the jump, two bits if it
+	 * is the one before, or two bits and the target.
+	 */
+	bool indirect(const uint32_t from, const uint32_t vpc);
+
+	/*
+	 * Start a packet other than branch bits. Flushes the pending bits
+	 * when recording and checks they were all read when replaying.
+	 */
+	bool packet(const uint8_t type);
+
+	uint8_t history(const uint32_t distance) const {
+		return m_history[(m_nbytes - distance) % VM_TRACE_HISTORY];
+	}
+
+	void put_byte();
+	void put_copy();
+	bool get_byte();
+	bool get_varint(uint64_t& value);
+
+	public:
+	Trace() = default;
+
+	/*
+	 * Load a saved trace. Throws std::runtime_error if the file cannot
+	 * be read or is not a trace.
+	 */
+	static Trace open(const std::string& path);
+
+	/*
+	 * Save the trace. Throws std::runtime_error on failure.
+	 */
+	void save(const std::string& path) const;
+
+	/*
+	 * Start recording a run with the given input, dropping the
+	 * previous one.
+	 */
+	void record(const vstream& stream, const Program& program, const uint8_t *data, const size_t length);
+
+	/*
+	 * Start replaying the recorded run. Throws std::runtime_error if
+	 * it was recorded from a different program.
+	 */
+	void replay(const vstream& stream, const Program& program);
+
+	/*
+	 * Whether the run is a replay.
+	 */
+	bool replaying() const {
+		return m_replay;
+	}
+
+	/*
+	 * Record the dispatch of the instruction at a decoded index, or
+	 * check it against the trace. Returns false if a replay diverged.
+	 */
+	bool step(const uint32_t index) {
+		/*
+		 * JIT block counters and the jumps back into a block after 
+		 * its cold copy are not part of the program. A cold copy 
+		 * stands for the leader it was copied from.
+		 */
+		if (m_insns[index].opcode == VM_JITBLOCK || (index >= m_cold && (index - m_cold) % 2))
+			return true;
+
+		const uint32_t original = index < m_cold ? index : m_vindex[m_vaddr[index]];
+		const bool ok = m_kind == VTRACE_NONE || transfer(original);
+
+		m_count++;
+		m_last = original;
+		m_insn = &m_insns[index];
+		m_kind = s_kinds[m_insn->opcode];
+		return ok;
+	}
+
+	/*
+	 * Record the key just set by VM_RC4K, or set the recorded key.
+	 * Returns false if a replay diverged.
+	 */
+	bool key(RC4& rc4);
+
+	/*
+	 * Record the end of the run, or check it against the trace.
+	 * Returns false if a replay diverged.
+	 */
+	bool end(const uint32_t error, const uint32_t ret);
+
+	/*
+	 * Input of the recorded run.
+	 */
+	const std::vector<uint8_t>& data() const {
+		return m_data;
+	}
+
+	/*
+	 * Returns the size of the packet stream in bytes.
+	 */
+	size_t size() const {
+		return m_packets.size();
+	}
+
+	/*
+	 * Returns the number of instructions dispatched by the last run.
+	 */
+	uint64_t count() const {
+		return m_count;
+	}
+};
+
+#endif // !__TRACE_H__
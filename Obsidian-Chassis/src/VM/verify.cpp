@@ -0,0 +1,418 @@
+#include <algorithm>
+#include <map>
+
+#include "decode.h"
+#include "err.h"
+#include "opcodes.h"
+#include "vm.h"
+
+/*
+ * Register file an operand byte selects.
+ */
+enum {
+    OPD_NONE,               // Not a register (immediate or 8-bit address).
+    OPD_REG,                // General purpose register.
+    OPD_VEC                 // Vector register.
+};
+
+/*
+ * Kinds of the ra, rb and rc operands and of the fourth register operand
+ * held in imm.
+ */
+static void operands(const OPCODE opcode, int kinds[4]) {
+    kinds[0] = kinds[1] = kinds[2] = kinds[3] = OPD_NONE;
+
+    switch (opcode) {
+        case VM_INC:
+        case VM_DEC:
+        case VM_NEG:
+        case VM_NOT:
+        case VM_PUSH:
+        case VM_POP:
+        case VM_MOVI:
+        case VM_ADDI:
+        case VM_SUBI:
+        case VM_CMP:
+        case VM_XORI:
+        case VM_AESK:
+        case VM_LOADBI:
+        case VM_LOADWI:
+        case VM_LOADDI:
+            kinds[0] = OPD_REG;
+            break;
+
+        case VM_STORB:
+        case VM_STORW:
+        case VM_STORD:
+            kinds[1] = OPD_REG;
+            break;
+
+        case VM_MOV:
+        case VM_ADD:
+        case VM_SUB:
+        case VM_ADC:
+        case VM_SBB:
+        case VM_LEA:
+        case VM_OR:
+        case VM_AND:
+        case VM_NOR:
+        case VM_XOR:
+        case VM_TEST:
+        case VM_SHR:
+        case VM_SHL:
+        case VM_SAR:
+        case VM_SAL:
+        case VM_DIV:
+        case VM_IDIV:
+        case VM_MUL:
+        case VM_IMUL:
+        case VM_MOD:
+        case VM_XCHG:
+        case VM_LOADB:
+        case VM_LOADW:
+        case VM_LOADD:
+            kinds[0] = kinds[1] = OPD_REG;
+            break;
+
+        case VM_VLOAD:
+        case VM_VBCASTD:
+            kinds[0] = OPD_VEC;
+            kinds[1] = OPD_REG;
+            break;
+
+        case VM_VSTORE:
+        case VM_VEXTRD:
+        case VM_VHADDB:
+        case VM_VHADDD:
+        case VM_VHXORD:
+            kinds[0] = OPD_REG;
+            kinds[1] = OPD_VEC;
+            break;
+
+        case VM_VMOV:
+        case VM_VXOR:
+        case VM_VAND:
+        case VM_VOR:
+        case VM_VADDB:
+        case VM_VADDW:
+        case VM_VADDD:
+        case VM_VSUBB:
+        case VM_VSUBW:
+        case VM_VSUBD:
+        case VM_VSHUFD:
+            kinds[0] = kinds[1] = OPD_VEC;
+            break;
+
+        case VM_VSHLD:
+        case VM_VSHRD:
+            kinds[0] = OPD_VEC;
+            break;
+
+        case VM_MEMCPY:
+        case VM_MEMSET:
+        case VM_AESE:
+        case VM_AESD:
+        case VM_CRC32C:
+        case VM_SHA256:
+        case VM_RC4M:
+            kinds[0] = kinds[1] = kinds[2] = OPD_REG;
+            break;
+
+        case VM_MEMCMP:
+        case VM_MEMCHR:
+        case VM_AESCTR:
+            kinds[0] = kinds[1] = kinds[2] = kinds[3] = OPD_REG;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Returns whether an operand byte names a register of its kind.
+ */
+static bool valid(const int kind, const uint32_t operand) {
+    switch (kind) {
+        case OPD_REG:
+            return operand < NUM_REGISTERS;
+
+        case OPD_VEC:
+            return operand < NUM_VECTORS;
+
+        default:
+            return true;
+    }
+}
+
+/*
+ * Returns whether the opcode always panics (see handlers.inc).
+ */
+static bool unimplemented(const OPCODE opcode) {
+    switch (opcode) {
+        case VM_SBB:
+        case VM_SAR:
+        case VM_SAL:
+        case VM_MOD:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Check a single instruction. Returns the error code or 0.
+ */
+static uint32_t check(const vinsn& insn, const uint32_t end) {
+    if (insn.opcode == VM_FAULT)
+        return insn.imm;
+    if (unimplemented(insn.opcode))
+        return ERR_OPCODE_UNIMPLEMENTED;
+
+    int kinds[4];
+    const uint32_t regs[4] = { insn.ra, insn.rb, insn.rc, insn.imm };
+
+    operands(insn.opcode, kinds);
+    for (int i = 0; i < 4; i++)
+        if (!valid(kinds[i], regs[i]))
+            return ERR_REGISTER_INVALID;
+
+    /*
+     * Immediate targets were resolved to the sentinels if they miss an
+     * instruction (see decode_stream).
+     */
+    if (insn_has_target(insn)) {
+        if (insn.target == end)
+            return ERR_CODE_OUT_OF_BOUNDS;
+        if (insn.target > end)
+            return ERR_CODE_MISALIGNED;
+    }
+
+    if (insn.opcode == VM_JMP || (insn_is_jcc(insn.opcode) && !insn_has_target(insn)))
+        return ERR_CODE_INDIRECT;
+
+    /*
+     * Data ranges given by immediates.
+     */
+    if (insn.opcode == VM_RC4K && (uint64_t)insn.ra + insn.imm > VM_DATA_LIMIT)
+        return ERR_DATA_OUT_OF_BOUNDS;
+    if (insn.opcode == VM_RC4C && (uint64_t)std::max({ insn.ra, insn.rb, insn.rc }) + insn.imm > VM_DATA_LIMIT)
+        return ERR_DATA_OUT_OF_BOUNDS;
+
+    return 0;
+}
+
+/*
+ * Depth of an instruction not reached yet.
+ */
+#define DEPTH_NONE UINT32_MAX
+
+/*
+ * Stack use of one function, relative to its entry.
+ */
+typedef struct _vframe {
+    uint32_t depth;                                     // Deepest push.
+    std::vector<std::pair<uint32_t, uint32_t>> calls;   // Callee index and depth at the call.
+} vframe;
+
+/*
+ * Walks the instructions of the function at entry and records its
+ * stack use. The entry point of the program is not called, so returns
+ * from it underflow. depth is scratch space with one DEPTH_NONE entry
+ * per instruction and is left that way.
+ */
+static bool walk(const vstream& stream, const uint32_t entry, const bool called, std::vector<uint32_t>& depth, vframe& frame, vverify& result) {
+    const uint32_t end = stream.insns.size() - 2;
+    std::vector<uint32_t> work, seen;
+    uint32_t error = 0, at = 0;
+
+    /*
+     * Continue at index next with stack depth d.
+     */
+    auto reach = [&](const uint32_t from, const uint32_t next, const uint32_t d) {
+        if (error != 0)
+            return;
+
+        if (next >= end) {
+            error = ERR_CODE_OUT_OF_BOUNDS;
+            at = from;
+        } else if (depth[next] == DEPTH_NONE) {
+            depth[next] = d;
+            seen.push_back(next);
+            work.push_back(next);
+        } else if (depth[next] != d) {
+            error = ERR_STACK_UNBALANCED;
+            at = next;
+        }
+    };
+
+    frame.depth = 0;
+    frame.calls.clear();
+    reach(entry, entry, 0);
+
+    while (!work.empty() && error == 0) {
+        const uint32_t i = work.back();
+        const vinsn& insn = stream.insns[i];
+        const uint32_t d = depth[i];
+
+        work.pop_back();
+
+        switch (insn.opcode) {
+            case VM_HLT:
+                break;
+
+            case VM_PUSH:
+            case VM_PUSHI:
+                frame.depth = std::max(frame.depth, d + 1);
+                reach(i, i + 1, d + 1);
+                break;
+
+            case VM_PUSHAD:
+                frame.depth = std::max(frame.depth, d + NUM_REGISTERS);
+                reach(i, i + 1, d + NUM_REGISTERS);
+                break;
+
+            case VM_POP:
+            case VM_POPAD: {
+                const uint32_t slots = insn.opcode == VM_POP ? 1 : NUM_REGISTERS;
+
+                if (d < slots) {
+                    error = ERR_STACK_UNDERFLOW;
+                    at = i;
+                } else {
+                    reach(i, i + 1, d - slots);
+                }
+                break;
+            }
+
+            case VM_CALL:
+            case VM_RCALL:
+                /*
+                 * The callee returns at the depth it was entered with.
+                 */
+                frame.calls.emplace_back(insn.target, d);
+                reach(i, i + 1, d);
+                break;
+
+            case VM_RET:
+                if (!called) {
+                    error = ERR_STACK_UNDERFLOW;
+                    at = i;
+                } else if (d != 0) {
+                    error = ERR_STACK_UNBALANCED;
+                    at = i;
+                }
+                break;
+
+            case VM_JMPI:
+                reach(i, insn.target, d);
+                break;
+
+            default:
+                if (insn_has_target(insn))
+                    reach(i, insn.target, d);
+                reach(i, i + 1, d);
+                break;
+        }
+    }
+
+    for (const uint32_t i : seen)
+        depth[i] = DEPTH_NONE;
+
+    if (error != 0) {
+        result.error = error;
+        result.vpc = stream.vaddr[at];
+        return false;
+    }
+
+    return true;
+}
+
+static uint32_t bound(const uint32_t entry, const std::map<uint32_t, vframe>& frames, std::map<uint32_t, uint32_t>& bounds, std::map<uint32_t, bool>& active);
+
+/*
+ * Maximum depth of a function and everything it calls, relative to its
+ * entry. VM_STACK_UNBOUNDED on recursion.
+ */
+static uint32_t deepest(const vframe& frame, const std::map<uint32_t, vframe>& frames, std::map<uint32_t, uint32_t>& bounds, std::map<uint32_t, bool>& active) {
+    uint64_t depth = frame.depth;
+
+    for (const auto& call : frame.calls) {
+        const uint32_t callee = bound(call.first, frames, bounds, active);
+
+        if (callee == VM_STACK_UNBOUNDED)
+            return VM_STACK_UNBOUNDED;
+
+        /*
+         * The return address sits between the caller and the callee.
+         */
+        depth = std::max(depth, (uint64_t)call.second + 1 + callee);
+    }
+
+    return depth < VM_STACK_UNBOUNDED ? (uint32_t)depth : VM_STACK_UNBOUNDED;
+}
+
+/*
+ * Memoised deepest() of the function at entry. active marks the
+ * functions on the current call path, reaching one again is recursion.
+ */
+static uint32_t bound(const uint32_t entry, const std::map<uint32_t, vframe>& frames, std::map<uint32_t, uint32_t>& bounds, std::map<uint32_t, bool>& active) {
+    const auto known = bounds.find(entry);
+
+    if (known != bounds.end())
+        return known->second;
+    if (active[entry])
+        return VM_STACK_UNBOUNDED;
+
+    active[entry] = true;
+    const uint32_t depth = deepest(frames.at(entry), frames, bounds, active);
+    active[entry] = false;
+
+    return bounds[entry] = depth;
+}
+
+bool verify_stream(const vstream& stream, vverify& result) {
+    const uint32_t end = stream.insns.size() - 2;
+
+    result = vverify();
+
+    /*
+     * Every instruction on its own, reachable or not.
+     */
+    for (uint32_t i = 0; i < end; i++) {
+        if (const uint32_t error = check(stream.insns[i], end)) {
+            result.error = error;
+            result.vpc = stream.vaddr[i];
+            return false;
+        }
+    }
+
+    /*
+     * Stack use of the entry point and every called function.
+     */
+    std::vector<uint32_t> depth(end, DEPTH_NONE);
+    std::map<uint32_t, vframe> frames;
+    vframe start;
+
+    if (!walk(stream, 0, false, depth, start, result))
+        return false;
+
+    for (uint32_t i = 0; i < end; i++) {
+        const vinsn& insn = stream.insns[i];
+
+        if ((insn.opcode == VM_CALL || insn.opcode == VM_RCALL) && frames.count(insn.target) == 0) {
+            if (!walk(stream, insn.target, true, depth, frames[insn.target], result))
+                return false;
+        }
+    }
+
+    /*
+     * Maximum depth over the call graph.
+     */
+    std::map<uint32_t, uint32_t> bounds;
+    std::map<uint32_t, bool> active;
+
+    result.stack = deepest(start, frames, bounds, active);
+    return true;
+}
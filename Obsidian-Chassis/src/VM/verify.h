@@ -0,0 +1,56 @@
+/*
+ * verify.h
+ *
+ * Load-time verifier for code sections.
+ *
+ * Walks the decoded stream of a program once and checks that
+ *   - every instruction is a known, implemented opcode of valid length,
+ *   - register operands are below NUM_REGISTERS (NUM_VECTORS for vector
+ *     registers),
+ *   - immediate branch and call targets start an instruction,
+ *   - immediate data ranges (the VM_RC4K key, the VM_RC4C input, output
+ *     and keystream) end within VM_DATA_LIMIT,
+ *   - no path runs off the end of the code section,
+ *   - the stack never underflows and its maximum depth is bounded.
+ *
+ * Stack depths are tracked per function (the entry point and every call
+ * target) relative to its entry. Every instruction of a function must be
+ * reached at the same depth on all paths, pops may only take slots the
+ * function pushed itself and VM_RET is only allowed at depth 0 of a
+ * called function, so it always pops the return address of its call.
+ * The maximum depth is bounded unless the call graph is recursive.
+ *
+ * Register jumps (VM_JMP and the register forms of the conditional
+ * jumps) have no static target, so programs using them do not verify.
+ *
+ * Builds with VM_VERIFIED drop the handler checks the verifier proves
+ * redundant (see VM_CHECK) and only run programs that verified with a
+ * maximum depth that fits their stack.
+ *
+ * Included by vm.h after the decoded stream types.
+ */
+
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+/*
+ * Maximum stack depth of a program with recursive calls.
+ */
+#define VM_STACK_UNBOUNDED UINT32_MAX
+
+/*
+ * Outcome of verifying a program.
+ */
+typedef struct _vverify {
+	uint32_t error;				// First failed check (ERR_*) or 0 if the program verified.
+	uint32_t vpc;				// Code offset of the offending instruction.
+	uint32_t stack;				// Maximum stack depth in 32-bit slots.
+} vverify;
+
+/*
+ * Verify a decoded code section without fusion. Returns false and the
+ * first failed check in result if the program does not verify.
+ */
+bool verify_stream(const vstream& stream, vverify& result);
+
+#endif // !__VERIFY_H__
@@ -4,6 +4,11 @@
 #include <climits>
 #include <iostream>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decode.h"
 #include "err.h"
 #include "opcodes.h"
 #include "rc4.h"
@@ -16,11 +21,19 @@ void VM::panic(const uint32_t code) {
      * This could be OS-specific.
      */
 
+    /*
+     * Map the decoded instruction back to its code offset.
+     */
+    m_vpc = vpc();
+
 #ifdef DEBUG
-    std::cerr << "[-] Error (0x" << std::hex << code << std::dec << "): " << strerr(code) << ".\n";
+    std::cerr << "[-] Error (0x" << std::hex << code << ") at 0x" << m_vpc << std::dec << ": " << strerr(code) << ".\n";
 #endif
 
-    exit(code);
+    /*
+     * Unwind to the loop, which decides whether to exit.
+     */
+    siglongjmp(*m_vfault, code);
 }
 
 void VM::panic(const uint32_t code, const std::string& msg) {
@@ -46,6 +59,10 @@ void VM::initialise(void) {
         m_vreg[i] = 0;
         m_vctx.vreg[i] = 0;
     }
+    for (int i = 0; i < NUM_VECTORS; i++) {
+        m_vvec[i] = VEC();
+        m_vctx.vvec[i] = VEC();
+    }
 
     /*
      * Point program counter to beginning of code section  
@@ -63,8 +80,8 @@ void VM::initialise(void) {
     /*
      * Zero EFLAGS registers.
      */
-    m_veflags = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    m_vctx.veflags = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    m_vflags.clear();
+    m_vctx.veflags.clear();
 
     /*
      * Clear code section.
@@ -72,423 +89,234 @@ void VM::initialise(void) {
     //m_vcode.clear();
 
     /*
-     * Clear global data section.
+     * Drop any snapshot and clear global data section. More pages are 
+     * committed on demand up to VM_DATA_LIMIT.
      */
-    m_vdata.clear();
-    // TODO: fix size value to be dynamic?
-    m_vdata.resize(DATA_SECTION_SIZE);
+    m_vsnapshot = false;
+    m_vdata.reset(DATA_SECTION_SIZE);
 
     /*
-     * Clear stack section.
+     * Allocate the stack section. Only reallocates when the capacity 
+     * changed, stale values above m_vsp are never read.
      */
-    m_vstack.clear();
-    m_vstack.resize(0);
+    if (m_vstack.size() != m_vstack_size) {
+        m_vstack.assign(m_vstack_size, 0);
+        m_vstack.shrink_to_fit();
+    }
+}
+
+VM::VM() : VM(Program::builtin()) {}
+
+VM::VM(std::shared_ptr<const Program> program) {
+    load(std::move(program));
+}
+
+void VM::load(std::shared_ptr<const Program> program) {
+    m_vprogram = std::move(program);
+    m_vcode = m_vprogram->code();
+    m_vstream.insns.clear();
+    m_vip = nullptr;
+    discard();
 }
 
-OPCODE VM::fetch(void) {
+void VM::load(const std::string& path) {
+    load(Program::open(path));
+}
+
+bool VM::bind(const REG addr, const void *buffer, const size_t length) {
+    return m_vdata.bind(addr, (uint8_t *)buffer, length, false);
+}
+
+bool VM::bind(const REG addr, void *buffer, const size_t length, const bool writable) {
+    return m_vdata.bind(addr, (uint8_t *)buffer, length, writable);
+}
+
+bool VM::bind(const REG addr, const std::string& path, const bool writable) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
     /*
-     * Check that the program counter does not exceed the size of the 
-     * code section. If exceeded, throw an exception!
+     * The mapping keeps the file referenced after the descriptor is 
+     * closed.
      */
-    if (m_vpc > m_vsize)
-        panic(ERR_CODE_OUT_OF_BOUNDS);
+    struct stat st;
+    const bool bound = fstat(fd, &st) == 0 && m_vdata.bind(addr, fd, st.st_size, writable);
 
-#ifdef DEBUG
-    std::cout << "[*] Executing opcode: 0x" << std::hex << (int)m_vcode[m_vpc] << std::dec << "\n";
+    close(fd);
+    return bound;
+}
+
+void VM::unbind(const REG addr) {
+    m_vdata.unbind(addr);
+}
+
+void VM::unbind(void) {
+    m_vdata.unbind();
+}
+
+void VM::set_exit_on_panic(const bool exit) {
+    m_vexit = exit;
+}
+
+void VM::decode(void) {
+    /*
+     * The program never changes so its stream only needs copying 
+     * once. The copy is ours to fuse, bind and JIT.
+     */
+    if (!m_vstream.insns.empty())
+        return;
+
+    m_vstream = m_vprogram->stream();
+
+#ifdef VM_FUSE_STATS
+    fuse_stats(m_vstream, 2, 16, std::cerr);
+    fuse_stats(m_vstream, 3, 16, std::cerr);
+#endif
+
+#ifdef VM_JIT
+    m_jit.attach(m_vstream);
 #endif
 
     /*
-     * Return the instruction in the code section pointed to by the 
-     * program counter.
+     * Fuse after the JIT has installed its block leaders so fused 
+     * sequences never span into another block.
      */
-    return m_vcode[m_vpc];
+    fuse_stream(m_vstream, m_vfusions);
+
+    m_vinsns = m_vstream.insns.data();
+    m_vbound = false;
+
+#if VM_DISPATCH == VM_DISPATCH_TAILCALL
+    for (auto& insn : m_vstream.insns)
+        insn.handler = s_handlers[insn.opcode];
+    m_vbound = true;
+#endif
 }
 
-bool VM::execute(const OPCODE opcode) {
-    static RC4 r;
+void VM::set_fusions(const std::vector<vfusion>& fusions) {
+    m_vfusions = fusions;
+}
 
-    switch (opcode) {
-        case VM_MOV:
-            m_vreg[m_vcode[m_vpc + 1]] = m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_MOVI:
-            //memcpy(&m_vreg[m_vcode[m_vpc + 1]], &m_vcode[m_vpc + 2], 4);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM32 *)&m_vcode[m_vpc + 2];
-            m_vpc += 6; 
-            break;
-
-        case VM_ADD:
-            //m_vreg[m_vcode[m_vpc + 1]] += m_vreg[m_vcode[m_vpc + 2]];
-            m_vreg[m_vcode[m_vpc + 1]] = ADD(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_ADDI:
-            // TODO: check if correct
-            //m_vreg[m_vcode[m_vpc + 1]] += *(int32_t *)&m_vcode[m_vpc + 2];
-            m_vreg[m_vcode[m_vpc + 1]] = ADD(m_vreg[m_vcode[m_vpc + 1]], *(IMM32 *)&m_vcode[m_vpc + 2]);
-            m_vpc += 6;
-            break;
-
-        case VM_SUB:
-            // TODO: carry flag
-            m_vreg[m_vcode[m_vpc + 1]] -= m_vreg[m_vcode[m_vpc + 2]];
-            m_veflags.sign = (int32_t)m_vreg[m_vcode[m_vpc + 1]] >= 0 ? 0 : 1;               // If result >= 0, unset sign flag (positive), else set sign flag.
-            m_veflags.zero = m_vreg[m_vcode[m_vpc + 1]] ? 0 : 1;                    // If result == 0, set zero flag.
-            m_vpc += 3;
-            break;
-
-        case VM_SUBI:
-            // TODO: check if correct; carry flag
-            m_vreg[m_vcode[m_vpc + 1]] -= *(IMM32 *)&m_vcode[m_vpc + 2];
-            m_veflags.sign = (int32_t)m_vreg[m_vcode[m_vpc + 1]] >= 0 ? 0 : 1;               // If result >= 0, unset sign flag (positive), else set sign flag.
-            m_veflags.zero = m_vreg[m_vcode[m_vpc + 1]] ? 0 : 1;                    // If result == 0, set zero flag.
-            m_vpc += 6;
-            break;
-
-        case VM_ADC:
-            m_vreg[m_vcode[m_vpc + 1]] = ADC(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_SBB:
-            // TODO
-            panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_INC:
-            m_vreg[m_vcode[m_vpc + 1]] += 1;
-            m_vpc += 2;
-            break;
-
-        case VM_DEC:
-            m_vreg[m_vcode[m_vpc + 1]] -= 1;
-            m_vpc += 2;
-            break;
-
-        case VM_CMP:
-            /*
-             * If equal, set EFLAGS zero flag to 1.
-             * Else, set EFLAGS zero flag to 0.
-             */
-            m_veflags.zero = m_vreg[m_vcode[m_vpc + 1]] - *(IMM32 *)&m_vcode[m_vpc + 2] ?  0 : 1;           // Modify zero flag.
-            m_veflags.sign = m_vreg[m_vcode[m_vpc + 1]] >= *(IMM32 *)&m_vcode[m_vpc + 2] ?  0 : 1;          // Modify sign flag.
-            m_vpc += 6;
-            break;
-
-        case VM_LEA:
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM32 *)&m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            // TODO
-            //panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_NEG:
-            m_vreg[m_vcode[m_vpc + 1]] = NEG(m_vreg[m_vcode[m_vpc + 1]]);
-            m_vpc += 2;
-            break;
-
-        case VM_OR:
-            m_vreg[m_vcode[m_vpc + 1]] = OR(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_AND:
-            m_vreg[m_vcode[m_vpc + 1]] = AND(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_NOT:
-            m_vreg[m_vcode[m_vpc + 1]] = NOT(m_vreg[m_vcode[m_vpc + 1]]);
-            m_vpc += 2;
-            break;
-
-        case VM_NOR:
-            m_vreg[m_vcode[m_vpc + 1]] = NOR(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_XOR:
-            m_vreg[m_vcode[m_vpc + 1]] = XOR(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_XORI:
-            m_vreg[m_vcode[m_vpc + 1]] = XOR(m_vreg[m_vcode[m_vpc + 1]], *(IMM32 *)&m_vcode[m_vpc + 2]);
-            m_vpc += 6;
-            break;
-
-        case VM_TEST:
-            m_veflags.zero = AND(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]) ? 0 : 1;
-            m_vpc += 3;
-            break;
-
-        case VM_SHR:
-            m_vreg[m_vcode[m_vpc + 1]] >>= m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_SHL:
-            m_vreg[m_vcode[m_vpc + 1]] <<= m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_SAR:
-            // TODO
-            panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_SAL:
-            // TODO
-            panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_PUSH:
-            m_vstack.push_back(m_vreg[m_vcode[m_vpc + 1]]);                         // Add value to stack.
-            m_vsp++;                                                                // Increment stack pointer.
-            m_vpc += 2;
-            break;
-
-        case VM_PUSHI:
-            m_vstack.push_back(*(IMM32 *)&m_vcode[m_vpc + 1]);                      // Add value to stack.
-            m_vsp++;                                                                // Increment stack pointer.
-            m_vpc += 5;
-            break;
-
-        case VM_POP:
-            if (m_vsp == 0 || m_vstack.empty())                                     // Check stack pointer or size.
-                panic(ERR_STACK_UNDERFLOW);                                         // Panic on attempt to pop from invalid position.
-            else if (m_vsp > m_vstack.size())
-                panic(ERR_STACK_OVERFLOW);
-            m_vreg[m_vcode[m_vpc + 1]] = m_vstack[m_vsp - 1];                       // Obtain value.
-            //m_vstack.pop_back();                                                  // Don't actually remove value from stack.
-            m_vsp--;                                                                // Decrement stack pointer.
-            m_vpc += 2;
-            break;
-
-        case VM_PUSHAD:
-            // TODO
-            panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_POPAD:
-            // TODO
-            if (m_vsp == 0 || m_vstack.empty())                                     // Check stack pointer or size.
-                panic(ERR_STACK_UNDERFLOW);                                         // Panic on attempt to pop from invalid position.
-            panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_JMP:
-            m_vpc += 2;
-            m_vpc = m_vreg[m_vcode[m_vpc - 1]];
-            break;
-
-        case VM_JMPI:
-            m_vpc += 5;
-            m_vpc = *(IMM32 *)&m_vcode[m_vpc - 4];
-            break;
-
-        case VM_JE:
-            m_vpc += 2;
-            m_vpc = m_veflags.zero ? m_vreg[m_vcode[m_vpc - 1]] : m_vpc;
-            break;
-
-        case VM_JEI:
-            m_vpc += 5;
-            m_vpc = m_veflags.zero ? *(IMM32 *)&m_vcode[m_vpc - 4] : m_vpc;
-            break;
-
-        case VM_JNE:
-            m_vpc += 2;
-            m_vpc = m_veflags.zero ? m_vpc : m_vreg[m_vcode[m_vpc - 1]];
-            break;
-
-        case VM_JNEI:
-            m_vpc += 5;
-            m_vpc = m_veflags.zero ? m_vpc : *(IMM32 *)&m_vcode[m_vpc - 4];
-            break;
-
-        case VM_DIV:
-            m_vreg[m_vcode[m_vpc + 1]] /= m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_IDIV:
-            m_vreg[m_vcode[m_vpc + 1]] /= (IMM32)m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_MUL:
-            m_vreg[m_vcode[m_vpc + 1]] *= m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_IMUL:
-            m_vreg[m_vcode[m_vpc + 1]] *= (IMM32)m_vreg[m_vcode[m_vpc + 2]];      
-            m_vpc += 3;
-            break;
-
-        case VM_MOD:
-            // TODO
-            panic(ERR_OPCODE_UNIMPLEMENTED);
-            break;
-
-        case VM_CALL:
-            m_vpc += 5;                                                             // Point pc to next instruction after return.
-            m_vstack.push_back(m_vpc);                                              // Save pc onto stack for return.
-            m_vsp++;                                                                // Increment stack pointer.
-            m_vpc = *(IMM32 *)&m_vcode[m_vpc - 4];                                  // Set pc to the start routine (absolute).
-            break;
-
-        case VM_RCALL:
-            m_vpc += 5;                                                             // Point pc to next instruction after return.
-            m_vstack.push_back(m_vpc);                                              // Save pc onto stack for return.
-            m_vsp++;                                                                // Increment stack pointer.
-            m_vpc += *(IMM32 *)&m_vcode[m_vpc - 4];                                 // Set pc to the start routine (relative).
-            break;
-
-        case VM_RET:
-            m_vpc = m_vstack[m_vsp - 1];                                            // Retrieve saved pc value.
-            //m_vstack.pop_back();                                                  // Don't actually remove value from stack.
-            m_vsp--;                                                                // Decrement stack pointer.
-            break;
-        
-        case VM_XCHG:
-            m_vreg[m_vcode[m_vpc + 1]] = XOR(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);               // XOR swap.
-            m_vreg[m_vcode[m_vpc + 2]] = XOR(m_vreg[m_vcode[m_vpc + 2]], m_vreg[m_vcode[m_vpc + 1]]);
-            m_vreg[m_vcode[m_vpc + 1]] = XOR(m_vreg[m_vcode[m_vpc + 1]], m_vreg[m_vcode[m_vpc + 2]]);
-            m_vpc += 3;
-            break;
-
-        case VM_LOADB:
-            if (m_vcode[m_vpc + 2] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM8 *)&m_vdata[m_vreg[m_vcode[m_vpc + 2]]];
-            m_vpc += 3;
-            break;
-
-        case VM_LOADBI:
-            if (m_vcode[m_vpc + 2] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM8 *)&m_vdata[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_LOADW:
-            if (m_vcode[m_vpc + 2] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM16 *)&m_vdata[m_vreg[m_vcode[m_vpc + 2]]];
-            m_vpc += 3;
-            break;
-
-        case VM_LOADWI:
-            if (m_vcode[m_vpc + 2] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM16 *)&m_vdata[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_LOADD:
-            if (m_vcode[m_vpc + 2] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM32 *)&m_vdata[m_vreg[m_vcode[m_vpc + 2]]];
-            m_vpc += 3;
-            break;
-
-        case VM_LOADDI:
-            if (m_vcode[m_vpc + 2] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            m_vreg[m_vcode[m_vpc + 1]] = *(IMM32 *)&m_vdata[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_STORB:
-            if (m_vcode[m_vpc + 1] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            *(IMM8 *)&m_vdata[m_vcode[m_vpc + 1]] = (IMM8)m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-        
-        case VM_STORBI:
-            if (m_vcode[m_vpc + 1] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            *(IMM8 *)&m_vdata[m_vcode[m_vpc + 1]] = *(IMM8 *)&m_vcode[m_vpc + 2];
-            m_vpc += 3;
-            break;
-
-        case VM_STORW:
-            if (m_vcode[m_vpc + 1] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            *(IMM16 *)&m_vdata[m_vcode[m_vpc + 1]] = (IMM16)m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_STORWI:
-            if (m_vcode[m_vpc + 1] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            *(IMM16 *)&m_vdata[m_vcode[m_vpc + 1]] = *(IMM16 *)&m_vcode[m_vpc + 2];
-            m_vpc += 4;
-            break;
-
-        case VM_STORD:
-            if (m_vcode[m_vpc + 1] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            *(IMM32 *)&m_vdata[m_vcode[m_vpc + 1]] = (IMM32)m_vreg[m_vcode[m_vpc + 2]];
-            m_vpc += 3;
-            break;
-
-        case VM_STORDI:
-            if (m_vcode[m_vpc + 1] > m_vdata.size() - 1)                            // Check memory access location.
-                panic(ERR_DATA_OUT_OF_BOUNDS);
-            *(IMM32 *)&m_vdata[m_vcode[m_vpc + 1]] = *(IMM32 *)&m_vcode[m_vpc + 2];
-            m_vpc += 6;
-            break;
-
-        case VM_HLT:
+#ifdef VM_PROFILE
+void VM::set_profile(Profile *profile) {
+    m_vprofile = profile;
+}
+#endif
+
+#ifdef VM_SAMPLE
+void VM::sample(vsample& sample) const {
+    sample.program = m_vprogram.get();
+    sample.pc = m_vstream.vaddr[m_vip - m_vinsns];
+    sample.depth = 0;
+
+    /*
+     * Take the innermost return addresses, then put them outermost 
+     * first.
+     */
+    for (REG i = m_vsp; i-- > 0 && sample.depth < VM_SAMPLE_DEPTH;) {
+        uint32_t callee;
+
+        if (m_vprogram->callee(m_vstack[i], callee))
+            sample.frames[sample.depth++] = callee;
+    }
+
+    for (uint32_t i = 0; i < sample.depth / 2; i++) {
+        const uint32_t frame = sample.frames[i];
+
+        sample.frames[i] = sample.frames[sample.depth - 1 - i];
+        sample.frames[sample.depth - 1 - i] = frame;
+    }
+}
+#endif
+
+#ifdef VM_TRACE
+void VM::set_trace(Trace *trace) {
+    m_vtrace = trace;
+}
+
+uint32_t VM::replay(Trace& trace) {
+    Trace *recording = m_vtrace;
+    const bool exit = m_vexit;
+
+    reset();
+    trace.replay(m_vstream, *m_vprogram);
+    m_vdata.write(0, trace.data().data(), trace.data().size());
+
+    /*
+     * Divergence is reported through error() like any panic.
+     */
+    m_vtrace = &trace;
+    m_vexit = false;
+
+#ifdef VM_PROFILE
+    if (m_vprofile)
+        m_vprofile->begin(m_vstream, m_vprogram);
+#endif
+
+    loop(VM_BUDGET_UNLIMITED);
+
+    const uint32_t ret = m_vreg[0];
+
+    m_vtrace = recording;
+    m_vexit = exit;
+    return ret;
+}
+#endif
+
+void VM::set_stack_size(const uint32_t size) {
+    m_vstack_size = size;
+}
+
+const vinsn *VM::fetch(void) {
+    /*
+     * No bounds check is needed. Running off the end of the code 
+     * section lands on a VM_FAULT sentinel in the decoded stream.
+     */
 
 #ifdef DEBUG
-            std::cout << "[*] Halting VM...\n";
+    std::cout << "[*] Executing opcode: 0x" << std::hex << (int)m_vip->opcode << " at 0x" << vpc() << std::dec << "\n";
+#endif
+
+#ifdef VM_PROFILE
+    if (m_vprofile)
+        m_vprofile->step(m_vip - m_vinsns, m_vip->opcode);
+#endif
+
+#ifdef VM_TRACE
+    if (m_vtrace && !m_vtrace->step(m_vip - m_vinsns))
+        panic(ERR_TRACE_DIVERGED);
+#endif
+
+#ifdef VM_SAMPLE
+    /*
+     * Keep m_vip and the stack in memory for the sampling handler.
+     */
+    std::atomic_signal_fence(std::memory_order_seq_cst);
 #endif
 
-            return false;
-
-        case VM_RC4K:
-            r.set_for_cipher(*(IMM32 *)&m_vcode[m_vpc + 2], (uint8_t *)&m_vdata[m_vcode[m_vpc + 1]]);
-            m_vpc += 6;
-            break;
-
-        case VM_RC4C:
-            r.cipher((uint8_t *)&m_vdata[m_vcode[m_vpc + 1]], *(IMM32 *)&m_vcode[m_vpc + 3], (uint8_t *)&m_vdata[m_vcode[m_vpc + 2]], (uint8_t *)&m_vdata[m_vcode[m_vpc + 7]]);
-            m_vpc += 8;
-            break;
-
-        case VM_CONOUT:
-            std::cout << (char *)&m_vdata[m_vcode[m_vpc + 1]];
-            m_vpc += 2;
-            break;
-
-        case VM_NOP:
-            m_vpc++;
-            break;
-
-        case VM_PASSTHRU:
-            /*
-             * Allow (unsupported) native instructions to pass 
-             * through. Call the address where the native 
-             * instructions start and let vm_passthru macro 
-             * return back here when completed.
-             */
-            ((PASSTHRU)(&m_vcode[m_vpc + 5]))();                                    // Call handler with location of the code.
-            m_vpc += 6 + *(IMM32 *)&m_vcode[m_vpc + 1];                             // Move program counter size of native instructions + vm_passthru and vm_passend.
-            break;
-
-        default:
-            panic(ERR_OPCODE_INVALID);                                              // Invalid instruction! Panic!
-            break;
+    /*
+     * Return the decoded instruction pointed to by the program counter.
+     */
+    return m_vip;
+}
+
+bool VM::execute(const OPCODE opcode) {
+#define VM_HANDLER(op) case op:
+#define VM_HANDLER_DEFAULT default:
+#define VM_NEXT() break
+#define VM_HALT() return false
+
+    switch (opcode) {
+#include "handlers.inc"
     }
 
+#undef VM_HANDLER
+#undef VM_HANDLER_DEFAULT
+#undef VM_NEXT
+#undef VM_HALT
+
     /*
      * Default exit return value.
      * Returns true to continue emulation.
@@ -496,52 +324,329 @@ bool VM::execute(const OPCODE opcode) {
     return true;
 }
 
-uint32_t VM::loop(void) {
+#if VM_DISPATCH == VM_DISPATCH_TAILCALL
+
+#if defined(__has_cpp_attribute) && __has_cpp_attribute(clang::musttail)
+#define VM_MUSTTAIL [[clang::musttail]]
+#else
+#define VM_MUSTTAIL
+#endif
+
+#define VM_HANDLER(op) bool VM::h_##op(void)
+#define VM_HANDLER_DEFAULT bool VM::h_invalid(void)
+#define VM_NEXT() VM_MUSTTAIL return (this->*fetch()->handler)()
+#define VM_HALT() return false
+
+#include "handlers.inc"
+
+#undef VM_HANDLER
+#undef VM_HANDLER_DEFAULT
+#undef VM_NEXT
+#undef VM_HALT
+
+constexpr std::array<vhandler, 256> VM::make_handlers(void) {
+    std::array<vhandler, 256> handlers {};
+
+    for (auto& handler : handlers)
+        handler = &VM::h_invalid;
+
+#define X(op) handlers[op] = &VM::h_##op;
+    VM_OPCODE_LIST(X)
+#undef X
+
+    return handlers;
+}
+
+const std::array<vhandler, 256> VM::s_handlers = VM::make_handlers();
+
+#endif
+
+void VM::dispatch(void) {
+#if VM_DISPATCH == VM_DISPATCH_GOTO
+    /*
+     * Build the direct-threaded label table. Every handler jumps 
+     * straight to the handler of the next instruction so each 
+     * opcode gets its own indirect branch.
+     */
+    if (!m_vbound) {
+        void *labels[256];
+
+        for (int i = 0; i < 256; i++)
+            labels[i] = &&op_invalid;
+
+#define X(op) labels[op] = &&op_##op;
+        VM_OPCODE_LIST(X)
+#undef X
+
+        /*
+         * Store the handler address in each decoded instruction so 
+         * dispatch is a single indirect jump.
+         */
+        for (auto& insn : m_vstream.insns)
+            insn.handler = labels[insn.opcode];
+        m_vbound = true;
+    }
+
+#define VM_HANDLER(op) op_##op:
+#define VM_HANDLER_DEFAULT op_invalid:
+#define VM_NEXT() goto *fetch()->handler
+#define VM_HALT() goto halt
+
+    VM_NEXT();
+
+#include "handlers.inc"
+
+#undef VM_HANDLER
+#undef VM_HANDLER_DEFAULT
+#undef VM_NEXT
+#undef VM_HALT
+
+halt:
+    return;
+#elif VM_DISPATCH == VM_DISPATCH_TAILCALL
+    /*
+     * Enter the handler chain. Handlers tail call each other until 
+     * one of them halts.
+     */
+    (this->*fetch()->handler)();
+#else
     /*
      * Loop fetch and execute until halted.
      */
-    while (execute(fetch()));
+    while (execute(fetch()->opcode));
+#endif
+}
 
+vstatus VM::loop(const int64_t budget) {
     /*
-     * Return the value in vreg[0] containing exit status.
+     * Panics and accesses past the data section limit (sent back by 
+     * the SIGSEGV handler of the data section) return here. The signal 
+     * mask is not saved, the handler unblocks SIGSEGV itself.
      */
-    return m_vreg[0];
+    sigjmp_buf fault;
+
+    if (const int code = sigsetjmp(fault, 0)) {
+        m_vdata.leave();
+        m_vdata.sync();
+#ifdef VM_SAMPLE
+        Sampler::running(nullptr);
+#endif
+#ifdef VM_PROFILE
+        if (m_vprofile)
+            m_vprofile->end();
+#endif
+        m_vfault = nullptr;
+        m_vpc = vpc();
+        m_vstatus = VSTATUS_TRAPPED;
+
+        /*
+         * Record the fault. Sentinels past the code section have no 
+         * opcode of their own in m_vcode.
+         */
+        m_vtrap.error = code;
+        m_vtrap.vpc = m_vpc;
+        m_vtrap.opcode = m_vpc < m_vstream.vsize ? m_vcode[m_vpc] : m_vip->opcode;
+
+#ifdef VM_TRACE
+        if (m_vtrace && !m_vtrace->end(m_vtrap.error, m_vreg[0]))
+            m_vtrap.error = ERR_TRACE_DIVERGED;
+#endif
+
+        if (m_vexit)
+            exit(code);
+
+        return m_vstatus;
+    }
+
+    m_vbudget = budget;
+
+    m_vtrap = {};
+    m_vfault = &fault;
+    m_vdata.enter(&fault);
+
+#ifdef VM_VERIFIED
+    /*
+     * The handlers skip the checks the verifier proves redundant, so a 
+     * program that did not verify traps at the offending instruction.
+     */
+    if (!verified()) {
+        m_vip = branch(m_vprogram->verification().vpc);
+        panic(ERR_PROGRAM_UNVERIFIED);
+    }
+#endif
+#ifdef VM_SAMPLE
+    Sampler::running(this);
+#endif
+    dispatch();
+#ifdef VM_SAMPLE
+    Sampler::running(nullptr);
+#endif
+    m_vdata.leave();
+    m_vdata.sync();
+    m_vfault = nullptr;
+
+#ifdef VM_PROFILE
+    if (m_vprofile)
+        m_vprofile->end();
+#endif
+
+    m_vpc = vpc();
+
+    /*
+     * Handlers only stop with budget left on VM_HLT.
+     */
+    if (m_vbudget <= 0)
+        return m_vstatus = VSTATUS_YIELDED;
+
+    m_vstatus = VSTATUS_HALTED;
+
+#ifdef VM_TRACE
+    if (m_vtrace && !m_vtrace->end(m_vtrap.error, m_vreg[0])) {
+        m_vtrap.error = ERR_TRACE_DIVERGED;
+        m_vstatus = VSTATUS_TRAPPED;
+    }
+#endif
+
+    return m_vstatus;
+}
+
+vstatus VM::run(const uint64_t budget) {
+    if (m_vstatus != VSTATUS_YIELDED || budget == 0)
+        return m_vstatus;
+
+    return loop(budget < (uint64_t)VM_BUDGET_UNLIMITED ? (int64_t)budget : VM_BUDGET_UNLIMITED);
+}
+
+void VM::prepare(const std::vector<uint8_t>& data) {
+    prepare(data.data(), data.size());
 }
 
 uint32_t VM::start(const std::vector<uint8_t>& data) {
+    return start(data.data(), data.size());
+}
+
+void VM::reset(void) {
+    initialise();
+    decode();
+    m_vip = branch(0);
+}
+
+void VM::snapshot(void) {
+    /*
+     * Take the post-initialisation state if the VM never ran.
+     */
+    if (m_vip == nullptr)
+        reset();
+
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        m_vctx.vreg[i] = m_vreg[i];
+    for (int i = 0; i < NUM_VECTORS; i++)
+        m_vctx.vvec[i] = m_vvec[i];
+    m_vctx.vpc = m_vpc;
+    m_vctx.vsp = m_vsp;
+    m_vctx.veflags = m_vflags;
+
+    /*
+     * Slots above the stack pointer are never read, so only the live 
+     * part of the stack is saved.
+     */
+    m_vctx_stack.assign(m_vstack.begin(), m_vstack.begin() + m_vsp);
+
+    m_vdata.snapshot();
+    m_vsnapshot = true;
+}
+
+void VM::restore(void) {
+    if (!m_vsnapshot)
+        return;
+
+    for (int i = 0; i < NUM_REGISTERS; i++)
+        m_vreg[i] = m_vctx.vreg[i];
+    for (int i = 0; i < NUM_VECTORS; i++)
+        m_vvec[i] = m_vctx.vvec[i];
+    m_vpc = m_vctx.vpc;
+    m_vsp = m_vctx.vsp;
+    m_vflags = m_vctx.veflags;
+    m_vip = branch(m_vpc);
+
+    std::copy(m_vctx_stack.begin(), m_vctx_stack.end(), m_vstack.begin());
+
+    m_vdata.restore();
+}
+
+void VM::discard(void) {
+    m_vsnapshot = false;
+    m_vctx_stack.clear();
+    m_vdata.discard();
+}
+
+void VM::prepare(const uint8_t *data, const size_t length) {
 
 #ifdef DEBUG
     std::cout << "[*] Initialising VM...\n";
 #endif
 
     /*
-     * Initialise the VM and assign the set of instructions.
+     * Reset to the snapshot if there is one, which only rewrites what 
+     * the last run changed. Otherwise initialise the VM, decode the 
+     * code section once and start at its first instruction.
      */
-    initialise();
+    if (m_vsnapshot)
+        restore();
+    else
+        reset();
 
     /*
      * Copy data into virtual data section.
      */
-    for (size_t i = 0; i < data.size(); i++)
-        m_vdata[i] = data[i];
+    const size_t size = length < VM_DATA_LIMIT ? length : VM_DATA_LIMIT;
 
-    /*
-     * Point code to .text section that contains the virtualised 
-     * intructions and set size for code bounds checking.
-     */
-    m_vcode = &_vm_start;
-    m_vsize = _vm_size;
+    m_vdata.write(0, data, size);
+
+#ifdef VM_TRACE
+    if (m_vtrace)
+        m_vtrace->record(m_vstream, *m_vprogram, data, size);
+#endif
+
+#ifdef VM_PROFILE
+    if (m_vprofile)
+        m_vprofile->begin(m_vstream, m_vprogram);
+#endif
+
+    m_vstatus = VSTATUS_YIELDED;
+}
+
+void VM::prepare() {
+    if (m_vprogram->data_size() != 0)
+        prepare(m_vprogram->data(), m_vprogram->data_size());
+    else
+        prepare(nullptr, 0);
+}
+
+uint32_t VM::start(const uint8_t *data, const size_t length) {
+    prepare(data, length);
 
 #ifdef DEBUG
     std::cout << "[*] Starting VM execution cycle...\n";
 #endif
 
-    return loop();
+    loop(VM_BUDGET_UNLIMITED);
+
+    /*
+     * Return the value in vreg[0] containing exit status.
+     */
+    return m_vreg[0];
 }
 
 uint32_t VM::start() {
+    /*
+     * Start with the initial data of the program, if it has any.
+     */
+    if (m_vprogram->data_size() != 0)
+        return start(m_vprogram->data(), m_vprogram->data_size());
+
     /*
      * Start CPU loop cycle and return exit value.
      */
-    return VM::start(std::vector<uint8_t>{ 0 });
+    return start(nullptr, 0);
 }
\ No newline at end of file
@@ -18,43 +18,118 @@
  * m_code member of the VM class and then executed in a switch-case 
  * control statement.
  *
+ * The dispatch backend of the loop is selected at compile time with 
+ * VM_DISPATCH (see below). All backends share the handler bodies in 
+ * handlers.inc.
+ *
  * Registers:
  * The VM has 16 32-bit general purpose registers for use (m_vreg), 
  * a dedicated program counter register (m_pc). Return values will be 
- * stored in v_reg[0].
+ * stored in v_reg[0]. The vector opcodes add 16 256-bit registers 
+ * (m_vvec, see simd.h).
  *
  * EFLAGS:
- * EFLAGS is an 8-bit used to maintain the results of operations such as 
- * addition, subtraction or comparisons.
- * 
- * EFLAGS Layout:
- *   Z   C   O   S   D   R   R   R
- * +---+---+---+---+---+---+---+---+
- * | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 |
- * +---+---+---+---+---+---+---+---+  
+ * EFLAGS are evaluated lazily. Instructions that modify the flags 
+ * (VM_SUB, VM_SUBI, VM_CMP and VM_TEST) only record their operands and 
+ * result in m_vflags and each conditional jump computes the single 
+ * condition it tests from them (see vflags).
+ *
+ * The flags follow x86 semantics:
+ *   Z - result is zero.
+ *   C - unsigned borrow (first operand below the second).
+ *   O - signed overflow.
+ *   S - sign bit of the result.
  *
  * Code Section:
- * The code section is stored within the m_code member of the VM 
- * class with a predefined maximum size. This is allocated on the 
- * stack by default and can be modified to use the heap if necessary.
+ * The code section comes from an immutable Program (see program.h) 
+ * that is shared between VMs. By default this is the section linked 
+ * into the binary at _vm_start. Programs can also be loaded at runtime 
+ * from bytecode container files (see container.h).
+ *
+ * Reentrancy:
+ * All VM state, including the RC4 state of VM_RC4K/VM_RC4C, is held in 
+ * the instance, so separate VMs can run on separate threads at the same 
+ * time. A single VM must not be started on two threads at once. See 
+ * VMPool (pool.h) to run many jobs in parallel.
+ *
+ * Time Slicing:
+ * run() executes a VM for a budget of instructions and returns whether 
+ * it halted, trapped or yielded with the budget used up. All state 
+ * stays in the instance, so a yielded VM resumes where it stopped on 
+ * the next run(). The budget is charged once per basic block, when the 
+ * branch, call or return that ends it runs, with the length of the 
+ * block counted when decoding. Straight-line code pays nothing and a 
+ * slice may overrun the budget by the rest of its last block. 
+ * See Scheduler (scheduler.h) to round-robin many VMs on one thread.
  *
- * Data Section
- * 
- * TODO
- * 
- * 
+ * Data Section:
+ * The data section is a guest address space of up to VM_DATA_LIMIT 
+ * bytes (see mem.h). DATA_SECTION_SIZE bytes are committed when the VM 
+ * starts and the rest on first access. Accesses past the limit stop 
+ * the VM with ERR_DATA_OUT_OF_BOUNDS, unless they hit a caller buffer 
+ * or file bound above the limit (see bind).
  */
 
 #ifndef __VM_H__
 #define __VM_H__
 
+#include <array>
 #include <cstdint>
 #include <string>
 #include <vector>
 
+#include "opcodes.h"
+#include "simd.h"
+
 #define NUM_REGISTERS 16
 #define DATA_SECTION_SIZE 0x100
 
+/*
+ * Default capacity of the virtual stack in 32-bit slots.
+ */
+#ifndef VM_STACK_SIZE
+#define VM_STACK_SIZE 0x10000
+#endif
+
+/*
+ * Handler checks the verifier proves redundant (see verify.h). Builds 
+ * with -DVM_VERIFIED compile them out and only run programs that 
+ * verified.
+ */
+#ifdef VM_VERIFIED
+#define VM_CHECK(cond) false
+#else
+#define VM_CHECK(cond) (cond)
+#endif
+
+/*
+ * CPU loop dispatch backends.
+ *
+ * VM_DISPATCH_SWITCH    - fetch and execute through a single switch.
+ * VM_DISPATCH_GOTO      - direct-threaded computed goto table (GCC/Clang).
+ * VM_DISPATCH_TAILCALL  - table of handler functions that tail call the 
+ *                         next handler. Requires Clang's musttail to be 
+ *                         guaranteed, otherwise relies on optimisation 
+ *                         (-O2) to turn the calls into jumps.
+ *
+ * Select with -DVM_DISPATCH=VM_DISPATCH_XXX.
+ */
+#define VM_DISPATCH_SWITCH 0
+#define VM_DISPATCH_GOTO 1
+#define VM_DISPATCH_TAILCALL 2
+
+#ifndef VM_DISPATCH
+#if defined(__GNUC__)
+#define VM_DISPATCH VM_DISPATCH_GOTO
+#else
+#define VM_DISPATCH VM_DISPATCH_SWITCH
+#endif
+#endif
+
+#if VM_DISPATCH == VM_DISPATCH_GOTO && !defined(__GNUC__)
+#error "VM_DISPATCH_GOTO requires the GCC labels as values extension"
+#endif
+
 #define VM_REG(x) (x)
 
 /*
@@ -99,42 +174,191 @@ extern OPCODE _vm_start;
 extern uint32_t _vm_size;
 
 /*
- * EFLAGS struct using bit fields for each flag.
- * Don't typedef to 'veflags' because of name conflict.
+ * Lazily evaluated EFLAGS.
+ *
+ * Every flag writer is recorded as the subtraction res = dst - src: 
+ * VM_SUB, VM_SUBI and VM_CMP record their operands and VM_TEST records 
+ * its result minus zero, which clears carry and overflow like x86 does. 
+ * All conditions are therefore plain comparisons of the operands.
  */
-struct _veflags {
-	uint8_t zero : 1;			// Zero flag.
-	uint8_t carry : 1;			// Carry flag.
-	uint8_t overflow : 1;		// Overflow flag.
-	uint8_t sign : 1;			// Sign flag.
-	uint8_t direction : 1;		// Direction flag.
-	uint8_t res0 : 1;			// Reserved.
-	uint8_t res1 : 1;			// Reserved.
-	uint8_t res2 : 1;			// Reserved.
-};
+typedef struct _vflags {
+	REG dst;					// First operand.
+	REG src;					// Second operand.
+	REG res;					// Result (dst - src).
+
+	/*
+	 * Record a subtraction and return its result.
+	 */
+	REG sub(const REG a, const REG b) {
+		dst = a;
+		src = b;
+		res = a - b;
+		return res;
+	}
+
+	/*
+	 * Record a logical compare of the result of an AND.
+	 */
+	void test(const REG r) {
+		dst = r;
+		src = 0;
+		res = r;
+	}
+
+	/*
+	 * Clear all flags.
+	 */
+	void clear() {
+		test(1);
+	}
+
+	bool zero() const { return res == 0; }
+	bool carry() const { return dst < src; }
+	bool sign() const { return (int32_t)res < 0; }
+	bool overflow() const { return (int32_t)((dst ^ src) & (dst ^ res)) < 0; }
+
+	/*
+	 * Compound conditions (sign != overflow, carry || zero, ...).
+	 */
+	bool less() const { return (int32_t)dst < (int32_t)src; }
+	bool less_equal() const { return (int32_t)dst <= (int32_t)src; }
+	bool below_equal() const { return dst <= src; }
+} vflags;
 
 /*
  * Context structure to save the state of the VM.
  */
 typedef struct _vcontext {
 	REG vreg[NUM_REGISTERS];
+	VEC vvec[NUM_VECTORS];
 	REG vpc;
 	REG vsp;
-	struct _veflags veflags;
+	vflags veflags;
 } vcontext;
 
+/*
+ * Outcome of a time slice (see VM::run).
+ */
+enum vstatus {
+	VSTATUS_HALTED,				// Reached VM_HLT.
+	VSTATUS_YIELDED,			// Used up its budget, run() resumes it.
+	VSTATUS_TRAPPED				// Panicked, trap() holds the fault.
+};
+
+/*
+ * Fault that stopped a run (see VM::trap). All fields are 0 if the run 
+ * did not trap.
+ */
+typedef struct _vtrap {
+	uint32_t error;				// Panic code.
+	REG vpc;					// Code offset of the faulting instruction.
+	OPCODE opcode;				// Opcode at vpc, VM_FAULT past the code section.
+} vtrap;
+
+/*
+ * Budget of a run that is never cut short.
+ */
+#define VM_BUDGET_UNLIMITED INT64_MAX
+
+class VM;
+
+/*
+ * Handler reference stored in each decoded instruction. This is the 
+ * label address for the computed goto backend and the handler member 
+ * function for the tail call backend. Unused by the switch backend.
+ */
+#if VM_DISPATCH == VM_DISPATCH_TAILCALL
+typedef bool (VM::*vhandler)(void);
+#else
+typedef const void *vhandler;
+#endif
+
+/*
+ * Decoded instruction.
+ *
+ * The code section is decoded once into a fixed-width array of these 
+ * so that handlers never decode operand bytes or perform unaligned 
+ * immediate loads. Branch targets are resolved to indices in the 
+ * decoded array.
+ */
+typedef struct alignas(16) _vinsn {
+	vhandler handler;			// Backend handler.
+	OPCODE opcode;				// Opcode.
+	uint8_t ra;					// First operand byte (register or 8-bit address).
+	uint8_t rb;					// Second operand byte (register or 8-bit address).
+	uint8_t rc;					// Third operand byte (VM_RC4C key address or register).
+	IMM32 imm;					// Immediate (return address for VM_CALL/VM_RCALL, VM_AESCTR, VM_MEMCMP and VM_MEMCHR fourth register).
+	uint32_t target;			// Decoded index of the branch target (VM_RC4M key length and count).
+	uint32_t cost;				// Instructions of the basic block ended by a branch, call or return.
+} vinsn;
+
+/*
+ * Decoded code section.
+ *
+ * insns holds one entry per instruction found by a linear sweep of the 
+ * code section, followed by two VM_FAULT sentinels: one reached by 
+ * running off the end of the code (or branching past it) and one for 
+ * branches into the middle of an instruction.
+ */
+typedef struct _vstream {
+	std::vector<vinsn> insns;		// Decoded instructions.
+	std::vector<uint32_t> vaddr;	// Decoded index to code offset.
+	std::vector<uint32_t> vindex;	// Code offset to decoded index.
+	uint32_t vsize;					// Size of the decoded code section.
+
+	/*
+	 * Resolve a code offset to a decoded index.
+	 */
+	uint32_t index(const REG vpc) const {
+		return vpc <= vsize ? vindex[vpc] : vindex[vsize];
+	}
+} vstream;
+
+#include "jit.h"
+#include "fuse.h"
+#include "verify.h"
+#include "mem.h"
+#include "program.h"
+#include "profile.h"
+#include "sample.h"
+#include "trace.h"
+#include "rc4.h"
+#include "crypto.h"
+#include "bulk.h"
+
 class VM {
+	/*
+	 * Runs lanes on the state and handlers of their VMs.
+	 */
+	friend class VMLanes;
+
 	private:
 	/*
 	 * 16 general purpose virtual registers.
 	 */
 	REG m_vreg[NUM_REGISTERS];
+
+	/*
+	 * 16 virtual vector registers.
+	 */
+	VEC m_vvec[NUM_VECTORS];
 	
 	/*
 	 * Virtual program counter to track current instruction in code section.
+	 * Only synchronised with m_vip when the VM stops or panics.
 	 */
 	REG m_vpc;
 
+	/*
+	 * Pointer to the current instruction in the decoded stream.
+	 */
+	const vinsn *m_vip = nullptr;
+
+	/*
+	 * Base of the decoded stream.
+	 */
+	const vinsn *m_vinsns;
+
 	/*
 	 * Virtual stack pointer to track the current top stack position.
 	 */
@@ -143,44 +367,130 @@ class VM {
 	/*
 	 * Virtual EFLAGS for tracking state of instruction operations.
 	 */
-	struct _veflags m_veflags;
+	vflags m_vflags;
 	
 	/*
-	 * Virtual code section to hold set of instructions.
+	 * Program being run.
+	 */
+	std::shared_ptr<const Program> m_vprogram;
+
+	/*
+	 * Virtual code section of the program.
+	 */
+	const OPCODE *m_vcode = nullptr;
+
+	/*
+	 * Decoded code section. A copy of the program's stream with this 
+	 * VM's fusions, JIT leaders and handlers applied.
+	 */
+	vstream m_vstream;
+
+	/*
+	 * Whether the decoded handlers have been bound to this backend.
+	 */
+	bool m_vbound = false;
+
+#ifdef VM_JIT
+	/*
+	 * Baseline JIT for hot basic blocks.
+	 */
+	JIT m_jit;
+#endif
+
+#ifdef VM_PROFILE
+	/*
+	 * Profile recording the dispatched instructions or null.
+	 */
+	Profile *m_vprofile = nullptr;
+#endif
+
+#ifdef VM_TRACE
+	/*
+	 * Trace recording or replaying the run or null.
 	 */
-	//std::vector<OPCODE> m_vcode;
-	OPCODE *m_vcode;
+	Trace *m_vtrace = nullptr;
+#endif
 
 	/*
-	 * Size of the code section.
+	 * Superinstruction fusion patterns applied when decoding.
 	 */
-	uint32_t m_vsize;
+	std::vector<vfusion> m_vfusions = default_fusions();
 
 	/*
-	 * Virtual stack section.
+	 * Virtual stack section. Allocated once with a fixed capacity and 
+	 * written at m_vsp, so pushes never allocate.
 	 */
 	std::vector<uint32_t> m_vstack;
 
 	/*
-	 * Virtual context to save state of VM.
+	 * Capacity of the virtual stack in 32-bit slots.
+	 */
+	uint32_t m_vstack_size = VM_STACK_SIZE;
+
+	/*
+	 * Virtual context to save state of VM. Holds the snapshot taken 
+	 * by snapshot(), together with the live part of the stack.
 	 */
 	vcontext m_vctx;
+	std::vector<uint32_t> m_vctx_stack;
+
+	/*
+	 * Whether m_vctx holds a snapshot.
+	 */
+	bool m_vsnapshot = false;
 	
 	/*
 	 * VM passthru function pointer to handle unsupported instructions.
 	 */
 	void (*m_passthru)(void);
 
+	/*
+	 * RC4 state for VM_RC4K and VM_RC4C.
+	 */
+	RC4 m_rc4;
+
+	/*
+	 * AES key schedule for VM_AESK and the AES opcodes.
+	 */
+	AES m_aes;
+
+	/*
+	 * Jump buffer of the running loop, taken on panic.
+	 */
+	sigjmp_buf *m_vfault = nullptr;
+
+	/*
+	 * Fault of the last run, zeroed if it did not trap.
+	 */
+	vtrap m_vtrap = {};
+
+	/*
+	 * Whether a panic exits the process.
+	 */
+	bool m_vexit = false;
+
+	/*
+	 * Instructions left in the current time slice.
+	 */
+	int64_t m_vbudget = 0;
+
+	/*
+	 * Outcome of the last time slice. VSTATUS_YIELDED while a run is 
+	 * in progress.
+	 */
+	vstatus m_vstatus = VSTATUS_HALTED;
+
 	/* 
 	 * Panic if an unexpected error occured.
-	 * Exit process with specified code.
+	 * Stops the loop with the specified code and records the trap. 
+	 * Only exits the process if enabled with set_exit_on_panic.
 	 */
-	void panic(const uint32_t code);
+	[[noreturn]] void panic(const uint32_t code);
 
 	/*
 	 * Wrapper on panic to include custom output string.
 	 */
-	void panic(const uint32_t code, const std::string& msg);
+	[[noreturn]] void panic(const uint32_t code, const std::string& msg);
 	
 	/*
 	 * Initialises the VM class.  
@@ -189,25 +499,274 @@ class VM {
 	void initialise();
 
 	/*
-	 * Fetches an instruction from the code section.
+	 * Decodes the code section into m_vstream if it has not been 
+	 * decoded already.
+	 */
+	void decode();
+
+	/*
+	 * Returns whether the program verified with a maximum stack depth 
+	 * that fits the allocated stack, which VM_VERIFIED builds require.
+	 */
+	bool verified() const {
+		const vverify& verify = m_vprogram->verification();
+
+		return verify.error == 0 && verify.stack <= m_vstack.size();
+	}
+
+	/*
+	 * Fetches the current instruction from the decoded stream.
 	 */
-	OPCODE fetch();
+	const vinsn *fetch();
 
 	/*
-	 * Executes a given instruction.
+	 * Executes the current instruction with the given opcode.
 	 */
 	bool execute(const OPCODE opcode);
 
 	/*
-	 * CPU fetch and execute loop.
+	 * Returns the decoded instruction at a code offset.
 	 */
-	uint32_t loop();
+	const vinsn *branch(const REG vpc) const {
+		return m_vinsns + m_vstream.index(vpc);
+	}
+
+	/*
+	 * Continue at next after a branch, call or return. Charges the 
+	 * basic block it ends to the budget and returns true if the budget 
+	 * is used up.
+	 */
+	bool jump(const vinsn *next) {
+		m_vbudget -= m_vip->cost;
+		m_vip = next;
+		return m_vbudget <= 0;
+	}
+
+	/*
+	 * Returns the code offset of the current instruction.
+	 */
+	REG vpc() const {
+		return m_vstream.vaddr[m_vip - m_vinsns];
+	}
+
+	/*
+	 * Fetch and execute instructions until halted with the selected 
+	 * dispatch backend.
+	 */
+	void dispatch();
+
+	/*
+	 * CPU fetch and execute loop. Runs until the VM halts, panics or 
+	 * has used up budget instructions.
+	 */
+	vstatus loop(const int64_t budget);
+
+
+#if VM_DISPATCH == VM_DISPATCH_TAILCALL
+	/*
+	 * Tail-calling opcode handlers. Each handler executes its 
+	 * instruction and tail calls the handler of the next one.
+	 */
+#define X(op) bool h_##op(void);
+	VM_OPCODE_LIST(X)
+#undef X
+	bool h_invalid(void);
+
+	/*
+	 * Handler table indexed by opcode.
+	 */
+	static constexpr std::array<vhandler, 256> make_handlers();
+	static const std::array<vhandler, 256> s_handlers;
+#endif
 
 	public:
+	/*
+	 * Run the program linked into the binary.
+	 */
+	VM();
+
+	/*
+	 * Run the given program.
+	 */
+	explicit VM(std::shared_ptr<const Program> program);
+
+	VM(const VM&) = delete;
+	VM& operator=(const VM&) = delete;
+
 	/*
 	 * Publically accessible virtual data section.
 	 */
-	std::vector<uint8_t> m_vdata;
+	Memory m_vdata;
+
+	/*
+	 * Replace the superinstruction fusion patterns. Must be called 
+	 * before the VM is started. An empty table disables fusion.
+	 */
+	void set_fusions(const std::vector<vfusion>& fusions);
+
+#ifdef VM_PROFILE
+	/*
+	 * Record the following runs into a profile, or stop recording with 
+	 * null. The profile must outlive the runs.
+	 */
+	void set_profile(Profile *profile);
+#endif
+
+#ifdef VM_SAMPLE
+	/*
+	 * Record the current code offset and the call stack recovered from 
+	 * the return addresses on the virtual stack. Called by the SIGPROF 
+	 * handler of Sampler while the VM runs on the same thread.
+	 */
+	void sample(vsample& sample) const;
+#endif
+
+#ifdef VM_TRACE
+	/*
+	 * Record the following runs into a trace, or stop recording with 
+	 * null. Each run replaces the previous one in the trace. The trace 
+	 * must outlive the runs.
+	 */
+	void set_trace(Trace *trace);
+
+	/*
+	 * Run a recorded trace again from the initial state and return the 
+	 * value in vreg[0]. The VM is reset first, dropping any snapshot, 
+	 * and a panic never exits the process. error() is 
+	 * ERR_TRACE_DIVERGED if the run left the recorded path. Throws 
+	 * std::runtime_error if the trace is of another program.
+	 */
+	uint32_t replay(Trace& trace);
+#endif
+
+	/*
+	 * Set the capacity of the virtual stack in 32-bit slots. Takes 
+	 * effect the next time the VM is started.
+	 */
+	void set_stack_size(const uint32_t size);
+
+	/*
+	 * Replace the program. Takes effect the next time the VM is 
+	 * started.
+	 */
+	void load(std::shared_ptr<const Program> program);
+
+	/*
+	 * Map a bytecode container file and load its program (see 
+	 * Program::open). Throws std::runtime_error on failure.
+	 */
+	void load(const std::string& path);
+
+	/*
+	 * Returns the loaded program.
+	 */
+	const std::shared_ptr<const Program>& program() const {
+		return m_vprogram;
+	}
+
+	/*
+	 * Whether a panic exits the process with the panic code. Disabled 
+	 * by default: start returns on panic and trap() holds the fault, 
+	 * so a bad guest program never takes down its host.
+	 */
+	void set_exit_on_panic(const bool exit);
+
+	/*
+	 * Returns the error code of the last run or 0 if it did not trap.
+	 */
+	uint32_t error() const {
+		return m_vtrap.error;
+	}
+
+	/*
+	 * Returns the fault that stopped the last run. For native JIT 
+	 * blocks, vpc is the start of the block.
+	 */
+	const vtrap& trap() const {
+		return m_vtrap;
+	}
+
+	/*
+	 * Save the registers, stack and data section. While a snapshot is 
+	 * held, start() restores it instead of initialising the VM, which 
+	 * only rewrites the data pages the last run wrote to. Execution 
+	 * resumes at the program counter of the snapshot. A VM that never 
+	 * ran is initialised first, so a snapshot taken before the first 
+	 * start (or after reset) is the post-initialisation state. The 
+	 * decoded stream and JIT code are kept either way.
+	 */
+	void snapshot();
+
+	/*
+	 * Initialise the VM to the state start() runs from without running 
+	 * it. Drops the snapshot.
+	 */
+	void reset();
+
+	/*
+	 * Return to the snapshot, if any.
+	 */
+	void restore();
+
+	/*
+	 * Drop the snapshot. The next start() initialises the VM again.
+	 */
+	void discard();
+
+	/*
+	 * Bind a caller buffer or a file into the guest address space at a 
+	 * page aligned address at or above VM_DATA_LIMIT, where programs 
+	 * read it in place instead of from a copy in the data section (see 
+	 * Memory::bind). Bindings stay in place across runs. Writes to a 
+	 * read-only binding stop the VM with ERR_DATA_READ_ONLY. Return 
+	 * false if the range or file cannot be bound.
+	 */
+	bool bind(const REG addr, const void *buffer, const size_t length);
+	bool bind(const REG addr, void *buffer, const size_t length, const bool writable);
+	bool bind(const REG addr, const std::string& path, const bool writable = false);
+
+	/*
+	 * Remove the binding at a guest address, or all of them.
+	 */
+	void unbind(const REG addr);
+	void unbind();
+
+	/*
+	 * Returns the outcome of the last time slice.
+	 */
+	vstatus status() const {
+		return m_vstatus;
+	}
+
+	/*
+	 * Returns the value in vreg[0], the exit value once the VM halted.
+	 */
+	uint32_t value() const {
+		return m_vreg[0];
+	}
+
+	/*
+	 * Set up a run like start() does without executing anything. The 
+	 * VM is left yielded at its first instruction, ready for run().
+	 */
+	void prepare(const uint8_t *data, const size_t length);
+	void prepare(const std::vector<uint8_t>& data);
+	void prepare();
+
+	/*
+	 * Execute a prepared or yielded VM for about budget instructions 
+	 * and return the outcome. A yielded VM resumes on the next call, 
+	 * other outcomes are returned again until the next prepare(). A 
+	 * zero budget returns without executing. A panic returns 
+	 * VSTATUS_TRAPPED (see trap).
+	 */
+	vstatus run(const uint64_t budget);
+
+	/*
+	 * Start VM execution with length bytes of data copied into the 
+	 * data section.
+	 */
+	uint32_t start(const uint8_t *data, const size_t length);
 
 	/*
 	 * Start VM execution with predefined data.
@@ -215,7 +774,7 @@ class VM {
 	uint32_t start(const std::vector<uint8_t>& data);
 
 	/*
-	 * Start VM execution.
+	 * Start VM execution with the initial data of the program.
 	 */
 	uint32_t start();
 };